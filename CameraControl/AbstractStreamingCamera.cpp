@@ -2,30 +2,30 @@
 #include "ImageBuffer.h"
 #include <QOpenGLBuffer>
 #include <QTimer>
-
-#ifdef USE_CUDA
-#include <cuda.h>
-#include <cuda_runtime.h>
-#endif
+#include <chrono>
+#include <algorithm>
 
 using std::vector;
 using std::shared_ptr;
+using std::mutex;
+using std::unique_lock;
+using std::lock_guard;
 
 
 AbstractStreamingCamera::AbstractStreamingCamera(QObject* parent) :
    is_init(false), 
-   allocation_idx(0),
    terminate(false)
 {
    if (parent != nullptr)
       connect(parent, &QObject::destroyed, this, &QObject::deleteLater);
 
-   m = new QMutex();
-   buffer_mutex = new QMutex(QMutex::Recursive);
-   next_mutex = new QMutex();
    latest_data = shared_ptr<ImageBuffer>(new ImageBuffer());
 
-   control_mutex = new QMutex(QMutex::Recursive);
+#ifdef USE_CUDA
+   allocator = CreateBufferAllocator("cuda");
+#else
+   allocator = CreateBufferAllocator("malloc");
+#endif
 };
 
 AbstractStreamingCamera::~AbstractStreamingCamera()
@@ -34,31 +34,105 @@ AbstractStreamingCamera::~AbstractStreamingCamera()
    FreeBuffers();
 }
 
+/*
+   Free all buffers. Buffers still held by an ImageBuffer are retired
+   instead, and freed when they are released, so that in-flight frames
+   stay valid.
+*/
 void AbstractStreamingCamera::FreeBuffers()
 {
-   QMutexLocker lk(m);
-   QMutexLocker lkb(buffer_mutex);
-   is_init = false;
-   allocation_idx++;
-   latest_data = shared_ptr<ImageBuffer>(new ImageBuffer());
-   for( auto buffer : buffers)
-      FreeMemory(buffer);
-   buffers.clear();
+   {
+      QMutexLocker lkb(&buffer_mutex);
+      is_init = false;
+      for (auto buffer : buffers)
+      {
+         if (in_flight_buffers.count(buffer))
+            retired_buffers[buffer] = std::make_pair(buffers_allocator, allocated_buffer_size);
+         else
+            buffers_allocator->Free(buffer, allocated_buffer_size);
+      }
+      buffers.clear();
+      unused_buffers.clear();
+      capture_buffers.clear();
+      FreeSurplusBuffers();
+   }
+
+   // Only drop the latest frame once its buffer has been retired, so that
+   // releasing it frees the buffer rather than requeueing it with the camera
+   std::atomic_store(&latest_data, shared_ptr<ImageBuffer>(new ImageBuffer()));
 };
 
+/*
+   Add n buffers for a capture, queued with the camera like the others
+*/
+void AbstractStreamingCamera::AddCaptureBuffers(int n)
+{
+   QMutexLocker lk(&buffer_mutex);
+
+   if (buffers.empty())
+      return;
+
+   for (int i = 0; i < n; i++)
+   {
+      unsigned char* ptr = static_cast<unsigned char*>(buffers_allocator->Allocate(allocated_buffer_size));
+      buffers.push_back(ptr);
+      capture_buffers.push_back(ptr);
+
+      QueuePointerWithCamera(ptr);
+      unused_buffers.push_back(ptr);
+   }
+}
+
+/*
+   Stop using the capture buffers. They may still be queued with the 
+   camera, so they are only freed after the next flush
+*/
+void AbstractStreamingCamera::RemoveCaptureBuffers()
+{
+   QMutexLocker lk(&buffer_mutex);
+
+   for (auto ptr : capture_buffers)
+   {
+      buffers.erase(std::find(buffers.begin(), buffers.end(), ptr));
+      unused_buffers.remove(ptr);
+      surplus_buffers.push_back(ptr);
+   }
+   capture_buffers.clear();
+}
+
+/*
+   Should be called with buffer_mutex held, once the camera has been flushed
+*/
+void AbstractStreamingCamera::FreeSurplusBuffers()
+{
+   for (auto ptr : surplus_buffers)
+   {
+      if (in_flight_buffers.count(ptr))
+         retired_buffers[ptr] = std::make_pair(buffers_allocator, allocated_buffer_size);
+      else
+         buffers_allocator->Free(ptr, allocated_buffer_size);
+   }
+   surplus_buffers.clear();
+}
+
+/*
+   The latest frame is swapped atomically, so neither the acquisition
+   thread nor consumers ever wait for each other to get at it
+*/
 shared_ptr<ImageBuffer> AbstractStreamingCamera::GetLatest()
 {
-   QMutexLocker lk(m);
-   return latest_data;
+   return std::atomic_load(&latest_data);
 };
 
 shared_ptr<ImageBuffer> AbstractStreamingCamera::GetNext()
 {
-   QMutexLocker next_lk(next_mutex);
-   next_cv.wait(next_mutex, 10000);
+   {
+      unique_lock<mutex> lk(next_mutex);
+      uint64_t n = n_delivered;
+      next_cv.wait_for(lk, std::chrono::seconds(10), [&] { return n_delivered != n; });
+   }
 
-   QMutexLocker lk(m);
-   return latest_data;
+   return std::atomic_load(&latest_data);
 };
 
 cv::Mat AbstractStreamingCamera::GetImage()
@@ -85,12 +159,41 @@ cv::Mat AbstractStreamingCamera::GetNextImage()
 }
 
 
+/*
+   Requeue every idle buffer with the camera, sliced to the current image
+   size. Called when the ROI or pixel format changes; buffers are only
+   reallocated if the new image is bigger than they can hold. Buffers held
+   by an ImageBuffer are requeued, at the new size, when they are released.
+*/
 void AbstractStreamingCamera::QueueAllBuffers()
 {
+   int required_size = GetImageSizeBytes();
+
+   bool reallocate;
+   int new_size;
+   {
+      QMutexLocker lk(&buffer_mutex);
+      reallocate = (required_size > max_buffer_size) || (!buffers.empty() && allocator != buffers_allocator);
+      new_size = std::max(required_size, max_buffer_size);
+   }
+   if (reallocate)
+      AllocateBuffers(new_size);
+
+   QMutexLocker lk(&buffer_mutex);
+
    FlushBuffers();
-   buffer_size = GetImageSizeBytes();
+   FreeSurplusBuffers();
+   buffer_size = required_size;
+
+   unused_buffers.clear();
    for (auto buffer : buffers)
-      QueuePointer(buffer);
+   {
+      if (in_flight_buffers.count(buffer) == 0)
+      {
+         QueuePointerWithCamera(buffer);
+         unused_buffers.push_back(buffer);
+      }
+   }
 }
 
 /*
@@ -99,68 +202,78 @@ void AbstractStreamingCamera::QueueAllBuffers()
 */
 void AbstractStreamingCamera::QueuePointer(unsigned char* ptr)
 {
+   QMutexLocker lk(&buffer_mutex);
+
+   in_flight_buffers.erase(ptr);
+
+   auto retired = retired_buffers.find(ptr);
+   if (retired != retired_buffers.end())
+   {
+      retired->second.first->Free(ptr, retired->second.second);
+      retired_buffers.erase(retired);
+      return;
+   }
+
+   if (std::find(buffers.begin(), buffers.end(), ptr) == buffers.end())
+      return;
+
    QueuePointerWithCamera(ptr);
-   
-   QMutexLocker lk(buffer_mutex);
    unused_buffers.push_back(ptr);
 }
 
-/*
-   Wrapper for memory allocation, use cuda pinned memory if possible,
-   otherwise just malloc
-*/
-void AbstractStreamingCamera::AllocateMemory(void** ptr, int size)
+void AbstractStreamingCamera::SetBufferAllocator(shared_ptr<BufferAllocator> allocator_)
 {
-#ifdef USE_CUDA
-   CHECK(cudaMallocHost(ptr, size, cudaHostAllocMapped)); 
-#else
-   *ptr = malloc(size);
-#endif
+   bool reallocate;
+   {
+      QMutexLocker lkb(&buffer_mutex);
+      allocator = allocator_ ? allocator_ : CreateBufferAllocator("malloc");
+      reallocate = !buffers.empty();
+   }
+
+   // Otherwise the buffers are replaced when streaming stops
+   if (reallocate && !is_streaming)
+      runCommand([this]() { QueueAllBuffers(); });
 }
 
-/*
-   Wrapper for memory free
-*/
-void AbstractStreamingCamera::FreeMemory(void* ptr)
+shared_ptr<BufferAllocator> AbstractStreamingCamera::GetBufferAllocator()
 {
-#ifdef USE_CUDA
-   CHECK(cudaFreeHost(ptr));
-#else
-   free(ptr);
-#endif
+   QMutexLocker lkb(&buffer_mutex);
+   return allocator;
 }
 
-void AbstractStreamingCamera::AllocateBuffers(int buffer_size_) 
+/*
+   Allocate buffers big enough for the largest image the camera can
+   produce, so that ROI changes only need QueueAllBuffers. Existing
+   buffers are kept if they are already big enough.
+*/
+void AbstractStreamingCamera::AllocateBuffers(int max_buffer_size_) 
 {
-   buffer_size = buffer_size_;
-   max_buffer_size = buffer_size;
-
-   // Don't allocate if the current buffers are good enough
-   if (buffer_size < buffer_size_ || buffers.size() == 0)
    {
-      QMutexLocker lk(m);
-      latest_data = shared_ptr<ImageBuffer>( new ImageBuffer() );
-      lk.unlock();
+      QMutexLocker lkb(&buffer_mutex);
+      if (!buffers.empty() && max_buffer_size_ <= max_buffer_size && buffers_allocator == allocator)
+      {
+         is_init = true;
+         return;
+      }
+   }
 
-      QMutexLocker lkb(buffer_mutex);
+   FlushBuffers();
+   FreeBuffers();
 
-      FlushBuffers();
-      FreeBuffers();
+   QMutexLocker lkb(&buffer_mutex);
 
+   buffers_allocator = allocator;
+   max_buffer_size = max_buffer_size_;
+   allocated_buffer_size = max_buffer_size;
+   buffer_size = max_buffer_size;
 
-      // buffer_size should be big enough for float
-      AllocateMemory(reinterpret_cast<void**>(&background_ptr), buffer_size);
-      
-      for(int i=0; i<n_buffers; i++)
-      {
-         void* ptr;
-         AllocateMemory(&ptr, buffer_size);
+   for(int i=0; i<n_buffers; i++)
+   {
+      void* ptr = buffers_allocator->Allocate(allocated_buffer_size);
 
-         unsigned char* u8_ptr = static_cast<unsigned char*>(ptr);
-         buffers.push_back(u8_ptr);
-         unused_buffers.push_back(u8_ptr);
-      }
-      allocation_idx++;
+      unsigned char* u8_ptr = static_cast<unsigned char*>(ptr);
+      buffers.push_back(u8_ptr);
+      unused_buffers.push_back(u8_ptr);
    }
 
    is_init = true;
@@ -171,7 +284,7 @@ void AbstractStreamingCamera::AllocateBuffers(int buffer_size_)
 */
 unsigned char* AbstractStreamingCamera::GetUnusedBuffer()
 {
-   QMutexLocker lk(buffer_mutex);
+   QMutexLocker lk(&buffer_mutex);
 
    if (unused_buffers.empty())
       throw std::exception("Streaming Camera Error - Out of buffers");
@@ -185,14 +298,43 @@ unsigned char* AbstractStreamingCamera::GetUnusedBuffer()
 /*
    Call this function from the streaming thread with new image data
 */
-void AbstractStreamingCamera::SetLatest(cv::Mat& image)
+void AbstractStreamingCamera::SetLatest(cv::Mat& image, qint64 hardware_frame, qint64 hardware_timestamp_us)
 {
-   QMutexLocker lk(m);
-   latest_data = shared_ptr<ImageBuffer>( new ImageBuffer(image, background, this, image_index++) );
-   lk.unlock();
+   int index = image_index++;
+
+   {
+      QMutexLocker lkb(&buffer_mutex);
+      in_flight_buffers.insert(image.data);
+   }
+
+   shared_ptr<ImageBuffer> buffer(new ImageBuffer(image, this, index));
+
+   // Captured frames hold on to the camera buffer rather than copying it
+   {
+      QMutexLocker clk(&capture_mutex);
+      if (capture_armed && n_captured < (int) capture_pool.size())
+      {
+         CapturedFrame& frame = capture_pool[n_captured++];
+         frame.image_index = index;
+         frame.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+         frame.hardware_frame = hardware_frame;
+         frame.hardware_timestamp_us = hardware_timestamp_us;
+         frame.buffer = buffer;
+         frame.image = buffer->GetImage();
+         capture_cv.wakeAll();
+      }
+   }
 
-   emit NewImage();
-   next_cv.wakeAll();
+   std::atomic_store(&latest_data, buffer);
+
+   emit newImage();
+
+   // Only held to hand over to GetNext without a lost wakeup
+   {
+      lock_guard<mutex> lk(next_mutex);
+      n_delivered++;
+   }
+   next_cv.notify_all();
 }
 
 /*
@@ -229,6 +371,31 @@ void AbstractStreamingCamera::SetStreamingStatus(bool streaming_)
    }
 }
 
+/*
+   Change the ROI, stopping and restarting streaming around the change if
+   necessary. The existing buffers are reused, so this is quick.
+*/
+void AbstractStreamingCamera::StopStreaming()
+{
+   if (!is_streaming)
+      return;
+
+   SetStreamingStatus(false);
+   while (is_streaming)
+      QThread::msleep(1);
+}
+
+void AbstractStreamingCamera::ChangeROI(cv::Rect roi)
+{
+   bool was_streaming = is_streaming;
+   StopStreaming();
+
+   SetROI(roi);
+
+   if (was_streaming)
+      SetStreamingStatus(true);
+}
+
 /*
    Call this function just before the streaming thread finishes
    to clean up the buffers and notify listeners
@@ -252,44 +419,114 @@ void AbstractStreamingCamera::TerminateStreaming()
 */
 void AbstractStreamingCamera::ClearBackground()
 {
-   background = cv::Mat();
+   correction.clearDark();
    emit NewBackground();
 }
 
 /*
    Collect a new background by averaging a number of frames
 */
-void AbstractStreamingCamera::UpdateBackground()
+void AbstractStreamingCamera::UpdateBackground(int n_frames)
 {
-   cv::Size image_size = GetImageSize();
-   cv::Mat new_background(image_size, CV_32F, background_ptr);
-   /*
-   
-   int n = 5;
+   correction.setDark(AverageFrames(n_frames));
+   emit NewBackground();
+}
 
-   int type;
+void AbstractStreamingCamera::ClearFlatField()
+{
+   correction.clearFlat();
+   emit NewBackground();
+}
+
+/*
+   Collect a flat field reference by averaging a number of frames of a
+   uniform target. The current background is subtracted from it.
+*/
+void AbstractStreamingCamera::UpdateFlatField(int n_frames)
+{
+   correction.setFlat(AverageFrames(n_frames));
+   emit NewBackground();
+}
 
-   cv::Mat f;
-   for (int i=0; i<n; i++)
+cv::Mat AbstractStreamingCamera::AverageFrames(int n_frames)
+{
+   ReferenceAverager averager;
+   for (int i = 0; i < n_frames; i++)
    {
       shared_ptr<ImageBuffer> buf = GrabImage();
-      buf->GetImage().convertTo(f, CV_32F);
-      new_background += f;
-
-      type = buf->GetImage().type();
+      averager.add(buf->GetImage());
    }
+   return averager.result();
+}
 
-   new_background /= n;
-   new_background.convertTo(background, type);
-   */
+/*
+   Apply dark/flat correction into a pooled buffer. Returns null if there
+   is no matching reference, in which case the raw image should be used.
+*/
+PooledFrame AbstractStreamingCamera::CorrectImage(const cv::Mat& image)
+{
+   if (!correction.isActive(image.size()))
+      return nullptr;
 
-   shared_ptr<ImageBuffer> buf = GrabImage();
-   buf->GetImage().copyTo(background);
+   PooledFrame corrected = correction_pool.acquire(image.size(), image.type());
+   if (!correction.apply(image, *corrected))
+      return nullptr;
 
-   emit NewBackground();
+   return corrected;
 }
 
 cv::Mat AbstractStreamingCamera::BackgroundImage()
 {
-   return background;
-}
\ No newline at end of file
+   return correction.getDark();
+}
+
+/*
+   Add buffers for the capture and start capturing with the next frame
+*/
+void AbstractStreamingCamera::ArmCapture(int n_frames)
+{
+   DisarmCapture();
+   AddCaptureBuffers(n_frames);
+
+   QMutexLocker lk(&capture_mutex);
+   capture_pool.resize(n_frames);
+   n_captured = 0;
+   capture_armed = true;
+}
+
+bool AbstractStreamingCamera::WaitForCapturedFrame(int i, CapturedFrame& frame, int timeout_ms)
+{
+   QMutexLocker lk(&capture_mutex);
+
+   if (i >= (int) capture_pool.size())
+      return false;
+
+   while (n_captured <= i)
+      if (!capture_cv.wait(&capture_mutex, timeout_ms))
+         return false;
+
+   frame = capture_pool[i];
+   return true;
+}
+
+int AbstractStreamingCamera::GetNumCapturedFrames()
+{
+   QMutexLocker lk(&capture_mutex);
+   return n_captured;
+}
+
+void AbstractStreamingCamera::DisarmCapture()
+{
+   std::vector<CapturedFrame> pool;
+   {
+      QMutexLocker lk(&capture_mutex);
+      capture_armed = false;
+      pool.swap(capture_pool);
+      n_captured = 0;
+      capture_cv.wakeAll();
+   }
+
+   // Frames are released here, outside capture_mutex, as that requeues their buffers
+   pool.clear();
+   RemoveCaptureBuffers();
+}
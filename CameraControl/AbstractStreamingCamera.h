@@ -2,6 +2,9 @@
 
 #include "ParametricImageSource.h"
 #include "ImageBuffer.h"
+#include "DarkFlatCorrection.h"
+#include "FramePool.h"
+#include "BufferAllocator.h"
 
 #include <QThread>
 #include <QMutex>
@@ -14,6 +17,12 @@
 
 #include <memory>
 #include <vector>
+#include <list>
+#include <set>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include <cv.h>
 
@@ -29,6 +38,16 @@ public:
 
    enum TriggerMode { Internal, Software, External };
 
+   struct CapturedFrame
+   {
+      int image_index = 0; // host frame sequence number
+      qint64 timestamp_us = 0; // steady clock time the frame arrived
+      qint64 hardware_frame = -1; // camera frame counter, -1 if not available
+      qint64 hardware_timestamp_us = -1; // camera timestamp, -1 if not available
+      std::shared_ptr<ImageBuffer> buffer; // keeps image valid
+      cv::Mat image;
+   };
+
    AbstractStreamingCamera(QObject* parent = 0);
    ~AbstractStreamingCamera();
 
@@ -39,20 +58,40 @@ public:
    virtual double GetPixelSize() = 0;
    virtual cv::Rect GetROI() = 0;
 
-   virtual void SetTriggerMode(TriggerMode trigger_mode) = 0;
+   // Exposure time in seconds
+   virtual double GetExposureTime() = 0;
+   virtual void SetExposureTime(double exposure_s) = 0;
+
+   virtual TriggerMode GetTriggerMode() = 0;
+   // Returns false if the camera rejected the mode. Stop streaming first
+   virtual bool SetTriggerMode(TriggerMode trigger_mode) = 0;
    virtual void SoftwareTrigger() = 0;
 
    virtual void SetFullROI() = 0;
    virtual void SetROI(cv::Rect roi) = 0;
+   void ChangeROI(cv::Rect roi);
 
    virtual std::shared_ptr<ImageBuffer> GrabImage() = 0;
 
    virtual QWidget* GetControlWidget(QWidget* parent = 0) = 0;
 
-   void UpdateBackground();
+   // Dark and flat references are averaged over a number of frames
+   void UpdateBackground(int n_frames = 5);
    void ClearBackground();
+   void UpdateFlatField(int n_frames = 20);
+   void ClearFlatField();
+
+   /*
+      Set the allocator used for frame buffers. Existing buffers are 
+      replaced straight away if the camera isn't streaming, otherwise 
+      when streaming stops.
+   */
+   void SetBufferAllocator(std::shared_ptr<BufferAllocator> allocator_);
+   std::shared_ptr<BufferAllocator> GetBufferAllocator();
 
    void SetStreamingStatus(bool streaming);
+   void StopStreaming(); // and wait for the streaming thread to finish
+   bool IsStreaming() { return is_streaming; }
    std::shared_ptr<ImageBuffer> GetLatest();
    std::shared_ptr<ImageBuffer> GetNext();
 
@@ -61,6 +100,23 @@ public:
    cv::Mat GetImageUnsafe();
    cv::Mat BackgroundImage();
 
+   // ImageSource interface, so a camera can feed a ProcessingPipeline
+   cv::Mat getImage() { return GetImage(); }
+   cv::Mat getImageUnsafe() { return GetImageUnsafe(); }
+   cv::Mat getNextImage() { return GetNextImage(); }
+
+   /*
+      Keep the next n_frames frames, without copying them. Enough extra
+      camera buffers are added here to hold them all, so that no frame is
+      missed while the consumer is busy. Frame i of the capture can then be
+      collected with WaitForCapturedFrame from any thread; its buffer is
+      held until the capture is disarmed.
+   */
+   void ArmCapture(int n_frames);
+   bool WaitForCapturedFrame(int i, CapturedFrame& frame, int timeout_ms);
+   int GetNumCapturedFrames();
+   void DisarmCapture();
+
 signals:
    void ImageSizeChanged();
    void NewBackground();
@@ -95,7 +151,7 @@ protected:
 
    void AllocateBuffers(int buffer_size);
    void QueueAllBuffers();
-   void SetLatest(cv::Mat& image);
+   void SetLatest(cv::Mat& image, qint64 hardware_frame = -1, qint64 hardware_timestamp_us = -1);
    void TerminateStreaming();
 
    unsigned char* GetUnusedBuffer();
@@ -103,40 +159,56 @@ protected:
    void FreeBuffers();
    
    const static int n_buffers = 5; 
-   int buffer_size;
-   int max_buffer_size;
+   int buffer_size = 0; // size of the current image, which buffers are queued with
+   int max_buffer_size = 0; // capacity of each buffer
 
-   bool terminate;
+   std::atomic<bool> terminate;
    QThread* main_thread;
    QThread* worker_thread;
 
-   QWaitCondition next_cv;
-   QMutex* next_mutex;
-
-   bool controls_locked = false;
-   bool is_streaming = false;
+   std::atomic<bool> controls_locked = { false };
+   std::atomic<bool> is_streaming = { false };
 
    int image_index;
 
 private:
 
-   void AllocateMemory(void** ptr, int size);
-   void FreeMemory(void* ptr);
-
    void QueuePointer(unsigned char* ptr);
 
-   float* background_ptr;
-   cv::Mat background;
+   PooledFrame CorrectImage(const cv::Mat& image);
+   cv::Mat AverageFrames(int n_frames);
+
+   DarkFlatCorrection correction;
+   FramePool correction_pool;
 
    bool is_init;
-   bool buffers_ok;
-   int  allocation_idx;
 
+   std::shared_ptr<BufferAllocator> allocator;
+   std::shared_ptr<BufferAllocator> buffers_allocator; // allocator which owns the current buffers
+   size_t allocated_buffer_size = 0;
    std::vector<unsigned char*> buffers;
    std::list<unsigned char*> unused_buffers;
-   std::shared_ptr<ImageBuffer> latest_data;
+   std::set<unsigned char*> in_flight_buffers; // held by an ImageBuffer
+   std::map<unsigned char*, std::pair<std::shared_ptr<BufferAllocator>, size_t>> retired_buffers;
+   std::vector<unsigned char*> capture_buffers; // added for the current capture
+   std::list<unsigned char*> surplus_buffers; // capture buffers which may still be queued with the camera
+
+   void AddCaptureBuffers(int n);
+   void RemoveCaptureBuffers();
+   void FreeSurplusBuffers();
+   std::shared_ptr<ImageBuffer> latest_data; // only accessed with std::atomic_load/store
+
+   std::mutex next_mutex;
+   std::condition_variable next_cv;
+   uint64_t n_delivered = 0; // frames passed to SetLatest, guarded by next_mutex
+
+   QMutex buffer_mutex; // buffer lists; only held briefly, never across a parameter query
+
+   QMutex capture_mutex;
+   QWaitCondition capture_cv;
+   std::vector<CapturedFrame> capture_pool;
+   int n_captured = 0;
+   bool capture_armed = false;
 
-   QMutex* m;
-   QMutex* buffer_mutex;
    friend class ImageBuffer;
 };
@@ -41,20 +41,40 @@ AndorCamera::AndorCamera(int idx, QObject* parent) :
    CHECK(AT_Open(idx, &Hndl));
    n_andor_cameras_connected__++;
 
+   aoi_width = getTypedParameter<qint64>("AOIWidth");
+   aoi_height = getTypedParameter<qint64>("AOIHeight");
+   aoi_left = getTypedParameter<qint64>("AOILeft");
+   aoi_top = getTypedParameter<qint64>("AOITop");
+   aoi_stride = getTypedParameter<qint64>("AOIStride");
+   image_size_bytes = getTypedParameter<qint64>("ImageSizeBytes");
+   bytes_per_pixel = getTypedParameter<double>("BytesPerPixel");
+   pixel_height = getTypedParameter<double>("PixelHeight");
+   exposure_time = getTypedParameter<double>("ExposureTime");
+
    StartThread();
 }
 
 void AndorCamera::Init()
 {
+   // Timestamp frames on the camera where supported, so frame timing 
+   // doesn't depend on the host. Set before allocating, as the metadata
+   // is appended to each image
+   //===========================================================
+   AT_SetBool(Hndl, L"MetadataEnable", AT_TRUE);
+   AT_SetBool(Hndl, L"MetadataTimestamp", AT_TRUE);
+
    // Allocate buffers big enough for largest possible image
    //===========================================================
-   int64_t max_width, max_height;
+   int64_t max_width, max_height, max_stride;
    double max_bytes_per_pixel;
    AT_GetIntMax(Hndl,L"AOIWidth", &max_width);
-   AT_GetIntMax(Hndl,L"AOIWidth", &max_height);
+   AT_GetIntMax(Hndl,L"AOIHeight", &max_height);
    CHECK(AT_GetFloatMax(Hndl, L"BytesPerPixel", &max_bytes_per_pixel));
 
+   // Rows may be padded, so allow for the largest stride too
    int max_n_bytes = max_width * max_height * max_bytes_per_pixel;
+   if (AT_GetIntMax(Hndl, L"AOIStride", &max_stride) == AT_SUCCESS)
+      max_n_bytes = std::max(max_n_bytes, (int) (max_stride * max_height));
 
    AllocateBuffers(max_n_bytes);
    
@@ -130,6 +150,11 @@ void AndorCamera::Init()
    CHECK(AT_RegisterFeatureCallback(Hndl, L"AOIHeight",     AndorFeatureCallback, static_cast<void*>(this)));
    CHECK(AT_RegisterFeatureCallback(Hndl, L"AOIWidth",      AndorFeatureCallback, static_cast<void*>(this)));
    CHECK(AT_RegisterFeatureCallback(Hndl, L"BytesPerPixel", AndorFeatureCallback, static_cast<void*>(this)));
+
+   watched_features << "AOIHeight" << "AOIWidth" << "BytesPerPixel";
+
+   // Defaults were written directly
+   invalidateParameterCache();
 }
 
 
@@ -142,6 +167,8 @@ QWidget* AndorCamera::GetControlWidget(QWidget* parent)
 
 AndorCamera::~AndorCamera()
 {
+   stopParameterThreads();
+
    FreeBuffers();
    
    using namespace AndorCameras;
@@ -163,24 +190,77 @@ int AT_EXP_CONV AndorFeatureCallback(AT_H Hndl, const AT_WC* feature, void* cont
    return true;
 }
 
+/*
+   Called by the SDK when the value, limits or availability of a 
+   watched feature change, possibly from within a write
+*/
 void AndorCamera::Callback(const AT_WC* feature)
 {
-   GetImageSize();
-   GetNumBytesPerPixel();
+   QString parameter = QString::fromWCharArray(feature);
+
+   if (parameter != "AOIHeight" && parameter != "AOIWidth" && parameter != "BytesPerPixel")
+   {
+      invalidateParameter(parameter);
+      return;
+   }
+
+   // Size changes affect ImageSizeBytes, AOIStride etc. which aren't watched
+   invalidateParameterCache();
+
+   // Requeue buffers with the correct size once the write which caused
+   // this has finished; the SDK may call back from within the write
+   postCommand([this]()
+   {
+      QueueAllBuffers();
+      emit ImageSizeChanged();
+   });
+}
+
+/*
+   Register a callback for a feature the first time it is read, so the
+   cached value is dropped when the camera changes it
+*/
+void AndorCamera::WatchFeature(const ParameterInfo& parameter)
+{
+   {
+      QMutexLocker lk(&watched_mutex);
+      if (watched_features.contains(parameter.name))
+         return;
+      watched_features.insert(parameter.name);
+   }
+
+   const AT_WC* param = NativeKey(parameter);
+   SOFTCHECK(AT_RegisterFeatureCallback(Hndl, param, AndorFeatureCallback, static_cast<void*>(this)));
+}
+
+/*
+   Features are stored as null terminated UTF-16, which is what the SDK
+   takes, so the name isn't converted on every call
+*/
+QByteArray AndorCamera::nativeParameterKey(const QString& parameter)
+{
+   return QByteArray(reinterpret_cast<const char*>(parameter.utf16()), (parameter.size() + 1) * sizeof(ushort));
+}
 
-   // requeue buffers with correct size
-   QueueAllBuffers();
+const AT_WC* AndorCamera::NativeKey(const ParameterInfo& parameter)
+{
+   return reinterpret_cast<const AT_WC*>(parameter.key.constData());
+}
 
-   // Only size updates registered
-   emit ImageSizeChanged();
+/*
+   Readings which change continuously are never cached
+*/
+bool AndorCamera::isParameterVolatile(const QString& parameter)
+{
+   return parameter == "SensorTemperature" || parameter == "TemperatureStatus" || parameter == "TimestampClock";
 }
 
 
-void AndorCamera::SetParameter(const QString& parameter, ParameterType type, QVariant value)
+void AndorCamera::writeParameter(const ParameterInfo& parameter, QVariant value)
 {
-   const AT_WC* param = reinterpret_cast<const AT_WC*>(parameter.utf16());
+   const AT_WC* param = NativeKey(parameter);
 
-   switch (type)
+   switch (parameter.type)
    {
    case Integer:
       SOFTCHECK(AT_SetInt(Hndl, param, value.toLongLong()));
@@ -203,12 +283,14 @@ void AndorCamera::SetParameter(const QString& parameter, ParameterType type, QVa
    }
 }
 
-QVariant AndorCamera::GetParameter(const QString& parameter, ParameterType type)
+QVariant AndorCamera::readParameter(const ParameterInfo& parameter)
 {
-   const AT_WC* param = reinterpret_cast<const AT_WC*>(parameter.utf16());
+   const AT_WC* param = NativeKey(parameter);
    QVariant value;
 
-   switch (type)
+   WatchFeature(parameter);
+
+   switch (parameter.type)
    {
    case Integer:
       int64_t vl;
@@ -242,23 +324,23 @@ QVariant AndorCamera::GetParameter(const QString& parameter, ParameterType type)
    return value;
 }
 
-QVariant AndorCamera::GetParameterMinIncrement(const QString& parameter, ParameterType type)
+QVariant AndorCamera::readParameterMinIncrement(const ParameterInfo& parameter)
 {
-   if (type == Integer)
+   if (parameter.type == Integer)
       return 1;
 
    return QVariant();
 }
 
 
-QVariant AndorCamera::GetParameterLimit(const QString& parameter, ParameterType type, Limit limit)
+QVariant AndorCamera::readParameterLimit(const ParameterInfo& parameter, Limit limit)
 {
-   const AT_WC* param = reinterpret_cast<const AT_WC*>(parameter.utf16());
+   const AT_WC* param = NativeKey(parameter);
    QVariant value;
 
    if (limit == Limit::Min)
    {
-      switch (type)
+      switch (parameter.type)
       {
       case Integer:
          int64_t vl;
@@ -275,7 +357,7 @@ QVariant AndorCamera::GetParameterLimit(const QString& parameter, ParameterType
    }
    else
    {
-      switch (type)
+      switch (parameter.type)
       {
       case Integer:
          int64_t vl;
@@ -294,9 +376,9 @@ QVariant AndorCamera::GetParameterLimit(const QString& parameter, ParameterType
    return value;
 }
 
-EnumerationList AndorCamera::GetEnumerationList(const QString& parameter)
+EnumerationList AndorCamera::readEnumerationList(const ParameterInfo& parameter)
 {
-   const AT_WC* param = reinterpret_cast<const AT_WC*>(parameter.utf16());
+   const AT_WC* param = NativeKey(parameter);
 
    int count = 0;
    AT_WC buf[1024];
@@ -321,18 +403,18 @@ EnumerationList AndorCamera::GetEnumerationList(const QString& parameter)
    return list;
 }
 
-bool AndorCamera::IsParameterWritable(const QString& parameter)
+bool AndorCamera::readParameterWritable(const ParameterInfo& parameter)
 {
-   const AT_WC* param = reinterpret_cast<const AT_WC*>(parameter.utf16());
+   const AT_WC* param = NativeKey(parameter);
 
    int is_writable = AT_FALSE;
    SOFTCHECK(AT_IsWritable(Hndl, param, &is_writable));
    return is_writable;
 }
 
-bool AndorCamera::IsParameterReadOnly(const QString& parameter)
+bool AndorCamera::readParameterReadOnly(const ParameterInfo& parameter)
 {
-   const AT_WC* param = reinterpret_cast<const AT_WC*>(parameter.utf16());
+   const AT_WC* param = NativeKey(parameter);
 
    int is_readonly = AT_TRUE;
    SOFTCHECK(AT_IsReadOnly(Hndl, param, &is_readonly));
@@ -393,126 +475,116 @@ AT_H AndorCamera::GetHandle()
 
 int AndorCamera::GetImageSizeBytes()
 {
-   int64_t image_size_bytes;
-   CHECK(AT_GetInt(Hndl, L"ImageSizeBytes", &image_size_bytes));
-   return (int) image_size_bytes;
+   return (int) image_size_bytes.get();
 }
 
 
 int AndorCamera::GetNumBytesPerPixel()
 {
-   double bytes_per_pixel_;
-   CHECK(AT_GetFloat(Hndl, L"BytesPerPixel", &bytes_per_pixel_));
-   //this->bytes_per_pixel = bytes_per_pixel_;
-   return bytes_per_pixel_;
+   return (int) bytes_per_pixel.get();
 }
 
 cv::Size AndorCamera::GetImageSize()
 {
-   int64_t image_width;
-   int64_t image_height;
-   int64_t stride_;
-   CHECK(AT_GetInt(Hndl, L"AOIWidth", &image_width));
-   CHECK(AT_GetInt(Hndl, L"AOIHeight", &image_height));
-   CHECK(AT_GetInt(Hndl, L"AOIStride", &stride_));
-   
-   //this->image_size = cv::Size(image_width, image_height);
-   //this->stride = stride_;
-
-   return cv::Size(image_width, image_height);
+   return cv::Size((int) aoi_width.get(), (int) aoi_height.get());
 }
 
 int AndorCamera::GetStride()
 {
-   int64_t stride;
-   CHECK(AT_GetInt(Hndl, L"AOIStride", &stride));
-   return stride;
+   return (int) aoi_stride.get();
 }
 
 double AndorCamera::GetPixelSize()
 {
-   double px_size;
-   CHECK(AT_GetFloat(Hndl, L"PixelHeight", &px_size));
-   return px_size;
+   return pixel_height.get();
 }
 
-void AndorCamera::SetROI(cv::Rect roi)
+double AndorCamera::GetExposureTime()
 {
-   int64_t p;
+   return exposure_time.get();
+}
 
+void AndorCamera::SetExposureTime(double exposure_s)
+{
+   exposure_time.set(exposure_s);
+}
+
+void AndorCamera::SetROI(cv::Rect roi)
+{
    if (controls_locked)
       return;
 
-   // Try and constrain to reasonable numbers
+   // Try and constrain to reasonable numbers. Each write can change 
+   // the limits of the next, so they are written one at a time
 
-   CHECK(AT_GetIntMax(Hndl, L"AOIWidth", &p));
-   roi.width = min((int)p, roi.width);
-   SOFTCHECK(AT_SetInt(Hndl, L"AOIWidth", roi.width));
+   roi.width = min((int) aoi_width.limit(Max), roi.width);
+   aoi_width.set(roi.width);
       
-   CHECK(AT_GetIntMin(Hndl, L"AOILeft", &p));
-   roi.x = max((int)p, roi.x + 1); // Andor is 1 indexed
-   SOFTCHECK(AT_SetInt(Hndl, L"AOILeft", roi.x));
+   roi.x = max((int) aoi_left.limit(Min), roi.x + 1); // Andor is 1 indexed
+   aoi_left.set(roi.x);
       
-   CHECK(AT_GetIntMax(Hndl, L"AOIHeight", &p));
-   roi.height = min((int)p, roi.height);
-   SOFTCHECK(AT_SetInt(Hndl, L"AOIHeight", roi.height));
+   roi.height = min((int) aoi_height.limit(Max), roi.height);
+   aoi_height.set(roi.height);
 
-   CHECK(AT_GetIntMin(Hndl, L"AOITop", &p));
-   roi.y = max((int)p, roi.y + 1); // Andor is 1 indexed
-   SOFTCHECK(AT_SetInt(Hndl, L"AOITop", roi.y));
+   roi.y = max((int) aoi_top.limit(Min), roi.y + 1); // Andor is 1 indexed
+   aoi_top.set(roi.y);
 }
 
-void AndorCamera::SetTriggerMode(TriggerMode trigger_mode)
+AbstractStreamingCamera::TriggerMode AndorCamera::GetTriggerMode()
 {
+   AT_WC mode[256] = { 0 };
+   runCommand([&]()
+   {
+      int index;
+      if (AT_GetEnumIndex(Hndl, L"TriggerMode", &index) == AT_SUCCESS)
+         AT_GetEnumStringByIndex(Hndl, L"TriggerMode", index, mode, 256);
+   });
+
+   QString m = QString::fromWCharArray(mode);
+   if (m == "Internal")
+      return Internal;
+   else if (m == "Software")
+      return Software;
+   else
+      return External;
+}
+
+bool AndorCamera::SetTriggerMode(TriggerMode trigger_mode)
+{
+   const AT_WC* mode = L"External";
    if (trigger_mode == Internal)
-      AT_SetEnumeratedString(Hndl, L"TriggerMode", L"Internal");
+      mode = L"Internal";
    else if (trigger_mode == Software)
-      AT_SetEnumeratedString(Hndl, L"TriggerMode", L"Software");
-   else
-      AT_SetEnumeratedString(Hndl, L"TriggerMode", L"External");
+      mode = L"Software";
+
+   int err = runCommand([&]() { return AT_SetEnumeratedString(Hndl, L"TriggerMode", mode); });
+
+   invalidateParameterCache();
+
+   if (err != AT_SUCCESS)
+   {
+      std::cout << "Could not set Andor trigger mode, error " << err << "\n";
+      return false;
+   }
+   return true;
 }
 
 void AndorCamera::SoftwareTrigger()
 {
-   AT_Command(Hndl, L"SoftwareTrigger");
+   runCommand([this]() { AT_Command(Hndl, L"SoftwareTrigger"); });
 }
 
 void AndorCamera::SetFullROI()
 {
-   int64_t p;
-
-   CHECK(AT_GetIntMax(Hndl, L"AOIWidth", &p));
-   SOFTCHECK(AT_SetInt(Hndl, L"AOIWidth", p));
-
-   CHECK(AT_GetIntMin(Hndl, L"AOILeft", &p));
-   SOFTCHECK(AT_SetInt(Hndl, L"AOILeft", p));
-
-   CHECK(AT_GetIntMax(Hndl, L"AOIHeight", &p));
-   SOFTCHECK(AT_SetInt(Hndl, L"AOIHeight", p));
-
-   CHECK(AT_GetIntMin(Hndl, L"AOITop", &p));
-   SOFTCHECK(AT_SetInt(Hndl, L"AOITop", p));
-
+   aoi_width.set(aoi_width.limit(Max));
+   aoi_left.set(aoi_left.limit(Min));
+   aoi_height.set(aoi_height.limit(Max));
+   aoi_top.set(aoi_top.limit(Min));
 }
 
 cv::Rect AndorCamera::GetROI()
 {
-   cv::Rect roi;
-   int64_t p;
-
-   CHECK(AT_GetInt(Hndl, L"AOILeft", &p));
-   roi.x = (int) p;
-
-   CHECK(AT_GetInt(Hndl, L"AOITop", &p));
-   roi.y = (int) p;
-   
-   CHECK(AT_GetInt(Hndl, L"AOIWidth", &p));
-   roi.width = (int) p;
-   
-   CHECK(AT_GetInt(Hndl, L"AOIHeight", &p));
-   roi.height = (int) p;
-
-   return roi;
+   return cv::Rect((int) aoi_left.get(), (int) aoi_top.get(), (int) aoi_width.get(), (int) aoi_height.get());
 }
 
 
@@ -523,6 +595,37 @@ void AndorCamera::QueuePointerWithCamera(AT_U8* ptr)
 
 
 
+/*
+   Find the timestamp in the metadata appended to a frame. Blocks are read
+   back from the end of the buffer: the data, then a 4 byte CID and a 4 byte
+   length, which covers the CID and data
+*/
+static bool GetMetadataTimestamp(const AT_U8* buffer, int buffer_size, int image_size, int64_t& ticks)
+{
+   const int timestamp_cid = 1;
+
+   int end = buffer_size;
+   while (end - 8 >= image_size)
+   {
+      uint32_t length = *reinterpret_cast<const uint32_t*>(buffer + end - 4);
+      uint32_t cid = *reinterpret_cast<const uint32_t*>(buffer + end - 8);
+
+      int start = end - 4 - (int) length;
+      if (length < 4 || start < image_size)
+         return false;
+
+      if (cid == timestamp_cid && length - 4 >= 8)
+      {
+         ticks = *reinterpret_cast<const int64_t*>(buffer + start);
+         return true;
+      }
+
+      end = start;
+   }
+
+   return false;
+}
+
 void AndorCamera::run()
 {
    int errorValue;
@@ -536,6 +639,13 @@ void AndorCamera::run()
       type = CV_16U;
    int stride = GetStride();
 
+   AT_BOOL metadata = AT_FALSE, timestamps = AT_FALSE;
+   int64_t clock_frequency = 0;
+   AT_GetBool(Hndl, L"MetadataEnable", &metadata);
+   AT_GetBool(Hndl, L"MetadataTimestamp", &timestamps);
+   AT_GetInt(Hndl, L"TimestampClockFrequency", &clock_frequency);
+   bool use_timestamps = metadata && timestamps && (clock_frequency > 0);
+
    // Start Acquisition
    //========================================
    CHECK(AT_SetEnumString(Hndl, L"CycleMode", L"Continuous"));
@@ -558,7 +668,13 @@ void AndorCamera::run()
 
       if (errorValue == AT_SUCCESS)
       {
-         SetLatest(cv::Mat(size, type, ptr, stride));
+         qint64 timestamp_us = -1;
+         int64_t ticks;
+         if (use_timestamps && GetMetadataTimestamp(ptr, ret_buffer_size, stride * size.height, ticks))
+            timestamp_us = (qint64) (ticks * (1e6 / clock_frequency));
+
+         // Andor cameras have no frame counter, so the timestamp identifies the frame
+         SetLatest(cv::Mat(size, type, ptr, stride), -1, timestamp_us);
       } 
       else if (errorValue == 13)
       {
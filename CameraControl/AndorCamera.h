@@ -6,6 +6,8 @@
 #include "ImageBuffer.h"
 #include "atcore.h"
 
+#include <QSet>
+
 class AndorCamera : public AbstractStreamingCamera
 {
    Q_OBJECT
@@ -29,17 +31,12 @@ public:
 
    void   SetROI(cv::Rect roi);
    void   SetFullROI();
-   void SetTriggerMode(TriggerMode trigger_mode);
-   void SoftwareTrigger();
 
-   void SetParameter(const QString& parameter, ParameterType type, QVariant value);
-   QVariant GetParameter(const QString& parameter, ParameterType type);
-   QVariant GetParameterLimit(const QString& parameter, ParameterType type, Limit limit);
-   QVariant GetParameterMinIncrement(const QString& parameter, ParameterType type);
-
-   EnumerationList GetEnumerationList(const QString& parameter);
-   bool IsParameterWritable(const QString& parameter);
-   bool IsParameterReadOnly(const QString& parameter);
+   double GetExposureTime();
+   void   SetExposureTime(double exposure_s);
+   TriggerMode GetTriggerMode();
+   bool SetTriggerMode(TriggerMode trigger_mode);
+   void SoftwareTrigger();
 
    std::shared_ptr<ImageBuffer> GrabImage();
 
@@ -47,17 +44,43 @@ public:
 
 protected:
 
+   void writeParameter(const ParameterInfo& parameter, QVariant value);
+   QVariant readParameter(const ParameterInfo& parameter);
+   QVariant readParameterLimit(const ParameterInfo& parameter, Limit limit);
+   QVariant readParameterMinIncrement(const ParameterInfo& parameter);
+
+   EnumerationList readEnumerationList(const ParameterInfo& parameter);
+   bool readParameterWritable(const ParameterInfo& parameter);
+   bool readParameterReadOnly(const ParameterInfo& parameter);
+   QByteArray nativeParameterKey(const QString& parameter);
+   bool isParameterVolatile(const QString& parameter);
+
    void run();
 
 private:
    void QueuePointerWithCamera(AT_U8* ptr);
    void FlushBuffers();
    void Callback(const AT_WC* feature);
+   void WatchFeature(const ParameterInfo& parameter);
+   static const AT_WC* NativeKey(const ParameterInfo& parameter);
 
    QSize current_size;
    int current_stride;
 
    AT_H Hndl;
 
+   TypedParameter<qint64> aoi_width;
+   TypedParameter<qint64> aoi_height;
+   TypedParameter<qint64> aoi_left;
+   TypedParameter<qint64> aoi_top;
+   TypedParameter<qint64> aoi_stride;
+   TypedParameter<qint64> image_size_bytes;
+   TypedParameter<double> bytes_per_pixel;
+   TypedParameter<double> pixel_height;
+   TypedParameter<double> exposure_time;
+
+   QMutex watched_mutex;
+   QSet<QString> watched_features; // features with a callback to invalidate the parameter cache
+
    friend int AT_EXP_CONV AndorFeatureCallback(AT_H Hndl, const AT_WC* feature, void* context);
 };
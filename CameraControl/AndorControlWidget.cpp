@@ -12,8 +12,8 @@
 
 #include <iostream>
 
-AndorControlWidget::AndorControlWidget(AndorCamera* camera, QFormLayout* parent, QString control, ParameterType type, QString suffix, bool use_timer) :
-ParameterWidget(camera, parent, control, type, suffix, use_timer, false),
+AndorControlWidget::AndorControlWidget(AndorCamera* camera, QFormLayout* parent, QString control, ParameterType type, QString suffix, bool poll) :
+ParameterWidget(camera, parent, control, type, suffix, poll, false),
    Hndl(camera->GetHandle())
 {
    const AT_WC* param = reinterpret_cast<const AT_WC*>(control.utf16());
@@ -22,25 +22,10 @@ ParameterWidget(camera, parent, control, type, suffix, use_timer, false),
    if (!is_implemented)
       return;
 
-   Init();
-
-   CHECK(AT_RegisterFeatureCallback(Hndl, param, ValueUpdatedCallback, static_cast<void*>(this)));
-
+   // Changes are pushed by the camera, which registers a feature callback when the value is first read
+   init();
 };
 
 AndorControlWidget::~AndorControlWidget()
 {
-   const AT_WC* param = control.toStdWString().data();
-
-   if (is_implemented)
-      AT_UnregisterFeatureCallback(Hndl, param, ValueUpdatedCallback, static_cast<void*>(this));
-}
-
-int AT_EXP_CONV ValueUpdatedCallback(AT_H Hndl, const AT_WC* Feature, void* context)
-{   
-   AndorControlWidget* widget = static_cast<AndorControlWidget*>(context);
-   
-   // This may be called from another thread so post as event
-   QCoreApplication::postEvent(widget, new QEvent(WidgetEvent::ValueUpdated));
-   return 0;
 }
@@ -8,7 +8,7 @@ class AndorControlWidget : public ParameterWidget
    Q_OBJECT
 
 public:
-   AndorControlWidget(AndorCamera* camera, QFormLayout* parent, QString control, ParameterType type, QString suffix = "", bool use_timer = false);
+   AndorControlWidget(AndorCamera* camera, QFormLayout* parent, QString control, ParameterType type, QString suffix = "", bool poll = false);
    ~AndorControlWidget();
    
 protected:
@@ -22,6 +22,5 @@ private:
    int is_implemented;
 
    friend class AndorControlDisplay;
-   friend int AT_EXP_CONV ValueUpdatedCallback(AT_H Hndl, const AT_WC* Feature, void* context);
 
 };
@@ -0,0 +1,177 @@
+#include "BufferAllocator.h"
+
+#include <QStringList>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#ifdef USE_CUDA
+#include <cuda.h>
+#include <cuda_runtime.h>
+#endif
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+   void PrefaultPages(void* ptr, size_t size, size_t page_size)
+   {
+      volatile unsigned char* p = static_cast<unsigned char*>(ptr);
+      for (size_t i = 0; i < size; i += page_size)
+         p[i] = 0;
+   }
+
+   size_t SystemPageSize()
+   {
+#ifdef __linux__
+      return (size_t) sysconf(_SC_PAGESIZE);
+#else
+      return 4096;
+#endif
+   }
+}
+
+void* MallocBufferAllocator::Allocate(size_t size)
+{
+   void* ptr = malloc(size);
+   if (ptr == nullptr)
+      throw std::bad_alloc();
+
+   PrefaultPages(ptr, size, SystemPageSize());
+   return ptr;
+}
+
+void MallocBufferAllocator::Free(void* ptr, size_t size)
+{
+   free(ptr);
+}
+
+
+#ifdef USE_CUDA
+void CHECK(int err);
+
+void* CudaHostBufferAllocator::Allocate(size_t size)
+{
+   void* ptr;
+   CHECK(cudaHostAlloc(&ptr, size, cudaHostAllocMapped));
+   return ptr;
+}
+
+void CudaHostBufferAllocator::Free(void* ptr, size_t size)
+{
+   CHECK(cudaFreeHost(ptr));
+}
+#endif
+
+
+#ifdef __linux__
+size_t MmapBufferAllocator::MappedSize(size_t size, bool huge)
+{
+   size_t page = huge ? huge_page_size : SystemPageSize();
+   return ((size + page - 1) / page) * page;
+}
+
+QString MmapBufferAllocator::GetName()
+{
+   QString name = (options.huge_pages == None) ? "mmap" : (options.huge_pages == Transparent) ? "thp" : "hugepages";
+   if (options.lock)
+      name.append("-locked");
+   if (options.numa_node >= 0)
+      name.append(QString("@%1").arg(options.numa_node));
+   return name;
+}
+
+void* MmapBufferAllocator::Allocate(size_t size)
+{
+   int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+   void* ptr = MAP_FAILED;
+
+   if (options.huge_pages == Explicit)
+   {
+      ptr = mmap(nullptr, MappedSize(size, true), PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+      if (ptr == MAP_FAILED)
+         std::cout << "Could not reserve huge pages, falling back to transparent huge pages\n";
+   }
+
+   // Huge page aligned so that transparent huge pages can back the whole buffer
+   bool huge = (options.huge_pages != None);
+   size_t mapped_size = MappedSize(size, huge);
+
+   if (ptr == MAP_FAILED)
+   {
+      ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+      if (ptr == MAP_FAILED)
+         throw std::bad_alloc();
+
+      if (huge)
+         madvise(ptr, mapped_size, MADV_HUGEPAGE);
+   }
+
+   // Placement must be set before the pages are first touched
+   if (options.numa_node >= 0 && options.numa_node < 64)
+   {
+      const int mpol_bind = 2;
+      unsigned long nodemask = 1UL << options.numa_node;
+      if (syscall(SYS_mbind, ptr, mapped_size, mpol_bind, &nodemask, 64, 0) != 0)
+         std::cout << "Could not bind buffer to NUMA node " << options.numa_node << "\n";
+   }
+
+   bool locked = options.lock && (mlock(ptr, mapped_size) == 0);
+   if (options.lock && !locked)
+      std::cout << "Could not lock buffer in memory, check RLIMIT_MEMLOCK\n";
+
+   // mlock faults every page in; otherwise touch each page ourselves
+   if (options.prefault && !locked)
+      PrefaultPages(ptr, mapped_size, SystemPageSize());
+
+   return ptr;
+}
+
+void MmapBufferAllocator::Free(void* ptr, size_t size)
+{
+   size_t mapped_size = MappedSize(size, options.huge_pages != None);
+   if (options.lock)
+      munlock(ptr, mapped_size);
+   munmap(ptr, mapped_size);
+}
+#endif
+
+
+std::shared_ptr<BufferAllocator> CreateBufferAllocator(const QString& name)
+{
+   QStringList parts = name.split("@");
+   QString type = parts[0].trimmed().toLower();
+   int numa_node = (parts.size() > 1) ? parts[1].toInt() : -1;
+
+#ifdef USE_CUDA
+   if (type == "cuda")
+      return std::make_shared<CudaHostBufferAllocator>();
+#endif
+
+#ifdef __linux__
+   if (type.startsWith("mmap") || type.startsWith("thp") || type.startsWith("hugepages"))
+   {
+      MmapBufferAllocator::Options options;
+      if (type.startsWith("hugepages"))
+         options.huge_pages = MmapBufferAllocator::Explicit;
+      else if (type.startsWith("thp"))
+         options.huge_pages = MmapBufferAllocator::Transparent;
+      else
+         options.huge_pages = MmapBufferAllocator::None;
+      options.lock = type.endsWith("-locked");
+      options.numa_node = numa_node;
+      return std::make_shared<MmapBufferAllocator>(options);
+   }
+#endif
+
+   if (type != "malloc")
+      std::cout << "Buffer allocator '" << name.toStdString() << "' not available, using malloc\n";
+
+   return std::make_shared<MallocBufferAllocator>();
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <QString>
+#include <memory>
+#include <cstddef>
+
+/*
+   Allocates the frame buffers of an AbstractStreamingCamera.
+   Allocate should return memory which won't page fault when first
+   written, where the implementation can arrange it, so that the
+   acquisition loop never waits on the kernel.
+*/
+class BufferAllocator
+{
+public:
+   virtual ~BufferAllocator() {};
+
+   virtual void* Allocate(size_t size) = 0;
+   virtual void Free(void* ptr, size_t size) = 0;
+   virtual QString GetName() = 0;
+};
+
+/*
+   Plain malloc, pre-faulted by writing to every page
+*/
+class MallocBufferAllocator : public BufferAllocator
+{
+public:
+   void* Allocate(size_t size);
+   void Free(void* ptr, size_t size);
+   QString GetName() { return "malloc"; }
+};
+
+#ifdef USE_CUDA
+/*
+   Page-locked host memory mapped into the CUDA address space
+*/
+class CudaHostBufferAllocator : public BufferAllocator
+{
+public:
+   void* Allocate(size_t size);
+   void Free(void* ptr, size_t size);
+   QString GetName() { return "cuda"; }
+};
+#endif
+
+#ifdef __linux__
+/*
+   Anonymous mmap allocations with optional huge pages, page locking and
+   NUMA placement. If explicit huge pages can't be reserved the allocation
+   falls back to transparent huge pages. Locking requires a sufficient
+   RLIMIT_MEMLOCK; if it fails the memory is still pre-faulted.
+*/
+class MmapBufferAllocator : public BufferAllocator
+{
+public:
+
+   enum HugePages { None, Transparent, Explicit };
+
+   struct Options
+   {
+      HugePages huge_pages = Transparent;
+      bool lock = true;
+      bool prefault = true;
+      int numa_node = -1; // -1 for the default policy
+   };
+
+   MmapBufferAllocator(const Options& options = Options()) : options(options) {}
+
+   void* Allocate(size_t size);
+   void Free(void* ptr, size_t size);
+   QString GetName();
+
+private:
+   size_t MappedSize(size_t size, bool huge);
+
+   Options options;
+   size_t huge_page_size = 2 << 20;
+};
+#endif
+
+/*
+   Allocator by name, for runtime selection: "malloc", "cuda", or "mmap",
+   "thp" (transparent huge pages) or "hugepages" (explicit, falling back
+   to transparent), each optionally with "-locked" and "@<numa node>",
+   e.g. "hugepages-locked@1". Returns the malloc
+   allocator if the name isn't available on this platform.
+*/
+std::shared_ptr<BufferAllocator> CreateBufferAllocator(const QString& name);
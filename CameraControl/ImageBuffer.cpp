@@ -7,37 +7,35 @@ ImageBuffer::ImageBuffer()
    image = cv::Mat::zeros(128, 128, CV_8U);
 }
 
-ImageBuffer::ImageBuffer(cv::Mat image, cv::Mat& background, AbstractStreamingCamera* camera, int image_index) :
+ImageBuffer::ImageBuffer(cv::Mat image, AbstractStreamingCamera* camera, int image_index) :
    camera(camera), 
    image(image),
    image_index(image_index),
    is_null(false)
 {
-   allocation_idx = camera->allocation_idx;
-
-   if (background.size() == image.size())
-      background_subtracted = image - background;
-   else
-      background_subtracted = image;
 }
 
 cv::Mat& ImageBuffer::GetImage()
 {
-   if (!is_null && (camera->allocation_idx != allocation_idx))
-      image = cv::Mat::zeros(128, 128, CV_8U);
    return image;
 }
 
 cv::Mat& ImageBuffer::GetBackgroundSubtractedImage()
 {
-   if (!is_null && (camera->allocation_idx != allocation_idx))
-      image = cv::Mat::zeros(128, 128, CV_8U);
+   cv::Mat& raw = GetImage();
+
+   std::call_once(correction_flag, [&]()
+   {
+      if (!is_null)
+         corrected_frame = camera->CorrectImage(raw);
+      background_subtracted = corrected_frame ? *corrected_frame : raw;
+   });
 
    return background_subtracted;
 }
 
 ImageBuffer::~ImageBuffer()
 {
-   if (!is_null && (camera->allocation_idx == allocation_idx))
+   if (!is_null)
       camera->QueuePointer(image.data);
-}
\ No newline at end of file
+}
@@ -1,18 +1,26 @@
 #pragma once
 
+#include "FramePool.h"
+
 #include <cv.h>
+#include <mutex>
 
 class AbstractStreamingCamera;
 
 /*
 An image buffer wrapper for AbstractStreamingCamera
+
+The dark/flat corrected image is computed on first request, into a
+buffer from the camera's pool, so frames nobody asks for aren't corrected.
+The camera buffer stays valid until the ImageBuffer is destroyed, even
+if the camera reallocates its buffers in the meantime.
 */
 
 class ImageBuffer
 {
 public:
    ImageBuffer();
-   ImageBuffer(cv::Mat image, cv::Mat& background, AbstractStreamingCamera* camera, int image_index);
+   ImageBuffer(cv::Mat image, AbstractStreamingCamera* camera, int image_index);
 
    cv::Mat& GetImage();
    cv::Mat& GetBackgroundSubtractedImage();
@@ -23,8 +31,9 @@ private:
    AbstractStreamingCamera* camera;
    cv::Mat image;
    cv::Mat background_subtracted;
+   PooledFrame corrected_frame;
+   std::once_flag correction_flag;
    bool is_null = true;
-   int allocation_idx = -1;
    int image_index = 0;
 };
 
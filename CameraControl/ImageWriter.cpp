@@ -13,7 +13,7 @@ camera(camera)
 
 void ImageWriter::init()
 {
-   connect(camera, &ImageSource::NewImage, this, &ImageWriter::ImageUpdated, Qt::QueuedConnection);
+   connect(camera, &ImageSource::newImage, this, &ImageWriter::ImageUpdated, Qt::QueuedConnection);
 };
 
 void ImageWriter::SetFilenameRoot(const QString& file_root_)
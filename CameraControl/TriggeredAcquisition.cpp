@@ -0,0 +1,211 @@
+#include "TriggeredAcquisition.h"
+
+#include <QDateTime>
+#include <cmath>
+#include <iostream>
+#include <chrono>
+
+TriggeredAcquisition::TriggeredAcquisition(AbstractStreamingCamera* camera, ArduinoCounter* trigger_source, QObject* parent) :
+   QObject(parent),
+   camera(camera),
+   trigger_source(trigger_source)
+{
+}
+
+TriggeredAcquisition::~TriggeredAcquisition()
+{
+   Stop();
+}
+
+std::shared_future<bool> TriggeredAcquisition::Start()
+{
+   Stop();
+
+   auto promise = std::make_shared<std::promise<bool>>();
+   std::shared_future<bool> future = promise->get_future().share();
+
+   stop_requested = false;
+   running = true;
+   worker = std::thread([this, promise]()
+   {
+      bool success = Run();
+      running = false;
+      promise->set_value(success);
+      emit Finished(success);
+   });
+
+   return future;
+}
+
+void TriggeredAcquisition::Stop()
+{
+   stop_requested = true;
+   if (worker.joinable())
+      worker.join();
+}
+
+TriggeredAcquisition::TriggerSettings TriggeredAcquisition::GetTriggerSettings()
+{
+   TriggerSettings settings;
+   settings.use_external_pixel_clock = trigger_source->GetUseExternalClock();
+   settings.dwell_time_ms = trigger_source->GetDwellTime();
+   settings.pixels_per_line = trigger_source->GetPixelsPerLine();
+   settings.trigger_divisor = trigger_source->GetTriggerDivisor();
+   settings.trigger_delay_us = trigger_source->GetTriggerDelay();
+   settings.trigger_duration_us = trigger_source->GetTriggerDuration();
+   return settings;
+}
+
+/*
+   The setters are coalesced into a single configuration message
+*/
+void TriggeredAcquisition::ApplyTriggerSettings(const TriggerSettings& settings)
+{
+   trigger_source->SetUseExternalPixelClock(settings.use_external_pixel_clock);
+   trigger_source->SetDwellTime(settings.dwell_time_ms);
+   trigger_source->SetPixelsPerLine(settings.pixels_per_line);
+   trigger_source->SetTriggerDivisor(settings.trigger_divisor);
+   trigger_source->SetTriggerDelay(settings.trigger_delay_us);
+   trigger_source->SetTriggerDuration(settings.trigger_duration_us);
+   QMetaObject::invokeMethod(trigger_source, "flushParameters", Qt::QueuedConnection);
+}
+
+bool TriggeredAcquisition::Run()
+{
+   n_dropped = 0;
+
+   std::vector<ScanPoint> points;
+   if (use_plan)
+      points = plan.GeneratePoints();
+
+   if (use_plan && (int) points.size() < n_frames)
+   {
+      std::cout << "Triggered acquisition plan has fewer points than frames\n";
+      return false;
+   }
+
+   AbstractStreamingCamera::TriggerMode previous_trigger_mode = camera->GetTriggerMode();
+   TriggerSettings previous_trigger_settings = GetTriggerSettings();
+
+   // The trigger mode can't be changed while the camera is streaming
+   bool was_streaming = camera->IsStreaming();
+   camera->StopStreaming();
+
+   if (!camera->SetTriggerMode(AbstractStreamingCamera::External))
+   {
+      std::cout << "Could not switch camera to external trigger\n";
+      if (was_streaming)
+         camera->SetStreamingStatus(true);
+      return false;
+   }
+
+   camera->SetStreamingStatus(true);
+   camera->ArmCapture(n_frames);
+
+   // One line of n_frames pixels, with a trigger on every pixel clock
+   TriggerSettings trigger_settings;
+   trigger_settings.dwell_time_ms = frame_period_ms;
+   trigger_settings.pixels_per_line = n_frames;
+   trigger_settings.trigger_divisor = 1;
+   trigger_settings.trigger_delay_us = trigger_delay_us;
+   trigger_settings.trigger_duration_us = trigger_duration_us;
+   ApplyTriggerSettings(trigger_settings);
+
+   for (auto sink : sinks)
+      sink->BeginScan(plan);
+
+   QMetaObject::invokeMethod(trigger_source, "StartLine", Qt::QueuedConnection);
+
+   // Allow for the first frame to be exposed and read out
+   int timeout_ms = (int) (2 * frame_period_ms) + 1000;
+
+   bool success = true;
+   AbstractStreamingCamera::CapturedFrame first_frame;
+   int trigger_index = 0;
+
+   for (int i = 0; i < n_frames; i++)
+   {
+      AbstractStreamingCamera::CapturedFrame frame;
+
+      bool received = false;
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+      while (!received && !stop_requested && std::chrono::steady_clock::now() < deadline)
+         received = camera->WaitForCapturedFrame(i, frame, 50);
+
+      if (!received)
+      {
+         // Any remaining triggers produced no frames
+         if (!stop_requested)
+         {
+            std::cout << "Timed out waiting for triggered frame " << i << "\n";
+            n_dropped += n_frames - trigger_index;
+            emit FramesDropped(n_dropped);
+         }
+         success = false;
+         break;
+      }
+
+      if (i == 0)
+         first_frame = frame;
+
+      // Frames are in trigger order; if the camera's frame counter skips, or
+      // a frame is a whole period late relative to its sequence, earlier 
+      // triggers produced no frame
+      int expected;
+      if (first_frame.hardware_frame >= 0)
+      {
+         expected = (int) (frame.hardware_frame - first_frame.hardware_frame);
+      }
+      else
+      {
+         bool hardware_time = (first_frame.hardware_timestamp_us >= 0);
+         qint64 t0 = hardware_time ? first_frame.hardware_timestamp_us : first_frame.timestamp_us;
+         qint64 t = hardware_time ? frame.hardware_timestamp_us : frame.timestamp_us;
+         expected = (int) std::round((t - t0) / (1e3 * frame_period_ms));
+      }
+
+      if (detect_dropped_frames && expected > trigger_index)
+      {
+         n_dropped += expected - trigger_index;
+         emit FramesDropped(n_dropped);
+         trigger_index = expected;
+      }
+
+      if (trigger_index >= n_frames)
+         break;
+
+      ScanPoint point;
+      if (use_plan)
+         point = points[trigger_index];
+      else
+         point.index = trigger_index;
+      point.timestamp_ms = QDateTime::currentMSecsSinceEpoch();
+
+      // The frame is in a camera buffer which is reused once the capture is 
+      // disarmed, so sinks get their own copy
+      cv::Mat image = frame.image.clone();
+      for (auto sink : sinks)
+         sink->AddImage(point, image);
+
+      emit FrameAcquired(trigger_index);
+      emit ProgressChanged((100 * (trigger_index + 1)) / n_frames);
+
+      trigger_index++;
+   }
+
+   QMetaObject::invokeMethod(trigger_source, "Stop", Qt::QueuedConnection);
+
+   for (auto sink : sinks)
+      sink->EndScan();
+
+   camera->DisarmCapture();
+   camera->StopStreaming();
+   if (!camera->SetTriggerMode(previous_trigger_mode))
+      std::cout << "Could not restore camera trigger mode\n";
+   ApplyTriggerSettings(previous_trigger_settings);
+
+   if (was_streaming)
+      camera->SetStreamingStatus(true);
+
+   return success && (n_dropped == 0);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "AbstractStreamingCamera.h"
+#include "ArduinoCounter.h"
+#include "ScanEngine.h"
+
+#include <QObject>
+
+#include <thread>
+#include <future>
+#include <atomic>
+#include <vector>
+
+/*
+   Hardware timed acquisition: the Arduino generates one trigger per pixel
+   clock period and the camera runs in External trigger mode, so frame
+   timing doesn't depend on the host.
+
+   Frames are captured into a pool armed before the first trigger and are
+   matched to trigger indices in order. Dropped frames are detected with
+   the camera's frame counter if it has one (Ximea), otherwise with its
+   frame timestamps (Andor, with metadata), after which frames are assigned
+   to the trigger nearest their timestamp. Only if the camera provides
+   neither are host arrival times used, which assumes host delivery jitter
+   is below half the frame period; if not, disable detection with
+   SetDetectDroppedFrames(false).
+
+   Streaming is stopped while the camera's trigger mode is changed. The
+   trigger mode, streaming state and the Arduino's clock settings are 
+   restored when the acquisition finishes.
+
+   If a plan is set its points label the triggers in order, e.g. the
+   positions of a stage moving at constant velocity during the acquisition;
+   its axes are not moved. Frames are passed to the sinks on the
+   acquisition thread.
+*/
+class TriggeredAcquisition : public QObject
+{
+   Q_OBJECT
+
+public:
+
+   TriggeredAcquisition(AbstractStreamingCamera* camera, ArduinoCounter* trigger_source, QObject* parent = 0);
+   ~TriggeredAcquisition();
+
+   void SetNumFrames(int n_frames_) { n_frames = n_frames_; }
+   int GetNumFrames() { return n_frames; }
+
+   void SetFramePeriod(double frame_period_ms_) { frame_period_ms = frame_period_ms_; }
+   double GetFramePeriod() { return frame_period_ms; }
+
+   void SetTriggerDuration(double trigger_duration_us_) { trigger_duration_us = trigger_duration_us_; }
+   void SetTriggerDelay(double trigger_delay_us_) { trigger_delay_us = trigger_delay_us_; }
+
+   void SetDetectDroppedFrames(bool detect_dropped_frames_) { detect_dropped_frames = detect_dropped_frames_; }
+
+   void SetPlan(const ScanPlan& plan_) { plan = plan_; use_plan = true; }
+   void AddSink(ScanSink* sink) { sinks.push_back(sink); }
+   void ClearSinks() { sinks.clear(); }
+
+   std::shared_future<bool> Start();
+   void Stop();
+   bool IsRunning() { return running; }
+
+   int GetNumDroppedFrames() { return n_dropped; }
+
+signals:
+   void FrameAcquired(int trigger_index);
+   void FramesDropped(int n_dropped);
+   void ProgressChanged(int percentage_progress);
+   void Finished(bool success);
+
+protected:
+
+   struct TriggerSettings
+   {
+      bool use_external_pixel_clock = false;
+      double dwell_time_ms = 0;
+      int pixels_per_line = 1;
+      int trigger_divisor = 1;
+      double trigger_delay_us = 0;
+      double trigger_duration_us = 0;
+   };
+
+   bool Run();
+   TriggerSettings GetTriggerSettings();
+   void ApplyTriggerSettings(const TriggerSettings& settings);
+
+   AbstractStreamingCamera* camera;
+   ArduinoCounter* trigger_source;
+
+   int n_frames = 100;
+   double frame_period_ms = 10;
+   double trigger_duration_us = 10;
+   double trigger_delay_us = 0;
+   bool detect_dropped_frames = true;
+
+   ScanPlan plan;
+   bool use_plan = false;
+   std::vector<ScanSink*> sinks;
+
+   std::thread worker;
+   std::atomic<bool> running = { false };
+   std::atomic<bool> stop_requested = { false };
+   std::atomic<int> n_dropped = { 0 };
+};
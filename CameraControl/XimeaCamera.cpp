@@ -42,6 +42,13 @@ AbstractStreamingCamera(parent)
    // Retrieving a handle to the camera device 
    Check(xiOpenDevice(0, &xiH));
 
+   width = getTypedParameter<int>(XI_PRM_WIDTH);
+   height = getTypedParameter<int>(XI_PRM_HEIGHT);
+   offset_x = getTypedParameter<int>(XI_PRM_OFFSET_X);
+   offset_y = getTypedParameter<int>(XI_PRM_OFFSET_Y);
+   bit_depth = getTypedParameter<int>(XI_PRM_OUTPUT_DATA_BIT_DEPTH);
+   exposure_us = getTypedParameter<int>(XI_PRM_EXPOSURE);
+
    StartThread();
 }
 
@@ -76,27 +83,47 @@ QWidget* XimeaCamera::GetControlWidget(QWidget* parent)
    return new XimeaControlDisplay(this, parent);
 }
 
-void XimeaCamera::SetTriggerMode(TriggerMode trigger_mode)
+AbstractStreamingCamera::TriggerMode XimeaCamera::GetTriggerMode()
 {
-   if (trigger_mode == Internal)
-      SetParameter(XI_PRM_TRG_SOURCE, Integer, XI_TRG_OFF);
-   if (trigger_mode == Software)
-      SetParameter(XI_PRM_TRG_SOURCE, Integer, XI_TRG_SOFTWARE);
+   int source = getParameter(XI_PRM_TRG_SOURCE, Integer).toInt();
+   if (source == XI_TRG_OFF)
+      return Internal;
+   else if (source == XI_TRG_SOFTWARE)
+      return Software;
    else
-      SetParameter(XI_PRM_TRG_SOURCE, Integer, XI_TRG_EDGE_RISING);
+      return External;
+}
+
+bool XimeaCamera::SetTriggerMode(TriggerMode trigger_mode)
+{
+   int source = XI_TRG_EDGE_RISING;
+   if (trigger_mode == Internal)
+      source = XI_TRG_OFF;
+   else if (trigger_mode == Software)
+      source = XI_TRG_SOFTWARE;
+
+   try
+   {
+      setParameter(XI_PRM_TRG_SOURCE, Integer, source);
+   }
+   catch (std::exception& e)
+   {
+      std::cout << "Could not set Ximea trigger mode: " << e.what() << "\n";
+      return false;
+   }
+   return true;
 }
 
 void XimeaCamera::SoftwareTrigger()
 {
-   xiSetParamInt(xiH, XI_PRM_TRG_SOFTWARE, 0);
+   runCommand([this]() { xiSetParamInt(xiH, XI_PRM_TRG_SOFTWARE, 0); });
 }
 
-void XimeaCamera::SetParameter(const QString& parameter, ParameterType type, QVariant value)
+void XimeaCamera::writeParameter(const ParameterInfo& parameter, QVariant value)
 {
-   QByteArray b = parameter.toUtf8();
-   const char* param = b.constData();
+   const char* param = parameter.key.constData();
 
-   switch (type)
+   switch (parameter.type)
    {
    case Integer:
    case Boolean:
@@ -116,11 +143,13 @@ void XimeaCamera::SetParameter(const QString& parameter, ParameterType type, QVa
    }
 }
 
-QVariant XimeaCamera::GetParameter(const QString& parameter, ParameterType type)
+QVariant XimeaCamera::readParameter(const ParameterInfo& parameter)
 {
-   QByteArray b = parameter.toUtf8();
-   const char* param = b.constData();
+   return ReadParameter(parameter.key.constData(), parameter.type);
+}
 
+QVariant XimeaCamera::ReadParameter(const char* param, ParameterType type)
+{
    QVariant value;
 
    switch (type)
@@ -150,28 +179,29 @@ QVariant XimeaCamera::GetParameter(const QString& parameter, ParameterType type)
    return value;
 }
 
-QVariant XimeaCamera::GetParameterLimit(const QString& parameter, ParameterType type, Limit limit)
+QVariant XimeaCamera::readParameterLimit(const ParameterInfo& parameter, Limit limit)
 {
-   QString p = parameter;
+   QByteArray p = parameter.key;
    
    if (limit == Limit::Min)
       p.append(XI_PRM_INFO_MIN);
    else
       p.append(XI_PRM_INFO_MAX);
 
-   return GetParameter(p, type);
+   return ReadParameter(p.constData(), parameter.type);
 }
 
-QVariant XimeaCamera::GetParameterMinIncrement(const QString& parameter, ParameterType type)
+QVariant XimeaCamera::readParameterMinIncrement(const ParameterInfo& parameter)
 {
-   QString p = parameter;
+   QByteArray p = parameter.key;
 
    p.append(XI_PRM_INFO_INCREMENT);
-   return GetParameter(p, type);
+   return ReadParameter(p.constData(), parameter.type);
 }
 
-EnumerationList XimeaCamera::GetEnumerationList(const QString& parameter)
+EnumerationList XimeaCamera::readEnumerationList(const ParameterInfo& info)
 {
+   const QString& parameter = info.name;
    EnumerationList list;
 
    auto Add = [&](QString s, int i) { list.append(QPair<QString, int>(s, i)); };
@@ -231,44 +261,37 @@ EnumerationList XimeaCamera::GetEnumerationList(const QString& parameter)
    return list;
 }
 
+/*
+   Ximea has no change callbacks, so anything the camera updates by
+   itself mustn't be cached
+*/
+bool XimeaCamera::isParameterVolatile(const QString& parameter)
+{
+   return parameter.contains("temp") || parameter.contains("counter");
+}
+
 
 int XimeaCamera::GetNumBytesPerPixel()
 {
-   int bit_depth;
-   Check(xiGetParamInt(xiH, XI_PRM_OUTPUT_DATA_BIT_DEPTH, &bit_depth));
-
-   //bytes_per_pixel = ;
-   return bit_depth / 8;
+   return bit_depth.get() / 8;
 }
 
 cv::Size XimeaCamera::GetImageSize()
 {
-   int image_width, image_height;
-   Check(xiGetParamInt(xiH, XI_PRM_WIDTH, &image_width));
-   Check(xiGetParamInt(xiH, XI_PRM_HEIGHT, &image_height));
-
-   //image_size = cv::Size(image_width, image_height);
-   //return cv::Size(image_width, image_height);
+   // Frames are currently cropped to 1024x1024, see run()
    return cv::Size(1024, 1024);
 }
 
 
 int XimeaCamera::GetImageSizeBytes()
 {
-   int image_width, image_height;
-   Check(xiGetParamInt(xiH, XI_PRM_WIDTH, &image_width));
-   Check(xiGetParamInt(xiH, XI_PRM_HEIGHT, &image_height));
-
-   return image_width * image_height * GetNumBytesPerPixel();
+   return width.get() * height.get() * GetNumBytesPerPixel();
 }
 
 int XimeaCamera::GetStride()
 {
    // Image stride is always width
-
-   int image_width;
-   Check(xiGetParamInt(xiH, XI_PRM_WIDTH, &image_width));
-   return image_width;
+   return width.get();
 }
 
 double XimeaCamera::GetPixelSize()
@@ -279,37 +302,37 @@ double XimeaCamera::GetPixelSize()
 
 cv::Rect XimeaCamera::GetROI()
 {
-   int w, h, x, y;
-   Check(xiGetParamInt(xiH, XI_PRM_WIDTH, &w));
-   Check(xiGetParamInt(xiH, XI_PRM_HEIGHT, &h));
-   Check(xiGetParamInt(xiH, XI_PRM_OFFSET_X, &x));
-   Check(xiGetParamInt(xiH, XI_PRM_OFFSET_X, &y));
-
-   return cv::Rect(x, y, w, h);
+   return cv::Rect(offset_x.get(), offset_y.get(), width.get(), height.get());
 }
 
 void XimeaCamera::SetFullROI()
 {
-   int w, h, x, y;
-   Check(xiGetParamInt(xiH, XI_PRM_WIDTH XI_PRM_INFO_MAX, &w));
-   Check(xiGetParamInt(xiH, XI_PRM_HEIGHT XI_PRM_INFO_MAX, &h));
-   Check(xiGetParamInt(xiH, XI_PRM_OFFSET_X XI_PRM_INFO_MAX, &x));
-   Check(xiGetParamInt(xiH, XI_PRM_OFFSET_Y XI_PRM_INFO_MAX, &y));
-
-   Check(xiSetParamInt(xiH, XI_PRM_WIDTH, w));
-   Check(xiSetParamInt(xiH, XI_PRM_HEIGHT, h));
-   Check(xiSetParamInt(xiH, XI_PRM_OFFSET_X, x));
-   Check(xiSetParamInt(xiH, XI_PRM_OFFSET_Y, y));
+   int w = width.limit(Max);
+   int h = height.limit(Max);
+   int x = offset_x.limit(Max);
+   int y = offset_y.limit(Max);
+
+   SetROI(cv::Rect(x, y, w, h));
 }
 
 
 
 void XimeaCamera::SetROI(cv::Rect roi)
 {
-   Check(xiSetParamInt(xiH, XI_PRM_WIDTH, roi.width));
-   Check(xiSetParamInt(xiH, XI_PRM_HEIGHT, roi.height));
-   Check(xiSetParamInt(xiH, XI_PRM_OFFSET_X, roi.x));
-   Check(xiSetParamInt(xiH, XI_PRM_OFFSET_Y, roi.y));
+   setParameters({ { XI_PRM_WIDTH, Integer, roi.width },
+                   { XI_PRM_HEIGHT, Integer, roi.height },
+                   { XI_PRM_OFFSET_X, Integer, roi.x },
+                   { XI_PRM_OFFSET_Y, Integer, roi.y } });
+}
+
+double XimeaCamera::GetExposureTime()
+{
+   return exposure_us.get() * 1e-6;
+}
+
+void XimeaCamera::SetExposureTime(double exposure_s)
+{
+   exposure_us.set((int) (exposure_s * 1e6));
 }
 
 
@@ -382,7 +405,10 @@ void XimeaCamera::run()
          cv::Mat image(image_size, image_type, img.bp, stride);
          cv::Rect r(0, 0, 1024, 1024);
          cv::Mat im2 = image(r);
-         SetLatest(im2);
+
+         // Frame counter and timestamp from the camera, independent of host timing
+         qint64 timestamp_us = (qint64) img.tsSec * 1000000 + img.tsUSec;
+         SetLatest(im2, img.nframe, timestamp_us);
       }
       
       else if (errorValue == 10)
@@ -416,6 +442,8 @@ void XimeaCamera::FlushBuffers()
 
 XimeaCamera::~XimeaCamera()
 {
+   stopParameterThreads();
+
    if (xiH)
       xiCloseDevice(xiH);
 }
@@ -423,9 +451,7 @@ XimeaCamera::~XimeaCamera()
 void XimeaCamera::SetIntegrationTime(int integration_time_ms)
 {
    integration_time_us = integration_time_ms * 1000;
-
-   // Setting "exposure" parameter (1ms)
-   Check(xiSetParam(xiH, XI_PRM_EXPOSURE, &integration_time_us, sizeof(integration_time_us), xiTypeInteger));
+   exposure_us.set(integration_time_us);
 }
 
 
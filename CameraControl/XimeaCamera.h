@@ -30,6 +30,9 @@ public:
    void SetFullROI();
    void SetROI(cv::Rect roi);
 
+   double GetExposureTime();
+   void SetExposureTime(double exposure_s);
+
    std::shared_ptr<ImageBuffer> GrabImage();
 
    void* GetHandle() { return xiH; }
@@ -37,27 +40,38 @@ public:
 
    void GetImage(cv::Mat& cv_output);
    void SetIntegrationTime(int integration_time_ms_);
-   void SetTriggerMode(TriggerMode trigger_mode);
+   TriggerMode GetTriggerMode();
+   bool SetTriggerMode(TriggerMode trigger_mode);
    void SoftwareTrigger();
 
-   void SetParameter(const QString& parameter, ParameterType type, QVariant value);
-   QVariant GetParameter(const QString& parameter, ParameterType type);
-   QVariant GetParameterLimit(const QString& parameter, ParameterType type, Limit limit);
-   QVariant GetParameterMinIncrement(const QString& parameter, ParameterType type);
-   EnumerationList GetEnumerationList(const QString& parameter);
-   bool IsParameterWritable(const QString& parameter) { return true; }; // no algorithmic way to check 
-
    QWidget* GetControlWidget(QWidget* parent);
 
 protected:
 
+   void writeParameter(const ParameterInfo& parameter, QVariant value);
+   QVariant readParameter(const ParameterInfo& parameter);
+   QVariant readParameterLimit(const ParameterInfo& parameter, Limit limit);
+   QVariant readParameterMinIncrement(const ParameterInfo& parameter);
+   EnumerationList readEnumerationList(const ParameterInfo& parameter);
+   bool readParameterWritable(const ParameterInfo& parameter) { return true; }; // no algorithmic way to check 
+   bool isParameterVolatile(const QString& parameter);
+
    void run();
    void FlushBuffers();
 
 
 private:
+   QVariant ReadParameter(const char* param, ParameterType type);
+
    void* xiH;
 
+   TypedParameter<int> width;
+   TypedParameter<int> height;
+   TypedParameter<int> offset_x;
+   TypedParameter<int> offset_y;
+   TypedParameter<int> bit_depth;
+   TypedParameter<int> exposure_us;
+
    int integration_time_us = 100000;
    int timeout_ms = 1000;
 };
\ No newline at end of file
@@ -75,8 +75,8 @@ camera(camera), QWidget(parent)
    QFormLayout* acq_layout = new QFormLayout();
    
    //AddWidget(acq_layout, XI_PRM_IMAGE_DATA_FORMAT, Enumeration);
-   AddWidget(acq_layout, XI_PRM_EXPOSURE, Integer, " us", true); // use timer -> auto exposure is possible
-   AddWidget(acq_layout, XI_PRM_GAIN, Float, " dB", true); // use timer -> auto gain is possible
+   AddWidget(acq_layout, XI_PRM_EXPOSURE, Integer, " us", true); // poll -> auto exposure is possible
+   AddWidget(acq_layout, XI_PRM_GAIN, Float, " dB", true); // poll -> auto gain is possible
    AddWidget(acq_layout, XI_PRM_DOWNSAMPLING, Integer);
    AddWidget(acq_layout, XI_PRM_FRAMERATE, Float, " Hz");
    AddWidget(acq_layout, XI_PRM_TRG_SOURCE, Enumeration);
@@ -24,17 +24,9 @@ private:
    template<typename... Args>
    void AddWidget(Args... args)
    {
-      ParameterWidget* w = new ParameterWidget(camera, args...);
-      widgets.push_back(w);
-      
-      // Ximea api provides no callback, so manually check all widgets when one value changes
-      connect(w, &ParameterWidget::ValueChanged, this, &XimeaControlDisplay::UpdateWidgets);
-   }
-
-   void UpdateWidgets()
-   {
-      for (auto& w : widgets)
-         w->SetWidgetValue();
+      // Ximea api provides no callback, but every write invalidates the camera's 
+      // parameter cache, after which the camera pushes any changed values
+      widgets.push_back(new ParameterWidget(camera, args...));
    }
 
    void UpdateStreamingStatus(bool is_streaming);
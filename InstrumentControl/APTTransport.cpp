@@ -0,0 +1,122 @@
+#include "APTTransport.h"
+
+#ifdef USE_FTDI_APT_TRANSPORT
+#include "FTDIAPTTransport.h"
+#endif
+
+QByteArray APTMessage::toBytes() const
+{
+   QByteArray bytes;
+   QDataStream ds(&bytes, QIODevice::WriteOnly);
+   ds.setByteOrder(QDataStream::LittleEndian);
+
+   ds << id << param1 << param2 << dest << src;
+   bytes.append(data);
+
+   return bytes;
+}
+
+APTMessage APTMessage::command(quint16 id, quint8 param1, quint8 param2, quint8 dest, quint8 src)
+{
+   APTMessage message;
+   message.id = id;
+   message.param1 = param1;
+   message.param2 = param2;
+   message.dest = dest;
+   message.src = src;
+   return message;
+}
+
+APTMessage APTMessage::commandWithData(quint16 id, const QByteArray& data, quint8 dest, quint8 src)
+{
+   APTMessage message = command(id, data.size() & 0xFF, (data.size() >> 8) & 0xFF, dest | 0x80, src);
+   message.data = data;
+   return message;
+}
+
+/*
+   Extract the next complete message from the buffer, returns false if
+   we don't have one yet
+*/
+bool APTMessageParser::next(APTMessage& message)
+{
+   const int header_size = 6;
+
+   if (buffer.size() < header_size)
+      return false;
+
+   QDataStream ds(buffer);
+   ds.setByteOrder(QDataStream::LittleEndian);
+   ds >> message.id >> message.param1 >> message.param2 >> message.dest >> message.src;
+
+   int data_length = message.hasData() ? message.dataLength() : 0;
+
+   if (buffer.size() < header_size + data_length)
+      return false;
+
+   message.data = buffer.mid(header_size, data_length);
+   buffer.remove(0, header_size + data_length);
+
+   return true;
+}
+
+void LoopbackAPTTransport::close()
+{
+   std::lock_guard<std::mutex> lk(m);
+   is_open = false;
+   cv.notify_all();
+}
+
+void LoopbackAPTTransport::write(const QByteArray& data)
+{
+   std::list<APTMessage> messages;
+   {
+      std::lock_guard<std::mutex> lk(m);
+      from_host.append(data);
+
+      APTMessage message;
+      while (from_host.next(message))
+      {
+         written.push_back(message);
+         messages.push_back(message);
+      }
+   }
+
+   if (responder)
+      for (auto& message : messages)
+         responder(message, *this);
+}
+
+QByteArray LoopbackAPTTransport::read(int timeout_ms)
+{
+   std::unique_lock<std::mutex> lk(m);
+   cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&] { return !to_host.isEmpty() || !is_open; });
+
+   QByteArray data = to_host;
+   to_host.clear();
+   return data;
+}
+
+void LoopbackAPTTransport::inject(const QByteArray& data)
+{
+   std::lock_guard<std::mutex> lk(m);
+   to_host.append(data);
+   cv.notify_all();
+}
+
+std::list<APTMessage> LoopbackAPTTransport::takeWritten()
+{
+   std::lock_guard<std::mutex> lk(m);
+   std::list<APTMessage> w;
+   w.swap(written);
+   return w;
+}
+
+AbstractAPTTransport* CreateFTDIAPTTransport(const QString& description)
+{
+#ifdef USE_FTDI_APT_TRANSPORT
+   return new FTDIAPTTransport(description);
+#else
+   return nullptr;
+#endif
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QDataStream>
+
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <cstdint>
+
+/*
+   A complete Thorlabs APT message: 6 byte header, optionally followed by
+   a data packet whose length is given by param1/param2.
+   See the APT communications protocol document.
+*/
+struct APTMessage
+{
+   quint16 id = 0;
+   quint8 param1 = 0;
+   quint8 param2 = 0;
+   quint8 dest = 0;
+   quint8 src = 0;
+   QByteArray data;
+
+   bool hasData() const { return dest & 0x80; }
+   int dataLength() const { return param1 | (param2 << 8); }
+
+   QByteArray toBytes() const;
+   static APTMessage command(quint16 id, quint8 param1 = 0, quint8 param2 = 0, quint8 dest = 0x50, quint8 src = 0x01);
+   static APTMessage commandWithData(quint16 id, const QByteArray& data, quint8 dest = 0x50, quint8 src = 0x01);
+};
+
+/*
+   Splits a byte stream from an APT device into complete messages
+*/
+class APTMessageParser
+{
+public:
+   void append(const QByteArray& bytes) { buffer.append(bytes); }
+   bool next(APTMessage& message);
+   void clear() { buffer.clear(); }
+
+private:
+   QByteArray buffer;
+};
+
+/*
+   Byte transport to an APT device. read() should block until some data
+   is available or the timeout expires, rather than polling.
+*/
+class AbstractAPTTransport
+{
+public:
+   virtual ~AbstractAPTTransport() {};
+
+   virtual void open() = 0;
+   virtual void close() = 0;
+   virtual bool isOpen() = 0;
+
+   virtual void write(const QByteArray& data) = 0;
+   virtual QByteArray read(int timeout_ms) = 0;
+};
+
+/*
+   In-memory transport for running the protocol layer without hardware.
+   Bytes passed to inject() are returned by read(). Complete messages
+   written by the host are passed to the responder, if set, which can
+   reply with inject() to simulate a device.
+*/
+class LoopbackAPTTransport : public AbstractAPTTransport
+{
+public:
+
+   typedef std::function<void(const APTMessage& message, LoopbackAPTTransport& transport)> Responder;
+
+   LoopbackAPTTransport(Responder responder = nullptr) :
+      responder(responder)
+   {}
+
+   void open() { is_open = true; }
+   void close();
+   bool isOpen() { return is_open; }
+
+   void write(const QByteArray& data);
+   QByteArray read(int timeout_ms);
+
+   void inject(const QByteArray& data);
+   void inject(const APTMessage& message) { inject(message.toBytes()); }
+
+   std::list<APTMessage> takeWritten();
+
+private:
+
+   Responder responder;
+   bool is_open = false;
+
+   std::mutex m;
+   std::condition_variable cv;
+   QByteArray to_host;
+
+   APTMessageParser from_host;
+   std::list<APTMessage> written;
+};
+
+/*
+   Transport to the FTDI device with the given description. Returns null 
+   if FTDI support wasn't built (USE_THORLABS_APT_CONTROLLER)
+*/
+AbstractAPTTransport* CreateFTDIAPTTransport(const QString& description);
@@ -17,7 +17,13 @@ AbstractArduinoDevice::AbstractArduinoDevice(QObject *parent, QThread* thread) :
 
 void AbstractArduinoDevice::init()
 {
-    connect(this, &AbstractArduinoDevice::newMessage, [](const QString& msg) { std::cout << msg.toStdString() << "\n"; });
+   connect(this, &AbstractArduinoDevice::newMessage, [](const QString& msg) { std::cout << msg.toStdString() << "\n"; });
+
+   coalesce_timer = new QTimer(this);
+   coalesce_timer->setSingleShot(true);
+   coalesce_timer->setInterval(coalesce_interval_ms);
+   connect(coalesce_timer, &QTimer::timeout, this, &AbstractArduinoDevice::flushParameters);
+
    SerialDevice::init();
 }
 
@@ -77,6 +83,34 @@ bool AbstractArduinoDevice::connectToPort(const QString& port)
 
 }
 
+/*
+   Append the 4 byte representation of a parameter to a message
+*/
+void AbstractArduinoDevice::packParameter(QByteArray& data, const QVariant& param)
+{
+   int type = param.userType();
+
+   if (type == QMetaType::Double || type == QMetaType::Float)
+   {
+      float q = param.toFloat();
+      data.append(reinterpret_cast<const char*>(&q), 4);
+   }
+   else if (type == QMetaType::Int || type == QMetaType::Bool)
+   {
+      int32_t q = param.toInt();
+      data.append(reinterpret_cast<const char*>(&q), 4);
+   }
+   else if (type == QMetaType::UInt)
+   {
+      uint32_t q = param.toUInt();
+      data.append(reinterpret_cast<const char*>(&q), 4);
+   }
+   else
+   {
+      throw std::runtime_error("Unexpected type send to Arduino");
+   }
+}
+
 void AbstractArduinoDevice::sendMessage(char msg, QVariant param, bool require_connection)
 {
    if (QThread::currentThread() != getThread())
@@ -85,38 +119,127 @@ void AbstractArduinoDevice::sendMessage(char msg, QVariant param, bool require_c
       return;
    }
 
-
    if (require_connection && !is_connected)
       return;
 
+   // Make sure any outstanding parameter changes arrive first
+   flushParameters();
+
    QMutexLocker lk(&connection_mutex);
 
-   char* p;
-   if (param.type() == QVariant::Type::Double)
+   QByteArray data(1, msg);
+   packParameter(data, param);
+
+   serial_port->write(data);
+   serial_port->flush();
+}
+
+/*
+   Send a message followed by a variable length payload. The payload
+   length is sent as the parameter and the high bit of the message
+   marks it as having a payload, as for messages from the Arduino
+*/
+void AbstractArduinoDevice::sendMessageWithPayload(char msg, QByteArray payload, bool require_connection)
+{
+   if (QThread::currentThread() != getThread())
    {
-      float q = param.toFloat();
-      p = reinterpret_cast<char*>(&q);
+      QMetaObject::invokeMethod(this, "sendMessageWithPayload", Q_ARG(char, msg), Q_ARG(QByteArray, payload), Q_ARG(bool, require_connection));
+      return;
    }
-   else if (param.type() == QVariant::Type::Int || param.type() == QVariant::Type::Bool)
+
+   if (require_connection && !is_connected)
+      return;
+
+   QMutexLocker lk(&connection_mutex);
+
+   QByteArray data(1, msg | 0x80);
+   packParameter(data, static_cast<uint32_t>(payload.size()));
+   data.append(payload);
+
+   serial_port->write(data);
+   serial_port->flush();
+}
+
+/*
+   Send a set of parameters in a single write, as back-to-back individual
+   messages. If batching has been enabled for firmware which supports it
+   they are instead sent as one MSG_SET_PARAMETERS message, acknowledged
+   once with MSG_PARAMETERS_SET
+*/
+void AbstractArduinoDevice::sendParameters(const ArduinoParameterList& parameters)
+{
+   if (parameters.isEmpty())
+      return;
+
+   QByteArray data;
+   for (auto& p : parameters)
    {
-      int32_t q = param.toInt();
-      p = reinterpret_cast<char*>(&q);
+      data.append(p.first);
+      packParameter(data, p.second);
    }
-   else if (param.type() == QVariant::Type::UInt)
+
+   if (use_batched_parameters)
    {
-      uint32_t q = param.toUInt();
-      p = reinterpret_cast<char*>(&q);
+      sendMessageWithPayload(MSG_SET_PARAMETERS, data);
    }
    else
    {
-      throw std::runtime_error("Unexpected type send to Arduino");
+      if (QThread::currentThread() != getThread())
+      {
+         QMetaObject::invokeMethod(this, "sendRawData", Q_ARG(QByteArray, data));
+         return;
+      }
+      sendRawData(data);
    }
+}
+
+void AbstractArduinoDevice::sendRawData(QByteArray data)
+{
+   if (!is_connected)
+      return;
 
-   serial_port->write(&msg, 1);
-   serial_port->write(p, 4);
+   QMutexLocker lk(&connection_mutex);
+   serial_port->write(data);
    serial_port->flush();
 }
 
+/*
+   Queue a parameter change to be sent with any others made in the
+   next coalesce_interval_ms. If the same parameter is changed
+   repeatedly only the last value is sent.
+*/
+void AbstractArduinoDevice::queueParameter(char msg, QVariant param)
+{
+   QMutexLocker lk(&pending_mutex);
+
+   bool was_empty = pending_parameters.isEmpty();
+
+   bool replaced = false;
+   for (auto& p : pending_parameters)
+      if (p.first == msg)
+      {
+         p.second = param;
+         replaced = true;
+      }
+
+   if (!replaced)
+      pending_parameters.append(QPair<char, QVariant>(msg, param));
+
+   if (was_empty)
+      QMetaObject::invokeMethod(coalesce_timer, "start", Qt::QueuedConnection);
+}
+
+void AbstractArduinoDevice::flushParameters()
+{
+   ArduinoParameterList parameters;
+   {
+      QMutexLocker lk(&pending_mutex);
+      parameters.swap(pending_parameters);
+   }
+
+   sendParameters(parameters);
+}
+
 QByteArray AbstractArduinoDevice::readBytes(int n_bytes, int timeout_ms)
 {
    int attempts = timeout_ms / 100;
@@ -203,7 +326,10 @@ QByteArray AbstractArduinoDevice::processMessage(QByteArray data)
       payload = data.mid(5);
    }
 
-   processMessage(msg, param, payload);
+   if (msg == MSG_PARAMETERS_SET)
+      emit parametersSet(param);
+   else
+      processMessage(msg, param, payload);
    current_message.clear();
 
    return payload;
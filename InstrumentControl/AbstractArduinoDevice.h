@@ -1,14 +1,18 @@
 #pragma once
 
-#pragma once
-
 #include "SerialDevice.h"
 #include <opencv2/core.hpp>
 #include <QVariant>
+#include <QList>
+#include <QPair>
 
 // Admin commands
 #define MSG_IDENTIFY 0x49 // 'I'
 #define MSG_IDENTITY 0x4A
+#define MSG_SET_PARAMETERS 0x42 // 'B'
+#define MSG_PARAMETERS_SET 0x43
+
+typedef QList<QPair<char, QVariant>> ArduinoParameterList;
 
 class AbstractArduinoDevice : public SerialDevice
 {
@@ -20,6 +24,13 @@ public:
 
    void init();
 
+   // Only enable with firmware which understands MSG_SET_PARAMETERS
+   void setUseBatchedParameters(bool use_batched_parameters_) { use_batched_parameters = use_batched_parameters_; }
+   bool getUseBatchedParameters() { return use_batched_parameters; }
+
+signals:
+   void parametersSet(int n_parameters);
+
 protected:
 
    virtual void processMessage(const char message, uint32_t param, QByteArray& payload) = 0;
@@ -28,9 +39,17 @@ protected:
 
    Q_INVOKABLE void sendMessage(char msg, QVariant param, bool require_connection = true);
    void sendMessage(char msg) { sendMessage(msg, 0); }
+   Q_INVOKABLE void sendMessageWithPayload(char msg, QByteArray payload, bool require_connection = true);
+
+   void sendParameters(const ArduinoParameterList& parameters);
+   void queueParameter(char msg, QVariant param);
+   Q_INVOKABLE void flushParameters();
+   Q_INVOKABLE void sendRawData(QByteArray data);
 
 private:
 
+   static void packParameter(QByteArray& data, const QVariant& param);
+
    bool connectToPort(const QString& port);
    void resetDevice(const QString& port);
 
@@ -42,6 +61,12 @@ private:
    QByteArray current_message;
    qint64 bytes_left_in_message = 5;
 
+   QTimer* coalesce_timer;
+   QMutex pending_mutex;
+   ArduinoParameterList pending_parameters;
+   bool use_batched_parameters = false;
+   int coalesce_interval_ms = 20;
+
 };
 
 
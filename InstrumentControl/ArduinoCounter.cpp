@@ -3,6 +3,7 @@
 #include <QApplication>
 
 #include <QThread>
+#include <QMetaMethod>
 #include <algorithm>
 #include <iostream>
 
@@ -24,29 +25,118 @@ void ArduinoCounter::init()
    AbstractArduinoDevice::init();
 }
 
+/*
+   Keep the displayed count updated when not streaming. Only request
+   a new count once the last one has arrived so requests don't pile
+   up when the dwell time is longer than the monitor interval
+*/
 void ArduinoCounter::MonitorCount()
 {
-   if (!streaming)
+   if (streaming)
+      return;
+
+   uint64_t latest = GetLatestCountSequence();
+   bool count_requested;
+   {
+      std::lock_guard<std::mutex> lk(request_mutex);
+
+      // Give up on a request if the count never arrived
+      auto timeout = std::chrono::milliseconds(static_cast<int>(2 * dwell_time_ms) + 1000);
+      if (std::chrono::steady_clock::now() - count_request_time > timeout)
+         last_requested_seq = std::min(last_requested_seq, latest);
+
+      count_requested = last_requested_seq > latest;
+   }
+
+   if (!count_requested)
       GetCount();
 }
 
+/*
+   Get the next count to arrive - triggering it if we're not streaming. 
+   When we trigger, we wait for the count answering our own trigger rather
+   than one answering an earlier request, e.g. from the monitor
+*/
+int ArduinoCounter::GetNextCount()
+{
+   uint64_t seq = streaming ? GetLatestCountSequence() + 1 : RequestCount();
+
+   CountSample sample;
+   int timeout_ms = static_cast<int>(2 * dwell_time_ms) + 1000;
+   if (count_stream.waitFor(seq - 1, timeout_ms) && count_stream.read(seq, sample))
+      return sample.count;
+   
+   return current_count;
+}
+
+/*
+   Wait for the first count after after_seq, returns false on timeout
+*/
+bool ArduinoCounter::WaitForCount(uint64_t after_seq, CountSample& sample, int timeout_ms)
+{
+   if (!count_stream.waitFor(after_seq, timeout_ms))
+      return false;
+
+   // Normally after_seq+1, unless we've fallen too far behind
+   uint64_t seq = after_seq + 1;
+   uint64_t latest = GetLatestCountSequence();
+   if (latest - seq >= CountStream::capacity)
+      seq = latest - CountStream::capacity + 1;
+
+   return count_stream.read(seq, sample);
+}
+
+/*
+   Read the n counts following after_seq, waiting up to timeout_ms for them
+   to arrive. Fewer counts are returned on timeout.
+*/
+std::vector<CountSample> ArduinoCounter::ReadCounts(int n, uint64_t after_seq, int timeout_ms)
+{
+   return count_stream.readMany(after_seq, n, timeout_ms);
+}
+
+
+/*
+   Send the complete configuration to the counter in a single message
+*/
+void ArduinoCounter::setupAfterConnection()
+{
+   SendConfiguration();
+}
 
-void ArduinoCounter::SetupAfterConnection()
+void ArduinoCounter::SendConfiguration()
 {
-   SetDwellTime(dwell_time_ms);
-   SetUseExternalPixelClock(use_external_pixel_clock);
-   SetUseExternalLineClock(use_external_line_clock);
-   SetTriggerDivisor(trigger_divisor);
-   SetExternalClockDivisor(ext_clock_divisor);
-   SetNumFlybackSteps(n_flyback_steps);
-   SetUseDiagnosticCounts(use_diagnostic_counts);
+   ArduinoParameterList parameters;
+   auto Add = [&](char msg, QVariant value) { parameters.append(QPair<char, QVariant>(msg, value)); };
+
+   Add(MSG_SET_MODE, (uint32_t) (streaming ? MODE_STREAMING : MODE_ON_DEMAND));
+   Add(MSG_SET_DWELL_TIME, (float) (dwell_time_ms * 1000.0));
+   Add(MSG_SET_PIXEL_CLOCK_SOURCE, (uint32_t) (use_external_pixel_clock ? CLOCK_EXTERNAL : CLOCK_INTERNAL));
+   Add(MSG_SET_LINE_CLOCK_SOURCE, (uint32_t) (use_external_line_clock ? CLOCK_EXTERNAL : CLOCK_INTERNAL));
+   Add(MSG_SET_TRIGGER_CLOCK_DIVISOR, trigger_divisor);
+   Add(MSG_SET_EXTERNAL_CLOCK_DIVISOR, ext_clock_divisor);
+   Add(MSG_SET_NUM_PIXEL, (quint32) pixels_per_line);
+   Add(MSG_SET_GALVO_STEP, (quint32) galvo_step);
+   Add(MSG_SET_GALVO_OFFSET, galvo_offset);
+   Add(MSG_SET_NUM_FLYBACK_STEPS, n_flyback_steps);
+   Add(MSG_USE_DIAGNOSTIC_COUNTS, (int) use_diagnostic_counts);
+   Add(MSG_SET_TRIGGER_DELAY, (float) trigger_delay_us);
+   Add(MSG_SET_TRIGGER_DURATION, (float) trigger_duration_us);
+
+   sendParameters(parameters);
 }
 
+/*
+   Parameter setters queue their message rather than sending it directly, 
+   so that rapid changes (e.g. from a spinbox) are coalesced into a single
+   transmission. Queued parameters are always sent before any trigger command.
+*/
+
 void ArduinoCounter::SetStreaming(bool streaming_)
 {
    streaming = streaming_;
    uint32_t mode = streaming ? MODE_STREAMING : MODE_ON_DEMAND;
-   sendMessage(MSG_SET_MODE, mode);
+   queueParameter(MSG_SET_MODE, mode);
 }
 
 void ArduinoCounter::SetDwellTime(double dwell_time_ms_)
@@ -54,77 +144,76 @@ void ArduinoCounter::SetDwellTime(double dwell_time_ms_)
    dwell_time_ms = dwell_time_ms_;
 
    float dwell_time_us = dwell_time_ms * 1000.0;
-   sendMessage(MSG_SET_DWELL_TIME, dwell_time_us);
+   queueParameter(MSG_SET_DWELL_TIME, dwell_time_us);
 }
 
 void ArduinoCounter::SetUseExternalPixelClock(bool use_external_clock_)
 {
    use_external_pixel_clock = use_external_clock_;
    uint32_t source = use_external_pixel_clock ? CLOCK_EXTERNAL : CLOCK_INTERNAL;
-   sendMessage(MSG_SET_PIXEL_CLOCK_SOURCE, source);
+   queueParameter(MSG_SET_PIXEL_CLOCK_SOURCE, source);
 }
 
 void ArduinoCounter::SetUseExternalLineClock(bool use_external_clock_)
 {
    use_external_line_clock = use_external_clock_;
    uint32_t source = use_external_line_clock ? CLOCK_EXTERNAL : CLOCK_INTERNAL;
-   sendMessage(MSG_SET_LINE_CLOCK_SOURCE, source);
+   queueParameter(MSG_SET_LINE_CLOCK_SOURCE, source);
 }
 
 void ArduinoCounter::SetTriggerDivisor(int trigger_divisor_)
 {
    trigger_divisor = trigger_divisor_;
-   sendMessage(MSG_SET_TRIGGER_CLOCK_DIVISOR, trigger_divisor);
+   queueParameter(MSG_SET_TRIGGER_CLOCK_DIVISOR, trigger_divisor);
 }
 
 void ArduinoCounter::SetExternalClockDivisor(int ext_clock_divisor_)
 {
    ext_clock_divisor = ext_clock_divisor_;
-   sendMessage(MSG_SET_EXTERNAL_CLOCK_DIVISOR, ext_clock_divisor);
-
+   queueParameter(MSG_SET_EXTERNAL_CLOCK_DIVISOR, ext_clock_divisor);
 }
 
 void ArduinoCounter::SetPixelsPerLine(int pixels_per_line_)
 {
    pixels_per_line = pixels_per_line_;
-   sendMessage(MSG_SET_NUM_PIXEL, (quint32) pixels_per_line);
+   queueParameter(MSG_SET_NUM_PIXEL, (quint32) pixels_per_line);
 }
 
 void ArduinoCounter::SetGalvoStep(int galvo_step_)
 {
    galvo_step = galvo_step_;
-   sendMessage(MSG_SET_GALVO_STEP, (quint32) galvo_step);
+   queueParameter(MSG_SET_GALVO_STEP, (quint32) galvo_step);
 }
 
 void ArduinoCounter::SetGalvoOffset(int galvo_offset_)
 {
    galvo_offset = galvo_offset_;
-   sendMessage(MSG_SET_GALVO_OFFSET, galvo_offset);
+   queueParameter(MSG_SET_GALVO_OFFSET, galvo_offset);
    emit GalvoOffsetChanged(galvo_offset);
 }
 
 void ArduinoCounter::SetNumFlybackSteps(int n_flyback_steps_)
 {
    n_flyback_steps = n_flyback_steps_;
-   sendMessage(MSG_SET_NUM_FLYBACK_STEPS, n_flyback_steps);
+   queueParameter(MSG_SET_NUM_FLYBACK_STEPS, n_flyback_steps);
 }
 
 void ArduinoCounter::SetUseDiagnosticCounts(bool use_diagnostic_counts_)
 {
    use_diagnostic_counts = use_diagnostic_counts_;
-   sendMessage(MSG_USE_DIAGNOSTIC_COUNTS, (int)use_diagnostic_counts);
+   queueParameter(MSG_USE_DIAGNOSTIC_COUNTS, (int)use_diagnostic_counts);
 }
 
 void ArduinoCounter::SetTriggerDelay(double trigger_delay_us_)
 {
    trigger_delay_us = trigger_delay_us_;
-   sendMessage(MSG_SET_TRIGGER_DELAY, (float)trigger_delay_us);
+   queueParameter(MSG_SET_TRIGGER_DELAY, (float)trigger_delay_us);
 }
 
 void ArduinoCounter::SetTriggerDuration(double trigger_duration_us_)
 {
-   trigger_delay_us = trigger_duration_us_;
-   sendMessage(MSG_SET_TRIGGER_DURATION, (float)trigger_duration_us_);
+   trigger_duration_us = trigger_duration_us_;
+   queueParameter(MSG_SET_TRIGGER_DURATION, (float)trigger_duration_us);
 }
 
 
@@ -160,28 +249,53 @@ void ArduinoCounter::SetPMTEnabled(bool enabled)
 
 void ArduinoCounter::GetCount()
 {
+   RequestCount();
+}
+
+/*
+   Trigger a count, returning the sequence number of the count which will
+   answer it. Requests still outstanding are answered first.
+*/
+uint64_t ArduinoCounter::RequestCount()
+{
+   std::lock_guard<std::mutex> lk(request_mutex);
+
+   uint64_t seq = std::max(last_requested_seq, GetLatestCountSequence()) + 1;
+   last_requested_seq = seq;
+   count_request_time = std::chrono::steady_clock::now();
+
    sendMessage(MSG_TRIGGER);
+   return seq;
 }
 
 
 /*
    Interpet a message packet from Arduino
 */
-void ArduinoCounter::ProcessMessage(const char msg, uint32_t param, QByteArray payload)
+void ArduinoCounter::processMessage(const char msg, uint32_t param, QByteArray& payload)
 {
 
    switch (msg)
    {
       case MSG_PIXEL_DATA:
       {
-         emit CountUpdated(param);
+         count_stream.push(param);
          current_count = param;
+         emit CountUpdated(param);
       } break;
       case MSG_LINE_DATA:
       {
-         int n_px = payload.size() / 2;
-         cv::Mat line(1, n_px, CV_16U, payload.data());
-         emit NewLine(line);
+         // payload is shared, so receivers can keep it after we return
+         emit LineDataReceived(payload);
+
+         // The payload is released after this function returns, so only hand
+         // out a line that owns its data - and only if someone wants it
+         if (isSignalConnected(QMetaMethod::fromSignal(&ArduinoCounter::NewLine)))
+         {
+            int n_px = payload.size() / 2;
+            cv::Mat line(1, n_px, CV_16U, payload.data());
+            emit NewLine(line.clone());
+         }
       } break;
       case MSG_LINE_FINISHED:
       {
@@ -1,12 +1,11 @@
 #pragma once
 
 #include "AbstractArduinoDevice.h"
+#include "CountStream.h"
 #include <opencv2/core.hpp>
-
-// Admin commands
-#define MSG_IDENTIFY 0x49 // 'I'
-#define MSG_IDENTITY 0x4A
-
+#include <atomic>
+#include <mutex>
+#include <vector>
 
 // Setup commands
 #define MSG_SET_MODE 0x01
@@ -73,6 +72,8 @@ public:
    void SetTriggerDelay(double trigger_delay_us);
    void SetTriggerDuration(double trigger_duration_us);
 
+   void SendConfiguration();
+
    bool GetStreaming() { return streaming; }
    bool GetUseExternalClock() { return use_external_pixel_clock; }
    bool GetUseExternalLineClock() { return use_external_line_clock; }
@@ -88,20 +89,26 @@ public:
    double GetTriggerDuration() { return trigger_duration_us; }
 
    int GetCurrentCount() { return current_count; }
-   
-   int GetNextCount() // should  really do this with mutexes! 
-   { 
-      QThread::msleep(2 * dwell_time_ms);
-      return current_count;
-   }
-
-   void StartLine();
-   void PrimeLine();
-   void Stop();
+   int GetNextCount();
+
+   /*
+      Counts are recorded with a sequence number and timestamp as they 
+      arrive. Use GetLatestCountSequence() to find where you are in the 
+      stream, then wait for or read the counts that follow. These may be
+      called from any thread.
+   */
+   uint64_t GetLatestCountSequence() { return count_stream.latestSequence(); }
+   bool WaitForCount(uint64_t after_seq, CountSample& sample, int timeout_ms = 1000);
+   std::vector<CountSample> ReadCounts(int n, uint64_t after_seq, int timeout_ms = 1000);
+
+   Q_INVOKABLE void StartLine();
+   Q_INVOKABLE void PrimeLine();
+   Q_INVOKABLE void Stop();
    
 signals:
    void CountUpdated(int count);
    void NewLine(cv::Mat line);
+   void LineDataReceived(QByteArray payload);
    void LineFinished();
    void PMTEnabled(bool enabled);
    void OverloadOccured();
@@ -109,8 +116,8 @@ signals:
 
 private:
 
-   void SetupAfterConnection();
-   void ProcessMessage(const char message, uint32_t param, QByteArray payload);
+   void setupAfterConnection();
+   void processMessage(const char message, uint32_t param, QByteArray& payload);
    const QString getExpectedIdentifier() { return "Photon Counter"; }
    void MonitorCount();
 
@@ -131,7 +138,18 @@ private:
    double trigger_duration_us = 1;
 
    int idx = 0;
-   int current_count = 0;
+   std::atomic<int> current_count = { 0 };
+
+   /*
+      In on-demand mode each trigger is answered by one count, in order, so
+      a request is tagged with the sequence number of the count which will
+      answer it. Both are guarded by request_mutex.
+   */
+   uint64_t RequestCount();
+   std::mutex request_mutex;
+   uint64_t last_requested_seq = 0;
+   std::chrono::steady_clock::time_point count_request_time;
+   CountStream count_stream;
 
    QTimer* monitor_timer;
 };
@@ -0,0 +1,158 @@
+#include "Autofocus.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+using namespace std::chrono;
+
+std::shared_future<bool> Autofocus::Start()
+{
+   Stop();
+
+   auto promise = make_shared<std::promise<bool>>();
+   std::shared_future<bool> future = promise->get_future().share();
+
+   ClearStop();
+   running = true;
+   worker = std::thread([this, promise]()
+   {
+      promise->set_value(Run());
+   });
+
+   return future;
+}
+
+void Autofocus::Stop()
+{
+   stop_requested = true;
+   if (worker.joinable())
+      worker.join();
+}
+
+bool Autofocus::Run()
+{
+   running = true;
+   samples.clear();
+
+   bool success = (mover && image_source);
+
+   double lo = min(start, end), hi = max(start, end);
+   double step = (hi - lo) / (n_coarse_steps - 1);
+   double min_step = (tolerance > 0) ? tolerance : step / 100;
+
+   success = success && Sweep(start, end, n_coarse_steps);
+
+   while (success && step > min_step)
+   {
+      double centre = Best().position;
+      success = Sweep(max(lo, centre - step), min(hi, centre + step), n_fine_steps);
+      step *= 2.0 / (n_fine_steps - 1);
+   }
+
+   if (success)
+   {
+      best_position = FitPeak();
+
+      auto f = mover(best_position);
+      while (f.wait_for(milliseconds(50)) != future_status::ready)
+         if (stop_requested)
+            break;
+      success = !stop_requested && f.get();
+   }
+
+   running = false;
+   emit Finished(success, best_position);
+
+   return success;
+}
+
+/*
+   Move to a position and evaluate the metric of the next frame after
+   settling. Returns false without recording a sample if the move failed.
+*/
+bool Autofocus::Measure(double position, double& value)
+{
+   for (auto& s : samples)
+      if (fabs(s.position - position) < 1e-9)
+      {
+         value = s.metric;
+         return true;
+      }
+
+   auto f = mover(position);
+   while (f.wait_for(milliseconds(50)) != future_status::ready)
+      if (stop_requested)
+         return false;
+
+   if (!f.get())
+   {
+      cout << "Autofocus move to " << position << " failed\n";
+      return false;
+   }
+
+   this_thread::sleep_for(milliseconds(settle_time_ms));
+
+   for (int i = 0; i < n_discard_frames; i++)
+      image_source->getNextImage();
+
+   value = metric.Compute(image_source->getNextImage());
+
+   samples.push_back({ position, value });
+   emit MetricMeasured(position, value);
+
+   return !stop_requested;
+}
+
+bool Autofocus::Sweep(double from, double to, int n)
+{
+   for (int i = 0; i < n; i++)
+   {
+      double value;
+      if (!Measure(from + i * (to - from) / (n - 1), value))
+         return false;
+   }
+   return true;
+}
+
+const Autofocus::Sample& Autofocus::Best()
+{
+   return *max_element(samples.begin(), samples.end(), [](const Sample& a, const Sample& b) { return a.metric < b.metric; });
+}
+
+/*
+   Vertex of the parabola through the best sample and its nearest
+   measured neighbours on either side; the best sample if it's at the
+   edge of the measured range
+*/
+double Autofocus::FitPeak()
+{
+   const Sample& best = Best();
+
+   const Sample* left = nullptr;
+   const Sample* right = nullptr;
+   for (auto& s : samples)
+   {
+      if (s.position < best.position && (!left || s.position > left->position))
+         left = &s;
+      if (s.position > best.position && (!right || s.position < right->position))
+         right = &s;
+   }
+
+   if (!left || !right)
+      return best.position;
+
+   double x0 = left->position, x1 = best.position, x2 = right->position;
+   double y0 = left->metric, y1 = best.metric, y2 = right->metric;
+
+   double denom = (x0 - x1) * (x0 - x2) * (x1 - x2);
+   double a = (x2 * (y1 - y0) + x1 * (y0 - y2) + x0 * (y2 - y1)) / denom;
+   double b = (x2 * x2 * (y0 - y1) + x1 * x1 * (y2 - y0) + x0 * x0 * (y1 - y2)) / denom;
+
+   if (a >= 0)
+      return best.position;
+
+   double peak = -b / (2 * a);
+   return min(max(peak, x0), x2);
+}
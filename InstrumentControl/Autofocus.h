@@ -0,0 +1,99 @@
+#pragma once
+
+#include "ImageSource.h"
+#include "FocusMetric.h"
+#include "ScanEngine.h"
+
+#include <QObject>
+
+#include <vector>
+#include <thread>
+#include <future>
+#include <atomic>
+
+/*
+   Finds the stage position which maximises a focus metric by a coarse to
+   fine search. A coarse sweep over [start, end] finds the best point;
+   each following level sweeps one step either side of the best point so
+   far with n_fine_steps points, until the step is below the tolerance.
+   Positions already measured are not revisited. The peak is then located by a parabolic fit
+   through the best point and its neighbours, and the stage moved there.
+*/
+class Autofocus : public QObject
+{
+   Q_OBJECT
+
+public:
+
+   struct Sample
+   {
+      double position;
+      double metric;
+   };
+
+   Autofocus(QObject* parent = 0) :
+      QObject(parent)
+   {}
+
+   ~Autofocus() { Stop(); }
+
+   // For controllers with std::shared_future<bool> MoveToPosition(double)
+   template<class T>
+   void SetStage(T* stage)
+   {
+      mover = [stage](double value) { return stage->MoveToPosition(value); };
+   }
+
+   void SetMover(ScanAxis::Mover mover_) { mover = mover_; }
+   void SetImageSource(ImageSource* image_source_) { image_source = image_source_; }
+
+   FocusMetric& Metric() { return metric; }
+
+   void SetRange(double start_, double end_) { start = start_; end = end_; }
+   void SetCoarseSteps(int n_coarse_steps_) { n_coarse_steps = std::max(3, n_coarse_steps_); }
+   void SetFineSteps(int n_fine_steps_) { n_fine_steps = std::max(4, n_fine_steps_); }
+   void SetTolerance(double tolerance_) { tolerance = tolerance_; }
+   void SetSettleTime(int settle_time_ms_) { settle_time_ms = settle_time_ms_; }
+   void SetDiscardFrames(int n_discard_frames_) { n_discard_frames = n_discard_frames_; }
+
+   std::shared_future<bool> Start();
+   bool Run(); // blocks until focus is found, false if stopped or a move failed
+   void Stop();
+
+   // As for ScanEngine, call before starting a thread that calls Run(); Start() does this itself
+   void ClearStop() { stop_requested = false; }
+   bool IsRunning() { return running; }
+
+   double GetBestPosition() { return best_position; }
+   const std::vector<Sample>& GetSamples() { return samples; }
+
+signals:
+   void MetricMeasured(double position, double metric);
+   void Finished(bool success, double best_position);
+
+protected:
+
+   bool Measure(double position, double& value);
+   bool Sweep(double from, double to, int n);
+   const Sample& Best();
+   double FitPeak();
+
+   ScanAxis::Mover mover;
+   ImageSource* image_source = nullptr;
+   FocusMetric metric;
+
+   double start = 0;
+   double end = 0;
+   int n_coarse_steps = 11;
+   int n_fine_steps = 5;
+   double tolerance = 0;
+   int settle_time_ms = 0;
+   int n_discard_frames = 1;
+
+   std::vector<Sample> samples;
+   double best_position = 0;
+
+   std::thread worker;
+   std::atomic<bool> running = { false };
+   std::atomic<bool> stop_requested = { false };
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+/*
+   A single count from a counting device, stamped with its sequence
+   number (starting at 1) and the host time it was received
+*/
+struct CountSample
+{
+   uint64_t seq = 0;
+   int count = 0;
+   std::chrono::steady_clock::time_point timestamp;
+};
+
+/*
+   Ring of the most recent counts. Written from a single thread (the device
+   thread) without locking; any number of threads may read. Each slot
+   carries its sequence number so readers can detect if it was overwritten
+   while they were copying it. The mutex is only used to sleep readers
+   waiting for new data.
+*/
+class CountStream
+{
+public:
+
+   static const int capacity = 4096;
+
+   void push(int count)
+   {
+      uint64_t seq = write_seq.load(std::memory_order_relaxed) + 1;
+      Slot& slot = slots[seq % capacity];
+
+      slot.seq.store(0, std::memory_order_relaxed); // mark as being written
+      std::atomic_thread_fence(std::memory_order_release);
+
+      slot.sample.seq = seq;
+      slot.sample.count = count;
+      slot.sample.timestamp = std::chrono::steady_clock::now();
+
+      slot.seq.store(seq, std::memory_order_release);
+      write_seq.store(seq, std::memory_order_release);
+
+      {
+         std::lock_guard<std::mutex> lk(wait_mutex);
+      }
+      wait_cv.notify_all();
+   }
+
+   uint64_t latestSequence()
+   {
+      return write_seq.load(std::memory_order_acquire);
+   }
+
+   /*
+      Read the sample with sequence number seq. Returns false if it has
+      not arrived yet or has already been overwritten.
+   */
+   bool read(uint64_t seq, CountSample& sample)
+   {
+      if (seq == 0 || seq > latestSequence())
+         return false;
+
+      const Slot& slot = slots[seq % capacity];
+      if (slot.seq.load(std::memory_order_acquire) != seq)
+         return false;
+
+      sample = slot.sample;
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return slot.seq.load(std::memory_order_relaxed) == seq;
+   }
+
+   /*
+      Block until a sample with sequence number greater than after_seq
+      has arrived. Returns false on timeout
+   */
+   bool waitFor(uint64_t after_seq, int timeout_ms)
+   {
+      if (latestSequence() > after_seq)
+         return true;
+
+      std::unique_lock<std::mutex> lk(wait_mutex);
+      return wait_cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&] { return latestSequence() > after_seq; });
+   }
+
+   /*
+      Read up to n samples following after_seq, waiting up to timeout_ms
+      for them to arrive. Samples lost to overwriting are skipped.
+   */
+   std::vector<CountSample> readMany(uint64_t after_seq, int n, int timeout_ms)
+   {
+      std::vector<CountSample> samples;
+      samples.reserve(n);
+
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+      uint64_t seq = after_seq;
+
+      while ((int) samples.size() < n)
+      {
+         int remaining_ms = (int) std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+         if (!waitFor(seq, std::max(remaining_ms, 0)))
+            break;
+
+         uint64_t latest = latestSequence();
+
+         // Skip anything that has already been overwritten
+         if (latest - seq > capacity)
+            seq = latest - capacity;
+
+         CountSample sample;
+         while (seq < latest && (int) samples.size() < n)
+            if (read(++seq, sample))
+               samples.push_back(sample);
+      }
+
+      return samples;
+   }
+
+private:
+
+   struct Slot
+   {
+      std::atomic<uint64_t> seq = { 0 };
+      CountSample sample;
+   };
+
+   Slot slots[capacity];
+   std::atomic<uint64_t> write_seq = { 0 };
+
+   std::mutex wait_mutex;
+   std::condition_variable wait_cv;
+};
@@ -0,0 +1,213 @@
+#include "DarkFlatCorrection.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <limits>
+#include <type_traits>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+void ReferenceAverager::reset()
+{
+   sum = cv::Mat();
+   n_frames = 0;
+}
+
+void ReferenceAverager::add(const cv::Mat& frame)
+{
+   if (sum.size() != frame.size())
+   {
+      sum = cv::Mat::zeros(frame.size(), CV_32F);
+      n_frames = 0;
+   }
+
+   cv::accumulate(frame, sum);
+   n_frames++;
+}
+
+cv::Mat ReferenceAverager::result()
+{
+   if (n_frames == 0)
+      return cv::Mat();
+
+   return sum / n_frames;
+}
+
+
+namespace
+{
+   /*
+      Written as plain loops over contiguous rows with no branches in the
+      inner loop, so that the compiler vectorises them
+   */
+   template<typename T>
+   void CorrectRows(const cv::Mat& input, cv::Mat& output, const cv::Mat& dark, const cv::Mat& gain, int y0, int y1)
+   {
+      const bool saturate = is_integral<T>::value;
+      const float max_value = saturate ? (float) numeric_limits<T>::max() : numeric_limits<float>::max();
+      const float round = saturate ? 0.5f : 0.0f;
+      const int n = input.cols;
+
+      for (int y = y0; y < y1; y++)
+      {
+         const T* src = input.ptr<T>(y);
+         T* dst = output.ptr<T>(y);
+         const float* d = dark.empty() ? nullptr : dark.ptr<float>(y);
+         const float* g = gain.empty() ? nullptr : gain.ptr<float>(y);
+
+         if (d && g)
+         {
+            for (int x = 0; x < n; x++)
+            {
+               float v = ((float) src[x] - d[x]) * g[x];
+               dst[x] = (T) (min(max(v, 0.0f), max_value) + round);
+            }
+         }
+         else if (d)
+         {
+            for (int x = 0; x < n; x++)
+            {
+               float v = (float) src[x] - d[x];
+               dst[x] = (T) (min(max(v, 0.0f), max_value) + round);
+            }
+         }
+         else
+         {
+            for (int x = 0; x < n; x++)
+            {
+               float v = (float) src[x] * g[x];
+               dst[x] = (T) (min(max(v, 0.0f), max_value) + round);
+            }
+         }
+      }
+   }
+
+   class CorrectionBody : public cv::ParallelLoopBody
+   {
+   public:
+      CorrectionBody(const cv::Mat& input, cv::Mat& output, const cv::Mat& dark, const cv::Mat& gain) :
+         input(input), output(output), dark(dark), gain(gain)
+      {}
+
+      void operator()(const cv::Range& range) const
+      {
+         switch (input.depth())
+         {
+         case CV_8U: CorrectRows<uint8_t>(input, output, dark, gain, range.start, range.end); break;
+         case CV_16U: CorrectRows<uint16_t>(input, output, dark, gain, range.start, range.end); break;
+         case CV_32F: CorrectRows<float>(input, output, dark, gain, range.start, range.end); break;
+         }
+      }
+
+   private:
+      const cv::Mat& input;
+      cv::Mat& output;
+      const cv::Mat& dark;
+      const cv::Mat& gain;
+   };
+
+   const int pixels_per_stripe = 1 << 17;
+}
+
+void DarkFlatCorrection::setDark(const cv::Mat& dark_)
+{
+   cv::Mat d;
+   dark_.convertTo(d, CV_32F);
+
+   lock_guard<mutex> lk(m);
+   dark = d;
+   updateGain();
+}
+
+void DarkFlatCorrection::setFlat(const cv::Mat& flat_)
+{
+   cv::Mat f;
+   flat_.convertTo(f, CV_32F);
+
+   lock_guard<mutex> lk(m);
+   flat = f;
+   updateGain();
+}
+
+void DarkFlatCorrection::clearDark()
+{
+   lock_guard<mutex> lk(m);
+   dark = cv::Mat();
+   updateGain();
+}
+
+void DarkFlatCorrection::clearFlat()
+{
+   lock_guard<mutex> lk(m);
+   flat = cv::Mat();
+   updateGain();
+}
+
+cv::Mat DarkFlatCorrection::getDark()
+{
+   lock_guard<mutex> lk(m);
+   return dark;
+}
+
+cv::Mat DarkFlatCorrection::getGain()
+{
+   lock_guard<mutex> lk(m);
+   return gain;
+}
+
+/*
+   Called with m held. The gain is computed once, from the dark
+   subtracted flat, so apply() only needs a multiply
+*/
+void DarkFlatCorrection::updateGain()
+{
+   if (flat.empty())
+   {
+      gain = cv::Mat();
+      return;
+   }
+
+   cv::Mat f = flat.clone();
+   if (dark.size() == flat.size())
+      f -= dark;
+
+   cv::max(f, 1e-3, f);
+
+   cv::Mat g;
+   cv::divide(cv::mean(f)[0], f, g);
+   gain = g;
+}
+
+bool DarkFlatCorrection::isActive(cv::Size size)
+{
+   lock_guard<mutex> lk(m);
+   return dark.size() == size || gain.size() == size;
+}
+
+bool DarkFlatCorrection::apply(const cv::Mat& input, cv::Mat& output)
+{
+   cv::Mat d, g;
+   {
+      lock_guard<mutex> lk(m);
+      d = dark;
+      g = gain;
+   }
+
+   if (d.size() != input.size())
+      d = cv::Mat();
+   if (g.size() != input.size())
+      g = cv::Mat();
+
+   int depth = input.depth();
+   bool supported = (input.channels() == 1) && (depth == CV_8U || depth == CV_16U || depth == CV_32F);
+
+   if ((d.empty() && g.empty()) || !supported || output.size() != input.size() || output.type() != input.type())
+      return false;
+
+   double n_stripes = (double) input.total() / pixels_per_stripe;
+   cv::parallel_for_(cv::Range(0, input.rows), CorrectionBody(input, output, d, g), n_stripes);
+
+   return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cv.h>
+
+#include <mutex>
+
+/*
+   Averages a number of frames into a float reference image
+*/
+class ReferenceAverager
+{
+public:
+   void reset();
+   void add(const cv::Mat& frame);
+
+   int count() { return n_frames; }
+   cv::Mat result();
+
+private:
+   cv::Mat sum;
+   int n_frames = 0;
+};
+
+/*
+   Dark and flat field correction, out = (raw - dark) * gain where
+   gain = mean(flat - dark) / (flat - dark). Either reference may be unset.
+
+   References are stored as float and the correction is a single fused
+   pass over the frame, saturating for 8 and 16 bit data. Large frames
+   are split into row stripes across threads. References are replaced
+   rather than modified, so apply() can run on several frames at once.
+*/
+class DarkFlatCorrection
+{
+public:
+   void setDark(const cv::Mat& dark);
+   void setFlat(const cv::Mat& flat);
+   void clearDark();
+   void clearFlat();
+
+   cv::Mat getDark();
+   cv::Mat getGain();
+
+   // True if there is a reference of the right size for a frame
+   bool isActive(cv::Size size);
+
+   /*
+      output must have the same size and type as input, and may be the same
+      buffer. Returns false, leaving output untouched, if there's no
+      reference which matches the frame.
+   */
+   bool apply(const cv::Mat& input, cv::Mat& output);
+
+private:
+   void updateGain();
+
+   std::mutex m;
+   cv::Mat dark;
+   cv::Mat flat;
+   cv::Mat gain;
+};
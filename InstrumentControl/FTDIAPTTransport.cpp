@@ -0,0 +1,149 @@
+#include "FTDIAPTTransport.h"
+#include <windows.h>
+#include "FTD2XX.h"
+
+#include <QThread>
+#include <iostream>
+#include <vector>
+#include <stdexcept>
+
+using namespace std;
+
+void Check(unsigned long status)
+{
+   if (status != FT_OK)
+   {
+      cout << "Thorlabs APT Controller error\n";
+      throw runtime_error("Error with Thorlabs APT Controller, FTDI status " + to_string(status));
+   }
+}
+
+vector<FT_DEVICE_LIST_INFO_NODE> GetAPTDevices()
+{
+   DWORD n_dev;
+
+   // create the device information list
+   Check(FT_CreateDeviceInfoList(&n_dev));
+   printf("Number of devices is %d\n", n_dev);
+
+   // allocate storage for list based on numDevs
+   vector<FT_DEVICE_LIST_INFO_NODE> dev_info(n_dev);
+
+   if (n_dev > 0)
+   {
+      // get the device information list
+      Check(FT_GetDeviceInfoList(dev_info.data(), &n_dev));
+
+      for (auto& dev : dev_info)
+      {
+         printf(" Flags=0x%x\n", dev.Flags);
+         printf(" Type=0x%x\n", dev.Type);
+         printf(" ID=0x%x\n", dev.ID);
+         printf(" LocId=0x%x\n", dev.LocId);
+         printf(" SerialNumber=%s\n", dev.SerialNumber);
+         printf(" Description=%s\n", dev.Description);
+      }
+   }
+
+   return dev_info;
+}
+
+FTDIAPTTransport::FTDIAPTTransport(const QString& description) :
+   description(description)
+{
+}
+
+FTDIAPTTransport::~FTDIAPTTransport()
+{
+   close();
+}
+
+void FTDIAPTTransport::open()
+{
+   close();
+
+   ULONG baud_rate = 115200;
+   int purge_dwell_time = 50;
+
+   // TODO: open correct device index not just first matching description
+   GetAPTDevices();
+
+   Check(FT_OpenEx(description.toLatin1().data(), FT_OPEN_BY_DESCRIPTION, &device));
+
+   Check(FT_SetBaudRate(device, baud_rate));
+   Check(FT_SetDataCharacteristics(device, FT_BITS_8, FT_STOP_BITS_1, FT_PARITY_NONE));
+
+   // Pre purge dwell 50ms.
+   QThread::msleep(purge_dwell_time);
+   Check(FT_Purge(device, FT_PURGE_RX | FT_PURGE_TX));
+   // Post purge dwell 50ms.
+   QThread::msleep(purge_dwell_time);
+
+   Check(FT_ResetDevice(device));
+   Check(FT_SetFlowControl(device, FT_FLOW_RTS_CTS, 0, 0));
+   Check(FT_SetRts(device));
+
+   // Setup signalling event, auto-reset so each wait consumes one notification
+   bool manual_reset = false;
+   bool signalled = false;
+   event_handle = CreateEvent(NULL, manual_reset, signalled, NULL);
+
+   Check(FT_SetEventNotification(device, FT_EVENT_RXCHAR, event_handle));
+}
+
+void FTDIAPTTransport::close()
+{
+   if (device != nullptr)
+   {
+      FT_Close(device);
+      device = nullptr;
+   }
+
+   if (event_handle != nullptr)
+   {
+      CloseHandle(event_handle);
+      event_handle = nullptr;
+   }
+}
+
+void FTDIAPTTransport::write(const QByteArray& data)
+{
+   if (device == nullptr)
+      return;
+
+   DWORD bytes_written;
+
+   // FT_Write doesn't take a const pointer
+   char* data_ptr = const_cast<char*>(data.constData());
+   Check(FT_Write(device, data_ptr, data.size(), &bytes_written));
+}
+
+/*
+   Return everything in the receive queue, waiting on the receive event
+   for up to timeout_ms if it is empty
+*/
+QByteArray FTDIAPTTransport::read(int timeout_ms)
+{
+   if (device == nullptr)
+      return QByteArray();
+
+   DWORD n_rx_bytes = 0;
+   Check(FT_GetQueueStatus(device, &n_rx_bytes));
+
+   if (n_rx_bytes == 0)
+   {
+      WaitForSingleObject(event_handle, timeout_ms);
+      Check(FT_GetQueueStatus(device, &n_rx_bytes));
+   }
+
+   if (n_rx_bytes == 0)
+      return QByteArray();
+
+   QByteArray data(n_rx_bytes, Qt::Uninitialized);
+
+   DWORD bytes_read;
+   Check(FT_Read(device, data.data(), n_rx_bytes, &bytes_read));
+   data.truncate(bytes_read);
+
+   return data;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "APTTransport.h"
+#include <QString>
+
+/*
+   APT transport over an FTDI USB serial bridge using the D2XX library.
+   read() sleeps on the driver's receive event rather than polling the
+   queue status. close() must not be called while another thread is
+   inside read().
+
+   Information on communicating using FTD2xx:
+   http://www.ftdichip.com/Support/Documents/ProgramGuides/D2XX_Programmer's_Guide(FT_000071).pdf
+*/
+class FTDIAPTTransport : public AbstractAPTTransport
+{
+public:
+
+   FTDIAPTTransport(const QString& description);
+   ~FTDIAPTTransport();
+
+   void open();
+   void close();
+   bool isOpen() { return device != nullptr; }
+
+   void write(const QByteArray& data);
+   QByteArray read(int timeout_ms);
+
+protected:
+
+   QString description;
+
+   void* device = nullptr;
+   void* event_handle = nullptr;
+};
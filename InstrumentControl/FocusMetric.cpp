@@ -0,0 +1,224 @@
+#include "FocusMetric.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+
+using namespace std;
+
+namespace
+{
+   struct Partial
+   {
+      double sum = 0;
+      double sum_sq = 0;
+      double n = 0;
+   };
+
+   /*
+      Rows [y0, y1) of the frame. Integer frames are accumulated in
+      integers, which the compiler vectorises without relaxing floating
+      point rules; float frames fall back to scalar double sums. Border
+      pixels, which lack neighbours, are skipped.
+   */
+   template<typename T>
+   void MetricRows(const cv::Mat& frame, FocusMetric::Method method, int y0, int y1, Partial& p)
+   {
+      typedef typename conditional<is_integral<T>::value, int32_t, double>::type V;
+      typedef typename conditional<is_integral<T>::value, int64_t, double>::type S;
+
+      int w = frame.cols;
+
+      for (int y = y0; y < y1; y++)
+      {
+         const T* c = frame.ptr<T>(y);
+         S sum = 0, sum_sq = 0;
+         int n = 0;
+
+         switch (method)
+         {
+         case FocusMetric::VarianceOfLaplacian:
+         {
+            if (y == 0 || y == frame.rows - 1)
+               continue;
+            const T* u = frame.ptr<T>(y - 1);
+            const T* d = frame.ptr<T>(y + 1);
+            for (int x = 1; x < w - 1; x++)
+            {
+               V l = 4 * (V) c[x] - (V) c[x - 1] - (V) c[x + 1] - (V) u[x] - (V) d[x];
+               sum += l;
+               sum_sq += (S) l * l;
+            }
+            n = w - 2;
+            break;
+         }
+         case FocusMetric::Brenner:
+         {
+            for (int x = 0; x < w - 2; x++)
+            {
+               V diff = (V) c[x + 2] - (V) c[x];
+               sum_sq += (S) diff * diff;
+            }
+            n = w - 2;
+            break;
+         }
+         case FocusMetric::Tenengrad:
+         {
+            if (y == 0 || y == frame.rows - 1)
+               continue;
+            const T* u = frame.ptr<T>(y - 1);
+            const T* d = frame.ptr<T>(y + 1);
+            for (int x = 1; x < w - 1; x++)
+            {
+               V gx = ((V) u[x + 1] + 2 * (V) c[x + 1] + (V) d[x + 1]) - ((V) u[x - 1] + 2 * (V) c[x - 1] + (V) d[x - 1]);
+               V gy = ((V) d[x - 1] + 2 * (V) d[x] + (V) d[x + 1]) - ((V) u[x - 1] + 2 * (V) u[x] + (V) u[x + 1]);
+               sum_sq += (S) gx * gx + (S) gy * gy;
+            }
+            n = w - 2;
+            break;
+         }
+         case FocusMetric::NormalisedVariance:
+         {
+            for (int x = 0; x < w; x++)
+            {
+               V v = c[x];
+               sum += v;
+               sum_sq += (S) v * v;
+            }
+            n = w;
+            break;
+         }
+         }
+
+         p.sum += (double) sum;
+         p.sum_sq += (double) sum_sq;
+         p.n += n;
+      }
+   }
+
+   class MetricBody : public cv::ParallelLoopBody
+   {
+   public:
+      MetricBody(const cv::Mat& frame, FocusMetric::Method method, vector<Partial>& partials) :
+         frame(frame), method(method), partials(partials)
+      {}
+
+      void operator()(const cv::Range& range) const
+      {
+         int n = (int) partials.size();
+         for (int i = range.start; i < range.end; i++)
+         {
+            int y0 = (frame.rows * i) / n;
+            int y1 = (frame.rows * (i + 1)) / n;
+
+            switch (frame.type())
+            {
+            case CV_8U: MetricRows<uint8_t>(frame, method, y0, y1, partials[i]); break;
+            case CV_16U: MetricRows<uint16_t>(frame, method, y0, y1, partials[i]); break;
+            case CV_32F: MetricRows<float>(frame, method, y0, y1, partials[i]); break;
+            }
+         }
+      }
+
+   private:
+      const cv::Mat& frame;
+      FocusMetric::Method method;
+      vector<Partial>& partials;
+   };
+
+   const int pixels_per_stripe = 1 << 17;
+}
+
+double FocusMetric::Compute(const cv::Mat& frame)
+{
+   cv::Mat region = frame;
+   if (roi.area() > 0)
+      region = frame(roi & cv::Rect(0, 0, frame.cols, frame.rows));
+
+   if (subsampling > 1)
+   {
+      cv::Size size(region.cols / subsampling, region.rows / subsampling);
+      cv::resize(region, subsampled, size, 0, 0, cv::INTER_NEAREST);
+      region = subsampled;
+   }
+
+   int type = region.type();
+   if (region.rows < 3 || region.cols < 3 || (type != CV_8U && type != CV_16U && type != CV_32F))
+      return 0;
+
+   int n_stripes = max(1, min(region.rows, (int) (region.total() / pixels_per_stripe)));
+   vector<Partial> partials(n_stripes);
+   cv::parallel_for_(cv::Range(0, n_stripes), MetricBody(region, method, partials));
+
+   Partial total;
+   for (auto& p : partials)
+   {
+      total.sum += p.sum;
+      total.sum_sq += p.sum_sq;
+      total.n += p.n;
+   }
+
+   if (total.n == 0)
+      return 0;
+
+   double mean = total.sum / total.n;
+   double mean_sq = total.sum_sq / total.n;
+
+   switch (method)
+   {
+   case VarianceOfLaplacian:
+      return mean_sq - mean * mean;
+   case Brenner:
+   case Tenengrad:
+      return mean_sq;
+   case NormalisedVariance:
+      return (mean > 0) ? (mean_sq - mean * mean) / mean : 0;
+   }
+   return 0;
+}
+
+
+void FocusMetricStage::setMethod(FocusMetric::Method method)
+{
+   lock_guard<mutex> lk(m);
+   metric.SetMethod(method);
+}
+
+void FocusMetricStage::setRoi(cv::Rect roi)
+{
+   lock_guard<mutex> lk(m);
+   metric.SetRoi(roi);
+}
+
+void FocusMetricStage::setSubsampling(int subsampling)
+{
+   lock_guard<mutex> lk(m);
+   metric.SetSubsampling(subsampling);
+}
+
+void FocusMetricStage::setCallback(std::function<void(double)> callback_)
+{
+   lock_guard<mutex> lk(m);
+   callback = callback_;
+}
+
+bool FocusMetricStage::process(const cv::Mat& input, cv::Mat& output)
+{
+   double value;
+   std::function<void(double)> cb;
+   {
+      lock_guard<mutex> lk(m);
+      value = metric.Compute(input);
+      cb = callback;
+   }
+
+   latest_metric = value;
+   if (cb)
+      cb(value);
+
+   if (output.data != input.data)
+      input.copyTo(output);
+
+   return true;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "FrameProcessingStage.h"
+
+#include <cv.h>
+
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+/*
+   Sharpness of a frame, larger is sharper. Metrics are computed in a
+   single pass over the rows of the frame, split into stripes across
+   threads; an ROI and subsampling factor can be set to reduce the cost.
+*/
+class FocusMetric
+{
+public:
+
+   enum Method
+   {
+      VarianceOfLaplacian, // variance of the 4-neighbour Laplacian
+      Brenner,             // mean of squared differences of pixels two apart
+      Tenengrad,           // mean squared Sobel gradient magnitude
+      NormalisedVariance   // intensity variance / mean
+   };
+
+   FocusMetric(Method method = VarianceOfLaplacian) : method(method) {}
+
+   void SetMethod(Method method_) { method = method_; }
+   Method GetMethod() { return method; }
+
+   // An empty ROI uses the whole frame
+   void SetRoi(cv::Rect roi_) { roi = roi_; }
+
+   // Use every n-th pixel in each direction
+   void SetSubsampling(int subsampling_) { subsampling = std::max(1, subsampling_); }
+
+   double Compute(const cv::Mat& frame);
+
+private:
+   Method method;
+   cv::Rect roi;
+   int subsampling = 1;
+
+   cv::Mat subsampled;
+};
+
+/*
+   Computes a focus metric for each frame and passes the frame through
+   unchanged. The callback, if set, is called from the pipeline's worker.
+*/
+class FocusMetricStage : public FrameProcessingStage
+{
+public:
+   FocusMetricStage(FocusMetric::Method method = FocusMetric::VarianceOfLaplacian) : metric(method) {}
+
+   QString name() { return "Focus Metric"; }
+
+   void setMethod(FocusMetric::Method method);
+   void setRoi(cv::Rect roi);
+   void setSubsampling(int subsampling);
+   void setCallback(std::function<void(double)> callback_);
+
+   double getLatestMetric() { return latest_metric; }
+
+   bool isOrdered() { return true; }
+   bool canProcessInPlace() { return true; }
+   bool process(const cv::Mat& input, cv::Mat& output);
+
+private:
+   std::mutex m;
+   FocusMetric metric;
+   std::function<void(double)> callback;
+   std::atomic<double> latest_metric = { 0 };
+};
@@ -0,0 +1,255 @@
+#include "FrameAccumulator.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <climits>
+
+namespace
+{
+   /*
+      Plain loops over contiguous rows so the compiler vectorises them
+   */
+   template<typename T>
+   void AddRows(const cv::Mat& input, cv::Mat& acc)
+   {
+      for (int y = 0; y < input.rows; y++)
+      {
+         const T* src = input.ptr<T>(y);
+         int32_t* dst = acc.ptr<int32_t>(y);
+         for (int x = 0; x < input.cols; x++)
+            dst[x] += src[x];
+      }
+   }
+
+   template<typename T>
+   void MaxRows(const cv::Mat& input, cv::Mat& acc)
+   {
+      for (int y = 0; y < input.rows; y++)
+      {
+         const T* src = input.ptr<T>(y);
+         int32_t* dst = acc.ptr<int32_t>(y);
+         for (int x = 0; x < input.cols; x++)
+            dst[x] = std::max(dst[x], (int32_t) src[x]);
+      }
+   }
+
+   template<typename T>
+   void DecayRows(const cv::Mat& input, cv::Mat& acc, float alpha)
+   {
+      float beta = 1.0f - alpha;
+      for (int y = 0; y < input.rows; y++)
+      {
+         const T* src = input.ptr<T>(y);
+         float* dst = acc.ptr<float>(y);
+         for (int x = 0; x < input.cols; x++)
+            dst[x] = beta * dst[x] + alpha * src[x];
+      }
+   }
+
+   template<template<typename> class F, typename... Args>
+   bool Dispatch(const cv::Mat& input, Args&&... args)
+   {
+      switch (input.type())
+      {
+      case CV_8U: F<uint8_t>()(input, args...); return true;
+      case CV_16U: F<uint16_t>()(input, args...); return true;
+      default: return false;
+      }
+   }
+
+   template<typename T> struct Add { void operator()(const cv::Mat& i, cv::Mat& a) { AddRows<T>(i, a); } };
+   template<typename T> struct Max { void operator()(const cv::Mat& i, cv::Mat& a) { MaxRows<T>(i, a); } };
+   template<typename T> struct Decay { void operator()(const cv::Mat& i, cv::Mat& a, float alpha) { DecayRows<T>(i, a, alpha); } };
+}
+
+FrameAccumulator::FrameAccumulator(ImageSource* input, QObject* parent, QThread* thread) :
+   ImageSource(parent, thread),
+   input(input)
+{
+   startThread();
+}
+
+void FrameAccumulator::init()
+{
+   // Accumulate on the source's thread, before the frame can be overwritten
+   if (input)
+      connect(input, &ImageSource::newImage, this, [this]() { AddFrame(input->getImageUnsafe()); }, Qt::DirectConnection);
+}
+
+void FrameAccumulator::SetMode(Mode mode_)
+{
+   QMutexLocker lk(&frame_mutex);
+   mode = mode_;
+   accumulator = cv::Mat();
+   n_accumulated = 0;
+
+   // The published buffer is interpreted according to the mode
+   published = cv::Mat();
+   n_published = 0;
+}
+
+void FrameAccumulator::SetWindow(int window_)
+{
+   QMutexLocker lk(&frame_mutex);
+   window = std::max(0, window_);
+   accumulator = cv::Mat();
+   n_accumulated = 0;
+}
+
+void FrameAccumulator::Reset()
+{
+   QMutexLocker lk(&frame_mutex);
+   accumulator = cv::Mat();
+   n_accumulated = 0;
+}
+
+int FrameAccumulator::GetNumAccumulated()
+{
+   QMutexLocker lk(&frame_mutex);
+   return n_accumulated;
+}
+
+void FrameAccumulator::AddFrame(const cv::Mat& frame)
+{
+   if (frame.empty() || !producing_images)
+      return;
+
+   QMutexLocker lk(&frame_mutex);
+
+   int acc_type = (mode == ExponentialAverage) ? CV_32F : CV_32S;
+   if (accumulator.size() != frame.size() || accumulator.type() != acc_type || frame.type() != input_type)
+   {
+      accumulator = cv::Mat::zeros(frame.size(), acc_type);
+      n_accumulated = 0;
+      input_type = frame.type();
+   }
+
+   // Start again before the accumulator can overflow. Allocate a new buffer
+   // as the published result shares the old one
+   if (window == 0 && n_accumulated >= MaxFrames())
+   {
+      accumulator = cv::Mat::zeros(frame.size(), acc_type);
+      n_accumulated = 0;
+   }
+
+   bool ok;
+   if (mode == ExponentialAverage)
+   {
+      // Start from the first frame rather than decaying up from zero
+      float alpha = (n_accumulated == 0) ? 1.0f : 2.0f / (std::max(window, 1) + 1);
+      ok = Dispatch<Decay>(frame, accumulator, alpha);
+   }
+   else if (mode == MaxProjection && n_accumulated > 0)
+      ok = Dispatch<Max>(frame, accumulator);
+   else
+      ok = Dispatch<Add>(frame, accumulator);
+
+   if (!ok)
+      return;
+
+   n_accumulated++;
+
+   if (window > 0 && mode != ExponentialAverage && n_accumulated < std::min(window, MaxFrames()))
+      return;
+
+   int n_frames = Publish();
+
+   lk.unlock();
+   if (window > 0 && mode != ExponentialAverage)
+      emit AccumulationCompleted(n_frames);
+   emit newImage();
+}
+
+/*
+   Called with frame_mutex held, returns the number of frames published.
+   Completed windows are swapped out so accumulation restarts without a
+   copy; continuous results share the accumulator and are only scaled
+   when requested.
+*/
+int FrameAccumulator::Publish()
+{
+   if (window > 0 && mode != ExponentialAverage)
+   {
+      std::swap(published, accumulator);
+      if (accumulator.size() != published.size() || accumulator.type() != published.type())
+         accumulator.create(published.size(), published.type());
+      accumulator.setTo(0);
+
+      n_published = n_accumulated;
+      n_accumulated = 0;
+   }
+   else
+   {
+      published = accumulator;
+      n_published = n_accumulated;
+   }
+
+   publish_count++;
+   frame_cv.wakeAll();
+
+   return n_published;
+}
+
+/*
+   Called with frame_mutex held. The number of frames of the input type
+   which can be summed into the 32 bit accumulator without overflowing
+*/
+int FrameAccumulator::MaxFrames()
+{
+   if (mode != Sum && mode != Mean)
+      return INT_MAX;
+
+   switch (input_type)
+   {
+   case CV_8U: return INT32_MAX / UINT8_MAX;
+   case CV_16U: return INT32_MAX / UINT16_MAX;
+   default: return INT_MAX;
+   }
+}
+
+/*
+   Called with frame_mutex held
+*/
+cv::Mat FrameAccumulator::Result()
+{
+   if (published.empty() || n_published == 0)
+      return cv::Mat();
+
+   cv::Mat result;
+   switch (mode)
+   {
+   case Sum:
+      published.copyTo(result);
+      break;
+   case Mean:
+      published.convertTo(result, input_type, 1.0 / n_published);
+      break;
+   case ExponentialAverage:
+   case MaxProjection:
+      published.convertTo(result, input_type);
+      break;
+   }
+   return result;
+}
+
+cv::Mat FrameAccumulator::getImage()
+{
+   QMutexLocker lk(&frame_mutex);
+   return Result();
+}
+
+cv::Mat FrameAccumulator::getImageUnsafe()
+{
+   return getImage();
+}
+
+cv::Mat FrameAccumulator::getNextImage()
+{
+   QMutexLocker lk(&frame_mutex);
+   int count = publish_count;
+   while (publish_count == count)
+      if (!frame_cv.wait(&frame_mutex, 10000))
+         break;
+
+   return Result();
+}
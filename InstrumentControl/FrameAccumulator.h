@@ -0,0 +1,79 @@
+#pragma once
+
+#include "ImageSource.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+
+/*
+   Accumulates every frame from an ImageSource into a 32 bit buffer, for
+   averaging low light images at the full camera rate.
+
+   With a window of n frames, the result is published after every n frames
+   and accumulation restarts; with a window of 0 the result is published
+   after every frame and accumulates until Reset(). In ExponentialAverage
+   mode the window sets the decay, alpha = 2 / (window + 1), and the
+   result is always continuous.
+
+   Sum and Mean accumulate at most 32768 16 bit frames (8421504 8 bit 
+   frames) before the 32 bit buffer could overflow. At that point a window
+   is completed early, and with a window of 0 accumulation restarts.
+
+   Only the accumulation is done per frame, on the thread which emits
+   newImage. The result is scaled when it is requested, so frame rate
+   isn't limited by how often it is displayed.
+*/
+class FrameAccumulator : public ImageSource
+{
+   Q_OBJECT
+
+public:
+
+   enum Mode { Sum, Mean, ExponentialAverage, MaxProjection };
+
+   FrameAccumulator(ImageSource* input, QObject* parent = 0, QThread* thread = 0);
+
+   void init();
+
+   // Sum is returned as CV_32S; the other modes in the type of the input
+   cv::Mat getImage();
+   cv::Mat getImageUnsafe();
+   cv::Mat getNextImage();
+
+   void SetMode(Mode mode);
+   void SetWindow(int window);
+   void Reset();
+
+   Mode GetMode() { return mode; }
+   int GetWindow() { return window; }
+   int GetNumAccumulated();
+
+   // Add a frame directly, for sources which aren't an ImageSource
+   void AddFrame(const cv::Mat& frame);
+
+signals:
+   void AccumulationCompleted(int n_frames);
+
+private:
+
+   int Publish();
+   cv::Mat Result();
+   int MaxFrames();
+
+   ImageSource* input;
+
+   Mode mode = Mean;
+   int window = 0;
+
+   cv::Mat accumulator;
+   int n_accumulated = 0;
+   int input_type = -1;
+
+   // Last published accumulation, and the number of frames in it
+   cv::Mat published;
+   int n_published = 0;
+   int publish_count = 0;
+
+   QMutex frame_mutex;
+   QWaitCondition frame_cv;
+};
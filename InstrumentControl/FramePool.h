@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cv.h>
+
+#include <memory>
+#include <mutex>
+#include <list>
+
+typedef std::shared_ptr<cv::Mat> PooledFrame;
+
+/*
+   Pool of reusable frame buffers. acquire() returns a frame which goes
+   back to the pool when its last reference is released, so processing
+   at a steady frame size doesn't allocate. The pool may be destroyed
+   while frames are still in use.
+*/
+class FramePool
+{
+public:
+
+   FramePool(int max_free_frames = 16) :
+      state(std::make_shared<State>())
+   {
+      state->max_free = max_free_frames;
+   }
+
+   PooledFrame acquire(cv::Size size, int type)
+   {
+      cv::Mat m;
+      {
+         std::lock_guard<std::mutex> lk(state->m);
+         for (auto it = state->free.begin(); it != state->free.end(); it++)
+         {
+            if (it->size() == size && it->type() == type)
+            {
+               m = *it;
+               state->free.erase(it);
+               break;
+            }
+         }
+      }
+
+      if (m.empty())
+         m.create(size, type);
+
+      std::weak_ptr<State> weak_state = state;
+      return PooledFrame(new cv::Mat(m), [weak_state](cv::Mat* frame)
+      {
+         if (auto s = weak_state.lock())
+         {
+            std::lock_guard<std::mutex> lk(s->m);
+            s->free.push_front(*frame);
+            if ((int) s->free.size() > s->max_free)
+               s->free.pop_back();
+         }
+         delete frame;
+      });
+   }
+
+private:
+
+   struct State
+   {
+      std::mutex m;
+      std::list<cv::Mat> free;
+      int max_free;
+   };
+
+   std::shared_ptr<State> state;
+};
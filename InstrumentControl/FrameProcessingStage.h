@@ -0,0 +1,66 @@
+#pragma once
+
+#include <QString>
+#include <cv.h>
+
+#include <mutex>
+#include <cstdint>
+
+struct StageTiming
+{
+   double last_us = 0;
+   double mean_us = 0;
+   double max_us = 0;
+   uint64_t n_frames = 0;
+};
+
+/*
+   A processing step in a ProcessingPipeline. process() is called from the
+   pipeline's worker threads; unless isOrdered() returns true it may be
+   called for several frames at once, so should only read shared state.
+*/
+class FrameProcessingStage
+{
+public:
+   virtual ~FrameProcessingStage() {};
+
+   virtual QString name() = 0;
+
+   // Geometry of the output frame for a given input
+   virtual cv::Size outputSize(cv::Size input_size) { return input_size; }
+   virtual int outputType(int input_type) { return input_type; }
+
+   // Stages which keep state between frames see frames one at a time, in order
+   virtual bool isOrdered() { return false; }
+
+   // If true, output may be the input buffer when the geometry is unchanged
+   virtual bool canProcessInPlace() { return false; }
+
+   // Return false to consume the frame without producing an output
+   virtual bool process(const cv::Mat& input, cv::Mat& output) = 0;
+
+   void recordTiming(double us)
+   {
+      std::lock_guard<std::mutex> lk(timing_mutex);
+      timing.last_us = us;
+      timing.max_us = std::max(timing.max_us, us);
+      timing.n_frames++;
+      timing.mean_us += (us - timing.mean_us) / timing.n_frames;
+   }
+
+   StageTiming getTiming()
+   {
+      std::lock_guard<std::mutex> lk(timing_mutex);
+      return timing;
+   }
+
+   void resetTiming()
+   {
+      std::lock_guard<std::mutex> lk(timing_mutex);
+      timing = StageTiming();
+   }
+
+private:
+   std::mutex timing_mutex;
+   StageTiming timing;
+};
@@ -0,0 +1,202 @@
+#include "FrameProcessingStages.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <cstdint>
+
+using namespace std;
+
+void RoiCropStage::setRoi(cv::Rect roi_)
+{
+   lock_guard<mutex> lk(m);
+   roi = roi_;
+}
+
+/*
+   An empty ROI passes the whole frame
+*/
+cv::Rect RoiCropStage::clippedRoi(cv::Size size)
+{
+   lock_guard<mutex> lk(m);
+   cv::Rect full(cv::Point(0, 0), size);
+   return (roi.area() > 0) ? (roi & full) : full;
+}
+
+cv::Size RoiCropStage::outputSize(cv::Size input_size)
+{
+   return clippedRoi(input_size).size();
+}
+
+bool RoiCropStage::process(const cv::Mat& input, cv::Mat& output)
+{
+   cv::Rect r = clippedRoi(input.size());
+   if (r.size() != output.size())
+      return false; // ROI changed since the output was allocated
+
+   input(r).copyTo(output);
+   return true;
+}
+
+
+bool DarkFlatCorrectionStage::process(const cv::Mat& input, cv::Mat& output)
+{
+   if (!dark_flat.apply(input, output) && output.data != input.data)
+      input.copyTo(output);
+
+   return true;
+}
+
+
+namespace
+{
+   /*
+      Each output row is made by summing factor input rows into a row of
+      column sums, which the compiler vectorises, then summing across
+      each block of columns
+   */
+   template<typename T, typename A>
+   void BinRows(const cv::Mat& input, cv::Mat& output, int factor, bool mean, int y0, int y1)
+   {
+      int n = output.cols * factor;
+      uint32_t area = factor * factor;
+      vector<uint32_t> col_sum(n);
+
+      for (int y = y0; y < y1; y++)
+      {
+         const T* in = input.ptr<T>(y * factor);
+         for (int x = 0; x < n; x++)
+            col_sum[x] = in[x];
+
+         for (int dy = 1; dy < factor; dy++)
+         {
+            in = input.ptr<T>(y * factor + dy);
+            for (int x = 0; x < n; x++)
+               col_sum[x] += in[x];
+         }
+
+         A* out = output.ptr<A>(y);
+         const uint32_t* c = col_sum.data();
+         for (int x = 0; x < output.cols; x++, c += factor)
+         {
+            uint32_t sum = 0;
+            for (int dx = 0; dx < factor; dx++)
+               sum += c[dx];
+
+            out[x] = mean ? (A) ((sum + area / 2) / area) : cv::saturate_cast<A>(sum);
+         }
+      }
+   }
+
+   template<typename T>
+   void DecimateRows(const cv::Mat& input, cv::Mat& output, int factor, int y0, int y1)
+   {
+      for (int y = y0; y < y1; y++)
+      {
+         const T* in = input.ptr<T>(y * factor);
+         T* out = output.ptr<T>(y);
+         for (int x = 0; x < output.cols; x++)
+            out[x] = in[x * factor];
+      }
+   }
+
+   class BinningBody : public cv::ParallelLoopBody
+   {
+   public:
+      BinningBody(const cv::Mat& input, cv::Mat& output, int factor, BinningStage::Mode mode) :
+         input(input), output(output), factor(factor), mode(mode)
+      {}
+
+      void operator()(const cv::Range& range) const
+      {
+         int y0 = range.start, y1 = range.end;
+         bool mean = (mode == BinningStage::Mean);
+         int in_type = input.type(), out_type = output.type();
+
+         if (mode == BinningStage::Decimate && in_type == CV_8U)
+            DecimateRows<uint8_t>(input, output, factor, y0, y1);
+         else if (mode == BinningStage::Decimate)
+            DecimateRows<uint16_t>(input, output, factor, y0, y1);
+         else if (in_type == CV_8U && out_type == CV_8U)
+            BinRows<uint8_t, uint8_t>(input, output, factor, mean, y0, y1);
+         else if (in_type == CV_8U && out_type == CV_16U)
+            BinRows<uint8_t, uint16_t>(input, output, factor, mean, y0, y1);
+         else if (in_type == CV_16U && out_type == CV_16U)
+            BinRows<uint16_t, uint16_t>(input, output, factor, mean, y0, y1);
+         else
+            BinRows<uint16_t, int32_t>(input, output, factor, mean, y0, y1);
+      }
+
+   private:
+      const cv::Mat& input;
+      cv::Mat& output;
+      int factor;
+      BinningStage::Mode mode;
+   };
+
+   const int pixels_per_stripe = 1 << 17;
+}
+
+cv::Size BinningStage::outputSize(cv::Size input_size)
+{
+   return cv::Size(input_size.width / factor, input_size.height / factor);
+}
+
+int BinningStage::outputType(int input_type)
+{
+   if (mode != Sum)
+      return input_type;
+
+   switch (input_type)
+   {
+   case CV_8U: return CV_16U;
+   case CV_16U: return CV_32S;
+   default: return input_type;
+   }
+}
+
+bool BinningStage::process(const cv::Mat& input, cv::Mat& output)
+{
+   int f = factor;
+   Mode m = mode;
+
+   // Settings changed since the output was allocated
+   if (output.empty() || output.size() != cv::Size(input.cols / f, input.rows / f) || output.type() != outputType(input.type()))
+      return false;
+
+   int in_type = input.type();
+   if (in_type != CV_8U && in_type != CV_16U)
+   {
+      cv::resize(input, output, output.size(), 0, 0, (m == Decimate) ? cv::INTER_NEAREST : cv::INTER_AREA);
+      return true;
+   }
+
+   double n_stripes = (double) input.total() / pixels_per_stripe;
+   cv::parallel_for_(cv::Range(0, output.rows), BinningBody(input, output, f, m), n_stripes);
+
+   return true;
+}
+
+
+void FrameAveragingStage::setNumFrames(int n_frames_)
+{
+   n_frames = max(1, n_frames_);
+}
+
+bool FrameAveragingStage::process(const cv::Mat& input, cv::Mat& output)
+{
+   if (accumulator.size() != input.size())
+   {
+      accumulator = cv::Mat::zeros(input.size(), CV_32F);
+      n_accumulated = 0;
+   }
+
+   cv::accumulate(input, accumulator);
+
+   if (++n_accumulated < n_frames)
+      return false;
+
+   accumulator.convertTo(output, output.type(), 1.0 / n_accumulated);
+   accumulator.setTo(0);
+   n_accumulated = 0;
+
+   return true;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "FrameProcessingStage.h"
+#include "DarkFlatCorrection.h"
+
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+/*
+   Crop each frame to a region of interest, clipped to the frame
+*/
+class RoiCropStage : public FrameProcessingStage
+{
+public:
+   RoiCropStage(cv::Rect roi = cv::Rect()) : roi(roi) {}
+
+   QString name() { return "ROI Crop"; }
+
+   void setRoi(cv::Rect roi_);
+   cv::Size outputSize(cv::Size input_size);
+   bool process(const cv::Mat& input, cv::Mat& output);
+
+private:
+   cv::Rect clippedRoi(cv::Size size);
+
+   std::mutex m;
+   cv::Rect roi;
+};
+
+/*
+   Dark and flat field correction. Frames which don't match the
+   references are passed through unchanged.
+*/
+class DarkFlatCorrectionStage : public FrameProcessingStage
+{
+public:
+   QString name() { return "Dark/Flat Correction"; }
+
+   DarkFlatCorrection& correction() { return dark_flat; }
+
+   bool canProcessInPlace() { return true; }
+   bool process(const cv::Mat& input, cv::Mat& output);
+
+private:
+   DarkFlatCorrection dark_flat;
+};
+
+/*
+   Bin factor x factor blocks of pixels, or decimate by taking one pixel
+   from each block. Sums are widened so they can't overflow: 8 bit to
+   16 bit and 16 bit to 32 bit. Pixels beyond the last whole block are
+   discarded.
+
+   To bin for some consumers only, e.g. a preview, give them their own
+   pipeline: ProcessingPipeline::create(camera, { std::make_shared<BinningStage>(4, BinningStage::Mean) })
+*/
+class BinningStage : public FrameProcessingStage
+{
+public:
+   enum Mode { Sum, Mean, Decimate };
+
+   BinningStage(int factor = 2, Mode mode = Sum) : factor(std::max(1, factor)), mode(mode) {}
+
+   QString name() { return "Binning"; }
+
+   void setFactor(int factor_) { factor = std::max(1, factor_); }
+   void setMode(Mode mode_) { mode = mode_; }
+   int getFactor() { return factor; }
+   Mode getMode() { return mode; }
+
+   cv::Size outputSize(cv::Size input_size);
+   int outputType(int input_type);
+   bool process(const cv::Mat& input, cv::Mat& output);
+
+private:
+   std::atomic<int> factor;
+   std::atomic<Mode> mode;
+};
+
+/*
+   Average blocks of n consecutive frames, producing one output for every
+   n inputs
+*/
+class FrameAveragingStage : public FrameProcessingStage
+{
+public:
+   FrameAveragingStage(int n_frames = 4) : n_frames(n_frames) {}
+
+   QString name() { return "Frame Averaging"; }
+
+   void setNumFrames(int n_frames_);
+
+   bool isOrdered() { return true; }
+   bool process(const cv::Mat& input, cv::Mat& output);
+
+private:
+   std::atomic<int> n_frames;
+   int n_accumulated = 0;
+   cv::Mat accumulator;
+};
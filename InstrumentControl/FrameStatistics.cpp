@@ -0,0 +1,305 @@
+#include "FrameStatistics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <cmath>
+
+using namespace std;
+
+namespace
+{
+   struct Partial
+   {
+      double sum = 0;
+      double sum_sq = 0;
+      double min = numeric_limits<double>::max();
+      double max = numeric_limits<double>::lowest();
+      int64_t n_saturated = 0;
+      vector<double> roi_sums;
+   };
+
+   /*
+      Statistics of rows [y0, y1). Each row is reduced once for the whole
+      frame statistics, then the parts of it inside each ROI are summed
+      while the row is still in cache.
+   */
+   template<typename T, typename S>
+   void ReduceRows(const cv::Mat& frame, const vector<cv::Rect>& rois, double saturation_level, int y0, int y1, Partial& p)
+   {
+      T mn = numeric_limits<T>::max();
+      T mx = numeric_limits<T>::lowest();
+      T sat = (T) min(saturation_level, (double) numeric_limits<T>::max());
+
+      for (int y = y0; y < y1; y++)
+      {
+         const T* row = frame.ptr<T>(y);
+
+         S sum = 0, sum_sq = 0;
+         int64_t n_sat = 0;
+         for (int x = 0; x < frame.cols; x++)
+         {
+            T v = row[x];
+            sum += v;
+            sum_sq += (S) v * v;
+            mn = min(mn, v);
+            mx = max(mx, v);
+            n_sat += (v >= sat);
+         }
+
+         p.sum += sum;
+         p.sum_sq += sum_sq;
+         p.n_saturated += n_sat;
+
+         for (size_t i = 0; i < rois.size(); i++)
+         {
+            const cv::Rect& r = rois[i];
+            if (y < r.y || y >= r.y + r.height)
+               continue;
+
+            S roi_sum = 0;
+            for (int x = r.x; x < r.x + r.width; x++)
+               roi_sum += row[x];
+            p.roi_sums[i] += roi_sum;
+         }
+      }
+
+      p.min = min(p.min, (double) mn);
+      p.max = max(p.max, (double) mx);
+   }
+
+   class StatisticsBody : public cv::ParallelLoopBody
+   {
+   public:
+      StatisticsBody(const cv::Mat& frame, const vector<cv::Rect>& rois, double saturation_level, vector<Partial>& partials) :
+         frame(frame), rois(rois), saturation_level(saturation_level), partials(partials)
+      {}
+
+      void operator()(const cv::Range& range) const
+      {
+         int n = (int) partials.size();
+         for (int i = range.start; i < range.end; i++)
+         {
+            int y0 = (frame.rows * i) / n;
+            int y1 = (frame.rows * (i + 1)) / n;
+            Partial& p = partials[i];
+
+            switch (frame.type())
+            {
+            case CV_8U: ReduceRows<uint8_t, uint64_t>(frame, rois, saturation_level, y0, y1, p); break;
+            case CV_16U: ReduceRows<uint16_t, uint64_t>(frame, rois, saturation_level, y0, y1, p); break;
+            case CV_32F: ReduceRows<float, double>(frame, rois, saturation_level, y0, y1, p); break;
+            }
+         }
+      }
+
+   private:
+      const cv::Mat& frame;
+      const vector<cv::Rect>& rois;
+      double saturation_level;
+      vector<Partial>& partials;
+   };
+
+   const int pixels_per_stripe = 1 << 17;
+
+   qint64 SteadyTimeUs()
+   {
+      return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+   }
+}
+
+FrameStatistics::FrameStatistics(ImageSource* input, QObject* parent) :
+   QObject(parent),
+   input(input),
+   pool(4)
+{
+   // Copy the frame on the source's thread, before it can be overwritten
+   if (input)
+      connect(input, &ImageSource::newImage, this, [this]() { SubmitFrame(this->input->getImageUnsafe()); }, Qt::DirectConnection);
+
+   worker = std::thread(&FrameStatistics::Worker, this);
+}
+
+FrameStatistics::~FrameStatistics()
+{
+   if (input)
+      disconnect(input, &ImageSource::newImage, this, nullptr);
+
+   {
+      lock_guard<mutex> lk(pending_mutex);
+      terminate = true;
+   }
+   pending_cv.notify_all();
+   worker.join();
+}
+
+void FrameStatistics::SetSaturationLevel(double saturation_level_)
+{
+   lock_guard<mutex> lk(settings_mutex);
+   saturation_level = saturation_level_;
+}
+
+int FrameStatistics::AddRoi(cv::Rect roi)
+{
+   lock_guard<mutex> lk(settings_mutex);
+   rois.push_back(roi);
+   return (int) rois.size() - 1;
+}
+
+void FrameStatistics::ClearRois()
+{
+   lock_guard<mutex> lk(settings_mutex);
+   rois.clear();
+}
+
+std::vector<cv::Rect> FrameStatistics::GetRois()
+{
+   lock_guard<mutex> lk(settings_mutex);
+   return rois;
+}
+
+void FrameStatistics::SetHistoryLength(int history_length_)
+{
+   lock_guard<mutex> lk(history_mutex);
+   history_length = max(1, history_length_);
+   history.clear();
+   history_head = 0;
+}
+
+void FrameStatistics::ClearHistory()
+{
+   lock_guard<mutex> lk(history_mutex);
+   history.clear();
+   history_head = 0;
+}
+
+bool FrameStatistics::GetLatest(FrameStats& stats)
+{
+   lock_guard<mutex> lk(history_mutex);
+   if (history.empty())
+      return false;
+
+   size_t latest = (history.size() < history_length) ? history.size() - 1 : (history_head + history_length - 1) % history_length;
+   stats = history[latest];
+   return true;
+}
+
+std::vector<FrameStats> FrameStatistics::GetHistory()
+{
+   lock_guard<mutex> lk(history_mutex);
+   if (history.size() < history_length)
+      return history;
+
+   vector<FrameStats> ordered(history.begin() + history_head, history.end());
+   ordered.insert(ordered.end(), history.begin(), history.begin() + history_head);
+   return ordered;
+}
+
+void FrameStatistics::SubmitFrame(const cv::Mat& frame)
+{
+   if (frame.empty())
+      return;
+
+   PooledFrame f = pool.acquire(frame.size(), frame.type());
+   frame.copyTo(*f);
+
+   {
+      lock_guard<mutex> lk(pending_mutex);
+      pending = f;
+      pending_timestamp_us = SteadyTimeUs();
+      n_received++;
+   }
+   pending_cv.notify_one();
+}
+
+FrameStats FrameStatistics::Compute(const cv::Mat& frame)
+{
+   vector<cv::Rect> frame_rois;
+   double sat;
+   {
+      lock_guard<mutex> lk(settings_mutex);
+      frame_rois = rois;
+      sat = saturation_level;
+   }
+
+   // ROIs are clipped to the frame, so an ROI outside it sums to zero
+   for (auto& r : frame_rois)
+      r &= cv::Rect(0, 0, frame.cols, frame.rows);
+
+   if (sat < 0)
+      sat = (frame.depth() == CV_8U) ? 255 : (frame.depth() == CV_16U) ? 65535 : numeric_limits<double>::max();
+
+   FrameStats stats;
+   stats.roi_sums.resize(frame_rois.size());
+
+   int type = frame.type();
+   if (frame.empty() || (type != CV_8U && type != CV_16U && type != CV_32F))
+      return stats;
+
+   int n_stripes = max(1, min(frame.rows, (int) (frame.total() / pixels_per_stripe)));
+   vector<Partial> partials(n_stripes);
+   for (auto& p : partials)
+      p.roi_sums.resize(frame_rois.size());
+
+   cv::parallel_for_(cv::Range(0, n_stripes), StatisticsBody(frame, frame_rois, sat, partials));
+
+   Partial total;
+   total.roi_sums.resize(frame_rois.size());
+   for (auto& p : partials)
+   {
+      total.sum += p.sum;
+      total.sum_sq += p.sum_sq;
+      total.min = min(total.min, p.min);
+      total.max = max(total.max, p.max);
+      total.n_saturated += p.n_saturated;
+      for (size_t i = 0; i < p.roi_sums.size(); i++)
+         total.roi_sums[i] += p.roi_sums[i];
+   }
+
+   double n = (double) frame.total();
+   stats.mean = total.sum / n;
+   stats.std = sqrt(max(0.0, total.sum_sq / n - stats.mean * stats.mean));
+   stats.min = total.min;
+   stats.max = total.max;
+   stats.n_saturated = total.n_saturated;
+   stats.roi_sums = total.roi_sums;
+
+   return stats;
+}
+
+void FrameStatistics::Worker()
+{
+   while (true)
+   {
+      PooledFrame frame;
+      FrameStats stats;
+      {
+         unique_lock<mutex> lk(pending_mutex);
+         pending_cv.wait(lk, [this] { return pending || terminate; });
+
+         if (terminate)
+            return;
+
+         frame.swap(pending);
+         stats.timestamp_us = pending_timestamp_us;
+         stats.frame_index = n_received - 1;
+      }
+
+      FrameStats computed = Compute(*frame);
+      computed.timestamp_us = stats.timestamp_us;
+      computed.frame_index = stats.frame_index;
+
+      {
+         lock_guard<mutex> lk(history_mutex);
+         if (history.size() < history_length)
+            history.push_back(computed);
+         else
+         {
+            history[history_head] = computed;
+            history_head = (history_head + 1) % history_length;
+         }
+      }
+
+      emit StatisticsUpdated();
+   }
+}
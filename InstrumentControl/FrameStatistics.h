@@ -0,0 +1,91 @@
+#pragma once
+
+#include "ImageSource.h"
+#include "FramePool.h"
+
+#include <QObject>
+#include <cv.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+struct FrameStats
+{
+   uint64_t frame_index = 0;
+   qint64 timestamp_us = 0; // steady clock time the frame arrived
+   double mean = 0;
+   double std = 0;
+   double min = 0;
+   double max = 0;
+   int64_t n_saturated = 0;
+   std::vector<double> roi_sums; // in the order the ROIs were added
+};
+
+/*
+   Computes statistics of frames from an ImageSource on a worker thread:
+   mean, standard deviation, min, max, the number of saturated pixels and
+   the sum over each of a set of ROIs, all from a single pass over the
+   frame. Results are kept in a ring of the most recent frames.
+
+   Frames are copied on the thread which emits newImage; if the worker is
+   still busy the pending frame is replaced, so statistics are computed
+   for as many frames as the worker can keep up with.
+*/
+class FrameStatistics : public QObject
+{
+   Q_OBJECT
+
+public:
+
+   FrameStatistics(ImageSource* input, QObject* parent = 0);
+   ~FrameStatistics();
+
+   // Pixels at or above this level are saturated; by default the maximum of the frame type
+   void SetSaturationLevel(double saturation_level);
+
+   int AddRoi(cv::Rect roi);
+   void ClearRois();
+   std::vector<cv::Rect> GetRois();
+
+   void SetHistoryLength(int history_length);
+   void ClearHistory();
+
+   bool GetLatest(FrameStats& stats);
+   std::vector<FrameStats> GetHistory(); // oldest first
+
+   // Compute statistics directly, e.g. for frames which aren't from the source
+   FrameStats Compute(const cv::Mat& frame);
+
+   void SubmitFrame(const cv::Mat& frame);
+
+signals:
+   void StatisticsUpdated();
+
+private:
+
+   void Worker();
+
+   ImageSource* input;
+   FramePool pool;
+
+   std::mutex settings_mutex;
+   std::vector<cv::Rect> rois;
+   double saturation_level = -1;
+
+   std::thread worker;
+   std::atomic<bool> terminate = { false };
+   std::mutex pending_mutex;
+   std::condition_variable pending_cv;
+   PooledFrame pending;
+   qint64 pending_timestamp_us = 0;
+   uint64_t n_received = 0;
+
+   std::mutex history_mutex;
+   std::vector<FrameStats> history;
+   size_t history_length = 1000;
+   size_t history_head = 0; // next slot to write once the ring is full
+};
@@ -2,7 +2,9 @@
 
 #include <QThread>
 #include <QSerialPortInfo>
+#include <QDateTime>
 #include <iostream>
+#include <algorithm>
 
 using namespace std;
 
@@ -18,7 +20,7 @@ void GenericNewportController::init()
    SerialDevice::init();
 
    position_timer = new QTimer(this);
-   position_timer->setInterval(500);
+   position_timer->setInterval(idle_poll_interval_ms);
 
    connect(position_timer, &QTimer::timeout, this, &GenericNewportController::UpdateCurrentPosition);
    position_timer->start();
@@ -57,6 +59,7 @@ bool GenericNewportController::connectToPort(const QString& port)
 
    is_connected = true;
 
+   InvalidateCache();
    GetControllerState();
 
    Sync();
@@ -65,84 +68,296 @@ bool GenericNewportController::connectToPort(const QString& port)
    return true;
 }
 
+/*
+   Poll the position and state of the controller. While a move is in 
+   progress we poll at fast_poll_interval_ms so that completion is picked
+   up promptly, otherwise we back off to avoid tying up the port
+*/
 void GenericNewportController::UpdateCurrentPosition()
 {
+   // Hold the port over the whole update so a new move can't start between
+   // reading the state and deciding that the current move has finished
+   QMutexLocker lk(&connection_mutex);
+
    if (is_connected)
    {
-      double current_position = GetCurrentPosition();
+      double current_position = QueryCurrentPosition();
       emit CurrentPositionChanged(current_position);
 
       GetControllerState();
+
+      if (error_check_pending)
+         CheckErrors();
+   }
+   else
+   {
+      in_motion = false;
+      motion_ok = false;
+   }
+
+   if (in_motion)
+   {
+      position_timer->setInterval(fast_poll_interval_ms);
+   }
+   else
+   {
+      EndMotion(motion_ok);
+
+      int interval = position_timer->interval();
+      if (interval < idle_poll_interval_ms)
+         interval = idle_poll_interval_ms;
+      else
+         interval = std::min(2 * interval, max_idle_poll_interval_ms);
+      position_timer->setInterval(interval);
    }
 }
 
+/*
+   Switch to fast polling and check the state straight away. 
+   Runs on the controller thread.
+*/
+void GenericNewportController::StartMonitoringMotion()
+{
+   position_timer->setInterval(fast_poll_interval_ms);
+   position_timer->start();
+   UpdateCurrentPosition();
+}
+
+/*
+   Start tracking a new move. Any move still pending is superseded and
+   reported as unsuccessful.
+*/
+void GenericNewportController::BeginMotion()
+{
+   EndMotion(false);
+
+   std::lock_guard<std::mutex> lk(motion_mutex);
+   motion_promise = std::promise<bool>();
+   motion_future = motion_promise.get_future().share();
+   motion_pending = true;
+   motion_ok = true;
+   in_motion = true;
+}
+
+/*
+   Complete the pending move, if there is one
+*/
+void GenericNewportController::EndMotion(bool success)
+{
+   {
+      std::lock_guard<std::mutex> lk(motion_mutex);
+      if (!motion_pending)
+         return;
+
+      motion_pending = false;
+      motion_promise.set_value(success);
+   }
+
+   emit MotionFinished(success);
+}
+
 void GenericNewportController::SetMotorState(bool state)
 {
    SendCommand(controller_index, "MM", static_cast<int>(state));
 }
 
+void GenericNewportController::SetCachedValue(CachedValue& cache, double value)
+{
+   std::lock_guard<std::mutex> lk(cache_mutex);
+   cache.value = value;
+   cache.time_ms = QDateTime::currentMSecsSinceEpoch();
+}
+
+bool GenericNewportController::GetCachedValue(CachedValue& cache, qint64 max_age_ms, double& value)
+{
+   std::lock_guard<std::mutex> lk(cache_mutex);
+
+   if (cache.time_ms < 0 || (QDateTime::currentMSecsSinceEpoch() - cache.time_ms) > max_age_ms)
+      return false;
+
+   value = cache.value;
+   return true;
+}
+
+/*
+   Discard all cached values, e.g. after an error or a reconnection
+*/
+void GenericNewportController::InvalidateCache()
+{
+   std::lock_guard<std::mutex> lk(cache_mutex);
+   cached_position = CachedValue();
+   cached_target_position = CachedValue();
+   cached_velocity = CachedValue();
+   cached_acceleration = CachedValue();
+}
+
+/*
+   Check for errors from any commands sent since the last check. Writes
+   don't check for errors individually; this is called on the next
+   status update so several writes share one query.
+
+   A rejected move leaves the controller ready, so if the check covers
+   the command which started the current move, the move is failed here
+   rather than being reported as complete.
+*/
+void GenericNewportController::CheckErrors()
+{
+   bool check_move = move_error_check_pending.exchange(false);
+   error_check_pending = false;
+
+   if (QueryError())
+   {
+      InvalidateCache();
+
+      if (check_move)
+      {
+         in_motion = false;
+         motion_ok = false;
+         EndMotion(false);
+      }
+   }
+}
+
+double GenericNewportController::QueryCurrentPosition()
+{
+   double position = SendCommand(controller_index, "TP").toDouble() * units_per_microstep;
+   SetCachedValue(cached_position, position);
+   return position;
+}
+
+/*
+   The position is updated by the status poll, so this only queries
+   the controller if the poll hasn't run recently
+*/
 double GenericNewportController::GetCurrentPosition()
 {
-   return SendCommand(controller_index, "TP").toDouble() * units_per_microstep;
+   double position;
+   int max_age_ms = in_motion ? fast_poll_interval_ms : idle_poll_interval_ms;
+
+   if (GetCachedValue(cached_position, max_age_ms, position))
+      return position;
+
+   return QueryCurrentPosition();
 }
 
 double GenericNewportController::GetTargetPosition()
 {
-   return SendCommand(controller_index, "TH").toDouble() * units_per_microstep;
+   double position;
+   if (GetCachedValue(cached_target_position, parameter_cache_age_ms, position))
+      return position;
+
+   position = SendCommand(controller_index, "TH").toDouble() * units_per_microstep;
+   SetCachedValue(cached_target_position, position);
+   return position;
 }
 
 void GenericNewportController::SetTargetPosition(double position)
 {
-   in_motion = true;
+   MoveToPosition(position);
+}
+
+/*
+   Start a move to position, returning a future which becomes ready when 
+   the move is complete. The value is false if the move was interrupted
+   or the controller is not in a ready state at the end of the move.
+*/
+std::shared_future<bool> GenericNewportController::MoveToPosition(double position)
+{
+   QMutexLocker lk(&connection_mutex);
+
+   BeginMotion();
+   std::shared_future<bool> future = GetMotionFuture();
 
    SendCommand(controller_index, "PA", position / units_per_microstep);
-   QueryError();
+   SetCachedValue(cached_target_position, position);
+   move_error_check_pending = true;
+   error_check_pending = true;
+
+   lk.unlock();
+
+   QMetaObject::invokeMethod(this, "StartMonitoringMotion", Qt::QueuedConnection);
 
-   //StartMonitoringMotion();
+   return future;
+}
+
+std::shared_future<bool> GenericNewportController::GetMotionFuture()
+{
+   std::lock_guard<std::mutex> lk(motion_mutex);
+
+   if (!motion_future.valid())
+   {
+      std::promise<bool> p;
+      p.set_value(true);
+      return p.get_future().share();
+   }
+
+   return motion_future;
 }
 
 double GenericNewportController::GetVelocity()
 {
-   double velocity = SendCommand(controller_index, "VA").toDouble();
-   QueryError();
+   double velocity;
+   if (GetCachedValue(cached_velocity, parameter_cache_age_ms, velocity))
+      return velocity;
+
+   velocity = SendCommand(controller_index, "VA").toDouble();
+   if (!QueryError())
+      SetCachedValue(cached_velocity, velocity);
    return velocity;
 }
 
 void GenericNewportController::SetVelocity(double velocity)
 {
+   double cached;
+   if (GetCachedValue(cached_velocity, parameter_cache_age_ms, cached) && cached == velocity)
+      return;
+
    SendCommand(controller_index, "VA", velocity);
-   QueryError();
+   SetCachedValue(cached_velocity, velocity);
+   error_check_pending = true;
 }
 
 double GenericNewportController::GetAcceleration()
 {
-   double acceleration = SendCommand(controller_index, "AC").toDouble();
-   QueryError();
+   double acceleration;
+   if (GetCachedValue(cached_acceleration, parameter_cache_age_ms, acceleration))
+      return acceleration;
+
+   acceleration = SendCommand(controller_index, "AC").toDouble();
+   if (!QueryError())
+      SetCachedValue(cached_acceleration, acceleration);
    return acceleration;
 }
 
 void GenericNewportController::SetAcceleration(double acceleration)
 {
+   double cached;
+   if (GetCachedValue(cached_acceleration, parameter_cache_age_ms, cached) && cached == acceleration)
+      return;
+
    SendCommand(controller_index, "AC", acceleration);
-   QueryError();
+   SetCachedValue(cached_acceleration, acceleration);
+   error_check_pending = true;
 }
 
 void GenericNewportController::StopMotion()
 {
    SendCommand(controller_index, "ST");
-   QueryError();
+   CheckErrors();
 }
 
 void GenericNewportController::Home()
 {
    if (is_connected)
    {
+      InvalidateCache();
       SendCommand(controller_index, "RS"); // reset;
       QThread::sleep(10); // wait for reset
 
       while (SendCommand(controller_index, "TS").isEmpty()) 
          QThread::msleep(500);
 
+      BeginMotion();
       SendCommand(controller_index, "OR"); // home;
       WaitForMotion();
 
@@ -166,28 +381,18 @@ void GenericNewportController::Sync()
 
 void GenericNewportController::WaitForMotion()
 {
-   while (in_motion)
+   // The status timer can't run while we're blocking its thread, so poll directly
+   if (QThread::currentThread() == getThread())
    {
-      QThread::msleep(100);
+      while (in_motion && is_connected)
+      {
+         QThread::msleep(fast_poll_interval_ms);
+         UpdateCurrentPosition();
+      }
+      return;
    }
 
-   //TODO
-
-   /*
-   bool is_moving = true;
-
-   while (is_moving)
-   {
-      QString ts_return = SendCommand(controller_index, "TS");
-
-      if (ts_return.size() != 6) // malformed response
-         return;
-
-      QString state = ts_return.right(2);
-
-      is_moving = (state == "28" || state == "1E" || state == "1F"); // moving or homing
-   }
-   */
+   GetMotionFuture().wait();
 }
 
 void GenericNewportController::GetControllerState()
@@ -201,6 +406,7 @@ void GenericNewportController::GetControllerState()
    QString state = ts_return.right(2);
 
    in_motion = (state == "28" || state == "1E" || state == "1F"); // moving or homing
+   motion_ok = state.startsWith("3") && state <= "35"; // ready states 32-35
 
    /*
     if (state == "10") // not referenced from stage error
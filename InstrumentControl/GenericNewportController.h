@@ -4,6 +4,10 @@
 #include <cassert>
 #include <QStringList>
 
+#include <atomic>
+#include <future>
+#include <mutex>
+
 
 class GenericNewportController : public SerialDevice
 {
@@ -23,6 +27,8 @@ public:
    double GetCurrentPosition();
    double GetTargetPosition();
    void SetTargetPosition(double position);
+   std::shared_future<bool> MoveToPosition(double position);
+   std::shared_future<bool> GetMotionFuture();
    void WaitForMotion();
 
    double GetVelocity();
@@ -44,12 +50,16 @@ public:
 
    const QString& GetUnits() { return units; }
 
+   void InvalidateCache();
+   void CheckErrors();
+
 signals:
 
    void TargetPositionChanged(double target_position);
    void CurrentPositionChanged(double current_position);
    void VelocityChanged(double velocity);
    void AccelerationChanged(double acceleration);
+   void MotionFinished(bool success);
 
 protected:
 
@@ -57,12 +67,40 @@ protected:
    void GetControllerState();
    void Sync();
 
-   void StartMonitoringMotion();
+   void BeginMotion();
+   void EndMotion(bool success);
+   Q_INVOKABLE void StartMonitoringMotion();
 
    template<class T>
    void SendCommand(int axis, QByteArray command, T value);
 
-   virtual void QueryError() = 0;
+   virtual bool QueryError() = 0; // returns true if an error occurred
+
+   /*
+      Parameters are cached when written or read so that repeated reads
+      don't need a round trip. Reads are served from the cache while it
+      is younger than the relevant maximum age.
+   */
+   struct CachedValue
+   {
+      double value = 0;
+      qint64 time_ms = -1;
+   };
+
+   void SetCachedValue(CachedValue& cache, double value);
+   bool GetCachedValue(CachedValue& cache, qint64 max_age_ms, double& value);
+
+   double QueryCurrentPosition();
+
+   std::mutex cache_mutex;
+   CachedValue cached_position;
+   CachedValue cached_target_position;
+   CachedValue cached_velocity;
+   CachedValue cached_acceleration;
+   int parameter_cache_age_ms = 60000;
+
+   std::atomic<bool> error_check_pending = { false };
+   std::atomic<bool> move_error_check_pending = { false }; // the pending check covers a move command
 
    QTimer* position_timer;
    QString stage_type;
@@ -76,7 +114,18 @@ protected:
    QByteArray terminator = "\r\n";
    int controller_index = 1;
 
-   bool in_motion = false;
+   std::atomic<bool> in_motion = { false };
+   bool motion_ok = true;
+
+   // Status is polled quickly while moving and backs off when idle
+   int fast_poll_interval_ms = 15;
+   int idle_poll_interval_ms = 500;
+   int max_idle_poll_interval_ms = 2000;
+
+   std::mutex motion_mutex;
+   std::promise<bool> motion_promise;
+   std::shared_future<bool> motion_future;
+   bool motion_pending = false;
 };
 
 
@@ -0,0 +1,195 @@
+#include "LineScanImageSource.h"
+
+#include <algorithm>
+#include <cstring>
+
+LineScanImageSource::LineScanImageSource(ArduinoCounter* counter, QObject* parent, QThread* thread) :
+   ImageSource(parent, thread),
+   counter(counter)
+{
+   startThread();
+}
+
+void LineScanImageSource::init()
+{
+   connect(counter, &ArduinoCounter::LineDataReceived, this, &LineScanImageSource::LineDataReceived);
+   connect(counter, &ArduinoCounter::LineFinished, this, &LineScanImageSource::LineFinished);
+   connect(counter, &ArduinoCounter::GalvoOffsetChanged, this, &LineScanImageSource::GalvoOffsetChanged);
+
+   QMutexLocker lk(&frame_mutex);
+   n_flyback_pixels = counter->GetNumFlybackSteps();
+   AllocateFrames();
+}
+
+/*
+   (Re)allocate the frame pool if the frame geometry has changed.
+   Should be called with frame_mutex held
+*/
+void LineScanImageSource::AllocateFrames()
+{
+   pixels_per_line = std::max(1, counter->GetPixelsPerLine());
+   cv::Size sz(pixels_per_line, lines_per_frame);
+
+   if (frames.size() == n_frames && frames[0].size() == sz)
+      return;
+
+   frames.clear();
+   for (int i = 0; i < n_frames; i++)
+      frames.push_back(cv::Mat::zeros(sz, CV_16U));
+
+   write_idx = 0;
+   latest_idx = -1;
+   cur_line = 0;
+   cur_sample = 0;
+}
+
+void LineScanImageSource::ResetFrame()
+{
+   QMutexLocker lk(&frame_mutex);
+   cur_line = 0;
+   cur_sample = 0;
+}
+
+void LineScanImageSource::SetLinesPerFrame(int lines_per_frame_)
+{
+   QMutexLocker lk(&frame_mutex);
+   lines_per_frame = std::max(1, lines_per_frame_);
+   AllocateFrames();
+}
+
+void LineScanImageSource::SetBidirectional(bool bidirectional_)
+{
+   QMutexLocker lk(&frame_mutex);
+   bidirectional = bidirectional_;
+   cur_line = 0;
+   cur_sample = 0;
+}
+
+void LineScanImageSource::SetBidirectionalShift(int bidirectional_shift_)
+{
+   QMutexLocker lk(&frame_mutex);
+   bidirectional_shift = bidirectional_shift_;
+}
+
+void LineScanImageSource::SetNumFlybackPixels(int n_flyback_pixels_)
+{
+   QMutexLocker lk(&frame_mutex);
+   n_flyback_pixels = std::max(0, n_flyback_pixels_);
+}
+
+/*
+   Copy a (possibly partial) line from the message payload into the
+   current row of the frame being assembled
+*/
+void LineScanImageSource::LineDataReceived(QByteArray payload)
+{
+   QMutexLocker lk(&frame_mutex);
+
+   // Pick up any change in line length at the start of a frame
+   if (cur_line == 0 && cur_sample == 0)
+      AllocateFrames();
+
+   const uint16_t* data = reinterpret_cast<const uint16_t*>(payload.constData());
+   int n_samples = payload.size() / 2;
+
+   cv::Mat& frame = frames[write_idx];
+   uint16_t* row = frame.ptr<uint16_t>(cur_line);
+
+   if (cur_sample == 0)
+      std::memset(row, 0, pixels_per_line * sizeof(uint16_t));
+
+   // Range of samples in this chunk that lie in the image rather than the flyback
+   int px0 = cur_sample - n_flyback_pixels;
+   int first = std::max(0, -px0);
+   int last = std::min(n_samples, pixels_per_line - px0);
+
+   bool reversed = bidirectional && (cur_line % 2 == 1);
+
+   if (!reversed)
+   {
+      if (last > first)
+         std::memcpy(row + px0 + first, data + first, (last - first) * sizeof(uint16_t));
+   }
+   else
+   {
+      for (int i = first; i < last; i++)
+      {
+         int col = pixels_per_line - 1 - (px0 + i) + bidirectional_shift;
+         if (col >= 0 && col < pixels_per_line)
+            row[col] = data[i];
+      }
+   }
+
+   cur_sample += n_samples;
+}
+
+void LineScanImageSource::LineFinished()
+{
+   QMutexLocker lk(&frame_mutex);
+
+   if (frames.empty())
+      return;
+
+   cur_sample = 0;
+   cur_line++;
+
+   if (cur_line >= lines_per_frame)
+   {
+      cur_line = 0;
+      PublishFrame();
+      int completed_index = frame_index - 1;
+      lk.unlock();
+
+      emit newImage();
+      emit FrameCompleted(completed_index);
+   }
+}
+
+/*
+   A change of galvo offset moves the scan, so lines already collected
+   for this frame no longer register with new ones - start again
+*/
+void LineScanImageSource::GalvoOffsetChanged(int galvo_offset)
+{
+   ResetFrame();
+}
+
+/*
+   Mark the frame being written as the latest and move on to the next
+   buffer in the pool. Should be called with frame_mutex held
+*/
+void LineScanImageSource::PublishFrame()
+{
+   latest_idx = write_idx;
+   write_idx = (write_idx + 1) % n_frames;
+   frame_index++;
+
+   frame_cv.wakeAll();
+}
+
+cv::Mat LineScanImageSource::getImage()
+{
+   QMutexLocker lk(&frame_mutex);
+   if (latest_idx < 0)
+      return cv::Mat::zeros(lines_per_frame, pixels_per_line, CV_16U);
+   return frames[latest_idx].clone();
+}
+
+cv::Mat LineScanImageSource::getImageUnsafe()
+{
+   QMutexLocker lk(&frame_mutex);
+   if (latest_idx < 0)
+      return cv::Mat::zeros(lines_per_frame, pixels_per_line, CV_16U);
+   return frames[latest_idx];
+}
+
+cv::Mat LineScanImageSource::getNextImage()
+{
+   QMutexLocker lk(&frame_mutex);
+   int count = frame_index;
+   while (frame_index == count)
+      if (!frame_cv.wait(&frame_mutex, 10000))
+         return cv::Mat();
+
+   return frames[latest_idx].clone();
+}
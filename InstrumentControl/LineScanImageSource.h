@@ -0,0 +1,80 @@
+#pragma once
+
+#include "ImageSource.h"
+#include "ArduinoCounter.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QByteArray>
+
+#include <vector>
+
+/*
+   Assembles frames from the lines streamed by an ArduinoCounter during
+   galvo scanning so that photon counting scans can be displayed and
+   saved like any other image source.
+
+   Line data is copied once, directly from the message payload into its
+   final row of a pooled frame buffer. The first n_flyback_pixels samples
+   of each line are recorded while the galvo is returning and are discarded.
+   In bidirectional mode every second line is written in reverse, shifted
+   by bidirectional_shift pixels to correct for the galvo phase lag.
+*/
+class LineScanImageSource : public ImageSource
+{
+   Q_OBJECT
+
+public:
+
+   LineScanImageSource(ArduinoCounter* counter, QObject* parent = 0, QThread* thread = 0);
+
+   void init();
+
+   cv::Mat getImage();
+   cv::Mat getImageUnsafe();
+   cv::Mat getNextImage();
+
+   void SetLinesPerFrame(int lines_per_frame);
+   void SetBidirectional(bool bidirectional);
+   void SetBidirectionalShift(int bidirectional_shift);
+   void SetNumFlybackPixels(int n_flyback_pixels);
+
+   int GetLinesPerFrame() { return lines_per_frame; }
+   bool GetBidirectional() { return bidirectional; }
+   int GetBidirectionalShift() { return bidirectional_shift; }
+   int GetNumFlybackPixels() { return n_flyback_pixels; }
+
+   void ResetFrame();
+
+signals:
+   void FrameCompleted(int frame_index);
+
+private:
+
+   void LineDataReceived(QByteArray payload);
+   void LineFinished();
+   void GalvoOffsetChanged(int galvo_offset);
+
+   void AllocateFrames();
+   void PublishFrame();
+
+   ArduinoCounter* counter;
+
+   int lines_per_frame = 256;
+   int pixels_per_line = 1;
+   int n_flyback_pixels = 0;
+   bool bidirectional = false;
+   int bidirectional_shift = 0;
+
+   int cur_line = 0;
+   int cur_sample = 0;
+   int frame_index = 0;
+
+   const static int n_frames = 5;
+   std::vector<cv::Mat> frames;
+   int write_idx = 0;
+   int latest_idx = -1;
+
+   QMutex frame_mutex;
+   QWaitCondition frame_cv;
+};
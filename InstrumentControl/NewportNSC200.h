@@ -50,7 +50,7 @@ protected:
          return "";
    }
 
-   void QueryError()
+   bool QueryError()
    {
       /*
       if (!connected)
@@ -60,6 +60,7 @@ protected:
 
       NewMessage(response);
       */
+      return false;
    }
 
 };
\ No newline at end of file
@@ -73,10 +73,10 @@ protected:
          return "";
    }
 
-   void QueryError()
+   bool QueryError()
    {
       if (!is_connected)
-         return;
+         return false;
 
       QMutexLocker lk(&connection_mutex);
 
@@ -94,7 +94,10 @@ protected:
          QString message = error_message.right(response.size() - 5);
 
          newMessage(message);
+         return true;
       }
+
+      return false;
    }
 
 
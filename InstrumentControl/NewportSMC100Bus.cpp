@@ -0,0 +1,437 @@
+#include "NewportSMC100Bus.h"
+
+#include <QThread>
+#include <QDateTime>
+#include <iostream>
+
+using namespace std;
+
+NewportSMC100Bus::NewportSMC100Bus(const QMap<int, QString>& axes_, QObject* parent) :
+   SerialDevice(parent)
+{
+   for (auto it = axes_.begin(); it != axes_.end(); it++)
+      axes[it.key()].stage_type = it.value();
+
+   port_description = "";
+   startThread();
+}
+
+void NewportSMC100Bus::init()
+{
+   SerialDevice::init();
+
+   poll_timer = new QTimer(this);
+   poll_timer->setInterval(idle_poll_interval_ms);
+   connect(poll_timer, &QTimer::timeout, this, &NewportSMC100Bus::PollAxes);
+   poll_timer->start();
+}
+
+QList<int> NewportSMC100Bus::GetAxes()
+{
+   lock_guard<recursive_mutex> lk(axis_mutex);
+
+   QList<int> addresses;
+   for (auto& a : axes)
+      addresses.append(a.first);
+   return addresses;
+}
+
+bool NewportSMC100Bus::connectToPort(const QString& port)
+{
+   QMutexLocker lk(&connection_mutex);
+
+   QString m = QString("Trying to connect to Newport SMC100 bus on port: %1").arg(port);
+   newMessage(m);
+
+   // With no axes to identify we can't tell the bus from any other device
+   QList<int> addresses = GetAxes();
+   if (addresses.isEmpty())
+      return false;
+
+   if (!openSerialPort(port, QSerialPort::SoftwareControl, QSerialPort::Baud57600))
+      return false;
+
+   // Every axis on the bus must identify correctly
+   for (int address : addresses)
+   {
+      QString response = SendQuery(address, "VE", false);
+      if (!response.contains("SMC_"))
+      {
+         serial_port->close();
+         return false;
+      }
+
+      QString stage_type;
+      {
+         lock_guard<recursive_mutex> alk(axis_mutex);
+         stage_type = axes[address].stage_type;
+      }
+
+      if (!stage_type.isEmpty() && SendQuery(address, "ID", false) != stage_type)
+      {
+         serial_port->close();
+         return false;
+      }
+   }
+
+   is_connected = true;
+
+   for (int address : addresses)
+      PollAxis(address);
+
+   emit newMessage("Connected to Newport SMC100 bus.");
+   return true;
+}
+
+/*
+   Send a query to one controller and return the response with the
+   address and command removed
+*/
+QString NewportSMC100Bus::SendQuery(int address, QByteArray command, bool require_connection)
+{
+   if (require_connection && !is_connected)
+      return "";
+
+   QMutexLocker lk(&connection_mutex);
+
+   QByteArray b = QByteArray::number(address).append(command);
+
+   serial_port->readAll();
+   writeWithTerminator(QByteArray(b).append("?"));
+   QByteArray response = readUntilTerminator(1000);
+
+   int response_length = response.size() - b.size();
+
+   if (response_length > 0)
+      return response.mid(b.size(), response_length);
+   else
+      return "";
+}
+
+/*
+   Send a command which doesn't return a response. These are written
+   without waiting so several can be sent back to back.
+*/
+void NewportSMC100Bus::SendCommand(int address, QByteArray command, double value)
+{
+   if (!is_connected)
+      return;
+
+   QMutexLocker lk(&connection_mutex);
+
+   QByteArray b = QByteArray::number(address);
+   b.append(command);
+   b.append(QByteArray::number(value, 'g', 10));
+
+   serial_port->write(b);
+   serial_port->write(terminator);
+   serial_port->flush();
+}
+
+void NewportSMC100Bus::SendCommand(int address, QByteArray command)
+{
+   if (!is_connected)
+      return;
+
+   QMutexLocker lk(&connection_mutex);
+
+   serial_port->write(QByteArray::number(address).append(command));
+   serial_port->write(terminator);
+   serial_port->flush();
+}
+
+bool NewportSMC100Bus::QueryError(int address)
+{
+   QString response = SendQuery(address, "TE");
+   QString error = response.left(1);
+
+   if (!error.isEmpty() && error != "@") // No error
+   {
+      QString error_message = SendQuery(address, QByteArray("TB").append(error));
+      newMessage(QString("Axis %1: %2").arg(address).arg(error_message));
+      return true;
+   }
+
+   return false;
+}
+
+std::shared_future<bool> NewportSMC100Bus::MoveAxis(int address, double position)
+{
+   QMap<int, double> positions;
+   positions[address] = position;
+   return MoveAxes(positions);
+}
+
+/*
+   Start moves on several axes at once. The returned future becomes ready
+   when every axis has finished moving; it is false if any move failed.
+*/
+std::shared_future<bool> NewportSMC100Bus::MoveAxes(const QMap<int, double>& positions)
+{
+   // Hold the port so a status poll can't interleave with the moves
+   QMutexLocker lk(&connection_mutex);
+   lock_guard<recursive_mutex> alk(axis_mutex);
+
+   move_groups.emplace_back();
+   MoveGroup& group = move_groups.back();
+   std::shared_future<bool> future = group.promise.get_future().share();
+
+   for (auto it = positions.begin(); it != positions.end(); it++)
+   {
+      if (axes.count(it.key()) == 0)
+         continue;
+
+      BeginMotion(it.key());
+      axes[it.key()].target_position = it.value();
+      group.remaining.insert(it.key());
+   }
+
+   // Write all move commands back to back before checking any errors
+   for (auto it = positions.begin(); it != positions.end(); it++)
+      if (group.remaining.contains(it.key()))
+         SendCommand(it.key(), "PA", it.value());
+
+   QList<int> failed;
+   for (int address : group.remaining)
+   {
+      if (!QueryError(address))
+         continue;
+
+      // The move was rejected; make sure the axis is polled afresh
+      AxisState& axis = axes[address];
+      axis.in_motion = false;
+      axis.motion_ok = false;
+      axis.target_position = axis.position;
+      axis.state.clear();
+      axis.last_poll_ms = 0;
+      failed.append(address);
+   }
+
+   if (group.remaining.isEmpty())
+   {
+      group.promise.set_value(true);
+      move_groups.pop_back();
+   }
+
+   lk.unlock();
+
+   // Fail rejected moves now rather than waiting for them to be polled
+   for (int address : failed)
+      EndMotion(address, false);
+
+   QMetaObject::invokeMethod(this, "StartMonitoringMotion", Qt::QueuedConnection);
+
+   return future;
+}
+
+std::shared_future<bool> NewportSMC100Bus::GetMotionFuture(int address)
+{
+   lock_guard<recursive_mutex> lk(axis_mutex);
+
+   if (axes.count(address) == 0 || !axes[address].motion_future.valid())
+   {
+      std::promise<bool> p;
+      p.set_value(axes.count(address) > 0);
+      return p.get_future().share();
+   }
+
+   return axes[address].motion_future;
+}
+
+/*
+   Wait for all axes to stop moving. Only call this from another thread
+*/
+void NewportSMC100Bus::WaitForMotion()
+{
+   for (int address : GetAxes())
+      GetMotionFuture(address).wait();
+}
+
+void NewportSMC100Bus::BeginMotion(int address)
+{
+   EndMotion(address, false);
+
+   lock_guard<recursive_mutex> lk(axis_mutex);
+   AxisState& axis = axes[address];
+   axis.motion_promise = std::promise<bool>();
+   axis.motion_future = axis.motion_promise.get_future().share();
+   axis.motion_pending = true;
+   axis.motion_ok = true;
+   axis.in_motion = true;
+}
+
+/*
+   Complete the pending move on an axis, if there is one, and any
+   MoveAxes group that was waiting on it
+*/
+void NewportSMC100Bus::EndMotion(int address, bool success)
+{
+   QList<bool> groups_finished;
+   {
+      lock_guard<recursive_mutex> lk(axis_mutex);
+      AxisState& axis = axes[address];
+
+      if (!axis.motion_pending)
+         return;
+
+      axis.motion_pending = false;
+      axis.motion_promise.set_value(success);
+
+      for (auto it = move_groups.begin(); it != move_groups.end();)
+      {
+         if (it->remaining.remove(address))
+         {
+            it->success &= success;
+            if (it->remaining.isEmpty())
+            {
+               it->promise.set_value(it->success);
+               groups_finished.append(it->success);
+               it = move_groups.erase(it);
+               continue;
+            }
+         }
+         it++;
+      }
+   }
+
+   emit AxisMotionFinished(address, success);
+   for (bool group_success : groups_finished)
+      emit MotionFinished(group_success);
+}
+
+void NewportSMC100Bus::StartMonitoringMotion()
+{
+   poll_timer->setInterval(fast_poll_interval_ms);
+   poll_timer->start();
+   PollAxes();
+}
+
+/*
+   Poll every moving axis, and any idle axis which hasn't been polled
+   for idle_poll_interval_ms. The timer runs quickly only while
+   something is moving.
+*/
+void NewportSMC100Bus::PollAxes()
+{
+   qint64 now = QDateTime::currentMSecsSinceEpoch();
+   bool any_moving = false;
+
+   for (int address : GetAxes())
+   {
+      bool due;
+      {
+         lock_guard<recursive_mutex> lk(axis_mutex);
+         AxisState& axis = axes[address];
+         due = axis.in_motion || axis.motion_pending || (now - axis.last_poll_ms) >= idle_poll_interval_ms;
+      }
+
+      if (due)
+         PollAxis(address);
+
+      lock_guard<recursive_mutex> lk(axis_mutex);
+      any_moving |= axes[address].in_motion;
+   }
+
+   poll_timer->setInterval(any_moving ? fast_poll_interval_ms : idle_poll_interval_ms);
+}
+
+void NewportSMC100Bus::PollAxis(int address)
+{
+   QMutexLocker lk(&connection_mutex);
+
+   bool in_motion = false, motion_ok = false;
+   QString state;
+
+   if (is_connected)
+   {
+      double position = SendQuery(address, "TP").toDouble();
+      QString ts_return = SendQuery(address, "TS");
+
+      {
+         lock_guard<recursive_mutex> alk(axis_mutex);
+         AxisState& axis = axes[address];
+         axis.last_poll_ms = QDateTime::currentMSecsSinceEpoch();
+         axis.position = position;
+
+         if (ts_return.size() == 6) // otherwise malformed response
+         {
+            state = ts_return.right(2);
+            axis.in_motion = (state == "28" || state == "1E" || state == "1F"); // moving or homing
+            axis.motion_ok = state.startsWith("3") && state <= "35"; // ready states 32-35
+
+            if (state != axis.state)
+            {
+               axis.state = state;
+               emit AxisStateChanged(address, state);
+            }
+         }
+
+         in_motion = axis.in_motion;
+         motion_ok = axis.motion_ok;
+      }
+
+      emit AxisPositionChanged(address, position);
+   }
+
+   if (!in_motion)
+      EndMotion(address, motion_ok);
+}
+
+double NewportSMC100Bus::GetCurrentPosition(int address)
+{
+   lock_guard<recursive_mutex> lk(axis_mutex);
+   return axes.count(address) ? axes[address].position : 0;
+}
+
+double NewportSMC100Bus::GetTargetPosition(int address)
+{
+   lock_guard<recursive_mutex> lk(axis_mutex);
+   return axes.count(address) ? axes[address].target_position : 0;
+}
+
+QString NewportSMC100Bus::GetAxisState(int address)
+{
+   lock_guard<recursive_mutex> lk(axis_mutex);
+   return axes.count(address) ? axes[address].state : "";
+}
+
+bool NewportSMC100Bus::IsMoving(int address)
+{
+   lock_guard<recursive_mutex> lk(axis_mutex);
+   return axes.count(address) && axes[address].in_motion;
+}
+
+void NewportSMC100Bus::SetVelocity(int address, double velocity)
+{
+   SendCommand(address, "VA", velocity);
+   QueryError(address);
+}
+
+void NewportSMC100Bus::SetAcceleration(int address, double acceleration)
+{
+   SendCommand(address, "AC", acceleration);
+   QueryError(address);
+}
+
+void NewportSMC100Bus::StopAll()
+{
+   for (int address : GetAxes())
+      SendCommand(address, "ST");
+}
+
+/*
+   Start a home search on all axes simultaneously
+*/
+void NewportSMC100Bus::HomeAll()
+{
+   QMutexLocker lk(&connection_mutex);
+
+   for (int address : GetAxes())
+   {
+      BeginMotion(address);
+      SendCommand(address, "OR");
+   }
+
+   lk.unlock();
+   QMetaObject::invokeMethod(this, "StartMonitoringMotion", Qt::QueuedConnection);
+}
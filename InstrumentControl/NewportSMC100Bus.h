@@ -0,0 +1,153 @@
+#pragma once
+
+#include "SerialDevice.h"
+
+#include <QMap>
+#include <QList>
+#include <QSet>
+#include <QStringList>
+
+#include <future>
+#include <mutex>
+#include <list>
+#include <map>
+
+/*
+   Controls a chain of Newport SMC100 controllers sharing one RS-485 port.
+   http://assets.newport.com/webDocuments-EN/images/SMC100CC_And_SMC100PP_User_Manual.pdf
+
+   Each controller is addressed by its controller index (1-31) and is
+   referred to as an axis here. All communication goes through one thread
+   and port; status polling is scheduled across axes so that moving axes
+   are polled quickly while idle axes are only checked occasionally.
+
+   MoveAxes() writes the move commands for all axes back to back so that
+   the stages move simultaneously rather than one after another.
+*/
+class NewportSMC100Bus : public SerialDevice
+{
+   Q_OBJECT
+
+public:
+
+   struct AxisState
+   {
+      QString stage_type;
+      double position = 0;
+      double target_position = 0;
+      QString state;
+      bool in_motion = false;
+      bool motion_ok = true;
+      bool motion_pending = false;
+      std::promise<bool> motion_promise;
+      std::shared_future<bool> motion_future;
+      qint64 last_poll_ms = 0;
+   };
+
+   /*
+      The bus connects as soon as it is created, so the axes must be given 
+      here: a map from controller address to the expected stage type, which 
+      may be empty to accept any stage
+   */
+   NewportSMC100Bus(const QMap<int, QString>& axes, QObject* parent = 0);
+
+   void init();
+
+   bool connectToPort(const QString& port);
+   void resetDevice(const QString& port) {};
+
+   QList<int> GetAxes();
+
+   std::shared_future<bool> MoveAxis(int address, double position);
+   std::shared_future<bool> MoveAxes(const QMap<int, double>& positions);
+   std::shared_future<bool> GetMotionFuture(int address);
+   void WaitForMotion();
+
+   double GetCurrentPosition(int address);
+   double GetTargetPosition(int address);
+   QString GetAxisState(int address);
+   bool IsMoving(int address);
+
+   void SetVelocity(int address, double velocity);
+   void SetAcceleration(int address, double acceleration);
+
+   void StopAll();
+   void HomeAll();
+
+   const QString& GetUnits() { return units; }
+
+signals:
+   void AxisPositionChanged(int address, double position);
+   void AxisStateChanged(int address, const QString& state);
+   void AxisMotionFinished(int address, bool success);
+   void MotionFinished(bool success); // all axes in a MoveAxes call
+
+protected:
+
+   QString SendQuery(int address, QByteArray command, bool require_connection = true);
+   void SendCommand(int address, QByteArray command, double value);
+   void SendCommand(int address, QByteArray command);
+   bool QueryError(int address);
+
+   void PollAxes();
+   void PollAxis(int address);
+   Q_INVOKABLE void StartMonitoringMotion();
+
+   void BeginMotion(int address);
+   void EndMotion(int address, bool success);
+
+   // Protects the axis table; port access is protected by connection_mutex
+   std::recursive_mutex axis_mutex;
+   std::map<int, AxisState> axes;
+
+   struct MoveGroup
+   {
+      QSet<int> remaining;
+      bool success = true;
+      std::promise<bool> promise;
+   };
+   std::list<MoveGroup> move_groups;
+
+   QTimer* poll_timer;
+   int fast_poll_interval_ms = 15;
+   int idle_poll_interval_ms = 500;
+
+   QString units = "mm";
+};
+
+
+/*
+   Presents one axis of a NewportSMC100Bus with the same position
+   interface as a single controller, e.g. for use with ImageSeriesScanner
+*/
+class NewportBusAxis : public QObject
+{
+   Q_OBJECT
+
+public:
+
+   NewportBusAxis(NewportSMC100Bus* bus, int address, QObject* parent = 0) :
+      QObject(parent), bus(bus), address(address)
+   {
+      connect(bus, &NewportSMC100Bus::AxisPositionChanged, this, [this](int a, double p) { if (a == this->address) emit CurrentPositionChanged(p); });
+      connect(bus, &NewportSMC100Bus::AxisMotionFinished, this, [this](int a, bool s) { if (a == this->address) emit MotionFinished(s); });
+   }
+
+   void SetTargetPosition(double position) { bus->MoveAxis(address, position); }
+   std::shared_future<bool> MoveToPosition(double position) { return bus->MoveAxis(address, position); }
+   double GetCurrentPosition() { return bus->GetCurrentPosition(address); }
+   double GetTargetPosition() { return bus->GetTargetPosition(address); }
+   void WaitForMotion() { bus->GetMotionFuture(address).wait(); }
+   void SetVelocity(double velocity) { bus->SetVelocity(address, velocity); }
+   void SetAcceleration(double acceleration) { bus->SetAcceleration(address, acceleration); }
+   const QString& GetUnits() { return bus->GetUnits(); }
+   int GetAddress() { return address; }
+
+signals:
+   void CurrentPositionChanged(double position);
+   void MotionFinished(bool success);
+
+private:
+   NewportSMC100Bus* bus;
+   int address;
+};
@@ -0,0 +1,483 @@
+#include "ParametricImageSource.h"
+
+#include <QMutexLocker>
+#include <QStringList>
+#include <chrono>
+#include <iostream>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+   QMutex registry_mutex;
+   QHash<QString, ParameterId> registry;
+   QStringList registry_names;
+}
+
+ParametricImageSource::ParametricImageSource(QObject* parent) :
+   ImageSource(parent)
+{
+   qRegisterMetaType<ParameterChanges>("ParameterChanges");
+
+   command_thread = std::thread(&ParametricImageSource::commandWorker, this);
+   command_thread_id = command_thread.get_id();
+}
+
+ParametricImageSource::~ParametricImageSource()
+{
+   stopParameterThreads();
+}
+
+ParameterId ParametricImageSource::parameterId(const QString& parameter)
+{
+   QMutexLocker lk(&registry_mutex);
+
+   auto it = registry.constFind(parameter);
+   if (it != registry.constEnd())
+      return it.value();
+
+   ParameterId id = registry_names.size();
+   registry.insert(parameter, id);
+   registry_names.append(parameter);
+   return id;
+}
+
+QString ParametricImageSource::parameterName(ParameterId id)
+{
+   QMutexLocker lk(&registry_mutex);
+   return registry_names.value(id);
+}
+
+/*
+   Resolve a handle, working out the vendor key and volatility once.
+   Handles are shared between callers asking for the same parameter.
+*/
+ParameterHandle ParametricImageSource::getParameterHandle(const QString& parameter, ParameterType type)
+{
+   ParameterId id = parameterId(parameter);
+   quint64 key = cacheKey(id, type);
+
+   {
+      QMutexLocker lk(&handle_mutex);
+      auto it = handles.constFind(key);
+      if (it != handles.constEnd())
+         return ParameterHandle(this, it.value());
+   }
+
+   auto info = std::make_shared<ParameterInfo>();
+   info->id = id;
+   info->name = parameter;
+   info->type = type;
+   info->key = nativeParameterKey(parameter);
+   info->is_volatile = isParameterVolatile(parameter);
+
+   QMutexLocker lk(&handle_mutex);
+   auto it = handles.constFind(key);
+   if (it != handles.constEnd())
+      return ParameterHandle(this, it.value());
+
+   handles.insert(key, info);
+   return ParameterHandle(this, info);
+}
+
+/*
+   Return the cached field, calling read() on a miss. The camera is queried
+   without holding the cache lock; if the cache is invalidated meanwhile the
+   value read may be stale, so it is returned but not stored.
+*/
+template<typename F>
+QVariant ParametricImageSource::cached(const ParameterInfo& parameter, CacheField field, F read)
+{
+   if (field == CachedValue && parameter.is_volatile)
+      return runCommand(read);
+
+   quint64 key = cacheKey(parameter.id, field);
+   quint64 generation;
+   {
+      QMutexLocker lk(&cache_mutex);
+      auto it = cache.constFind(key);
+      if (it != cache.constEnd())
+         return it.value();
+      generation = cache_generation;
+   }
+
+   QVariant value = runCommand(read);
+
+   QMutexLocker lk(&cache_mutex);
+   if (generation == cache_generation)
+      cache.insert(key, value);
+   return value;
+}
+
+void ParametricImageSource::setParameter(const ParameterHandle& parameter, QVariant value)
+{
+   try
+   {
+      runCommand([&]() { writeParameter(*parameter.info, value); });
+   }
+   catch (...)
+   {
+      invalidateParameterCache();
+      throw;
+   }
+
+   invalidateParameterCache();
+}
+
+QVariant ParametricImageSource::getParameter(const ParameterHandle& parameter)
+{
+   const ParameterInfo& p = *parameter.info;
+   return cached(p, CachedValue, [&]() { return readParameter(p); });
+}
+
+QVariant ParametricImageSource::getParameterLimit(const ParameterHandle& parameter, Limit limit)
+{
+   const ParameterInfo& p = *parameter.info;
+   CacheField field = (limit == Min) ? CachedMin : CachedMax;
+   return cached(p, field, [&]() { return readParameterLimit(p, limit); });
+}
+
+QVariant ParametricImageSource::getParameterMinIncrement(const ParameterHandle& parameter)
+{
+   const ParameterInfo& p = *parameter.info;
+   return cached(p, CachedIncrement, [&]() { return readParameterMinIncrement(p); });
+}
+
+EnumerationList ParametricImageSource::getEnumerationList(const ParameterHandle& parameter)
+{
+   const ParameterInfo& p = *parameter.info;
+   QVariant list = cached(p, CachedEnumeration, [&]() { return QVariant::fromValue(readEnumerationList(p)); });
+   return list.value<EnumerationList>();
+}
+
+bool ParametricImageSource::isParameterWritable(const ParameterHandle& parameter)
+{
+   const ParameterInfo& p = *parameter.info;
+   return cached(p, CachedWritable, [&]() { return QVariant(readParameterWritable(p)); }).toBool();
+}
+
+bool ParametricImageSource::isParameterReadOnly(const ParameterHandle& parameter)
+{
+   const ParameterInfo& p = *parameter.info;
+   return cached(p, CachedReadOnly, [&]() { return QVariant(readParameterReadOnly(p)); }).toBool();
+}
+
+/*
+   Writing one parameter can change the value, limits or availability of
+   others, so the whole cache is invalidated once all values are written,
+   including when a write fails part way through. The values are written
+   as a single command, so no other call to the camera comes in between.
+*/
+void ParametricImageSource::setParameters(const QList<ParameterValue>& values)
+{
+   QList<ParameterHandle> handles;
+   for (auto& v : values)
+      handles.append(getParameterHandle(v.parameter, v.type));
+
+   try
+   {
+      runCommand([&]()
+      {
+         for (int i = 0; i < values.size(); i++)
+            writeParameter(*handles[i].info, values[i].value);
+      });
+   }
+   catch (...)
+   {
+      invalidateParameterCache();
+      throw;
+   }
+
+   invalidateParameterCache();
+}
+
+void ParametricImageSource::getParameters(QList<ParameterValue>& parameters)
+{
+   QList<ParameterHandle> handles;
+   for (auto& p : parameters)
+      handles.append(getParameterHandle(p.parameter, p.type));
+
+   QList<int> missing;
+   quint64 generation;
+   {
+      QMutexLocker lk(&cache_mutex);
+      generation = cache_generation;
+
+      for (int i = 0; i < parameters.size(); i++)
+      {
+         auto it = cache.constFind(cacheKey(handles[i].id(), CachedValue));
+         if (it != cache.constEnd())
+            parameters[i].value = it.value();
+         else
+            missing.append(i);
+      }
+   }
+
+   if (missing.isEmpty())
+      return;
+
+   runCommand([&]()
+   {
+      for (int i : missing)
+         parameters[i].value = readParameter(*handles[i].info);
+   });
+
+   QMutexLocker lk(&cache_mutex);
+   if (generation != cache_generation)
+      return;
+
+   for (int i : missing)
+      if (!handles[i].info->is_volatile)
+         cache.insert(cacheKey(handles[i].id(), CachedValue), parameters[i].value);
+}
+
+void ParametricImageSource::invalidateParameter(const QString& parameter)
+{
+   ParameterId id = parameterId(parameter);
+   dropCachedParameter(id);
+   markDirty(id);
+}
+
+void ParametricImageSource::invalidateParameterCache()
+{
+   {
+      QMutexLocker lk(&cache_mutex);
+      cache.clear();
+      cache_generation++;
+   }
+   markAllDirty();
+}
+
+void ParametricImageSource::dropCachedParameter(ParameterId id)
+{
+   QMutexLocker lk(&cache_mutex);
+   for (int field = CachedValue; field <= CachedEnumeration; field++)
+      cache.remove(cacheKey(id, field));
+   cache_generation++;
+}
+
+void ParametricImageSource::markDirty(ParameterId id)
+{
+   {
+      lock_guard<mutex> lk(watch_mutex);
+      if (!watched.contains(id))
+         return;
+      dirty.insert(id);
+   }
+   watch_cv.notify_one();
+}
+
+void ParametricImageSource::markAllDirty()
+{
+   {
+      lock_guard<mutex> lk(watch_mutex);
+      if (watched.isEmpty())
+         return;
+      for (auto it = watched.constBegin(); it != watched.constEnd(); it++)
+         dirty.insert(it.key());
+   }
+   watch_cv.notify_one();
+}
+
+/*
+   Start sending changes to a parameter with parametersChanged. The
+   notification thread is started with the first watched parameter.
+*/
+void ParametricImageSource::watchParameter(const ParameterHandle& parameter, bool poll)
+{
+   {
+      lock_guard<mutex> lk(watch_mutex);
+
+      if (stop_notifications)
+         return;
+
+      WatchedParameter& w = watched[parameter.id()];
+      w.handle = parameter;
+      w.n_watchers++;
+      if (poll)
+         w.n_polling++;
+
+      // Read the initial state, so later changes can be detected
+      dirty.insert(parameter.id());
+
+      if (!notification_thread.joinable())
+         notification_thread = std::thread(&ParametricImageSource::notificationWorker, this);
+   }
+   watch_cv.notify_one();
+}
+
+void ParametricImageSource::unwatchParameter(const ParameterHandle& parameter, bool poll)
+{
+   lock_guard<mutex> lk(watch_mutex);
+
+   auto it = watched.find(parameter.id());
+   if (it == watched.end())
+      return;
+
+   if (poll)
+      it->n_polling--;
+   if (--(it->n_watchers) <= 0)
+      watched.erase(it);
+}
+
+/*
+   Stop the notification thread, then the command thread once it has run
+   any queued commands. Commands posted afterwards are run directly.
+*/
+void ParametricImageSource::stopParameterThreads()
+{
+   {
+      lock_guard<mutex> lk(watch_mutex);
+      stop_notifications = true;
+   }
+   watch_cv.notify_all();
+
+   if (notification_thread.joinable())
+      notification_thread.join();
+
+   {
+      lock_guard<mutex> lk(command_mutex);
+      stop_commands = true;
+   }
+   command_cv.notify_all();
+
+   if (command_thread.joinable())
+      command_thread.join();
+}
+
+void ParametricImageSource::postCommand(std::function<void()> f)
+{
+   {
+      lock_guard<mutex> lk(command_mutex);
+      if (!stop_commands)
+      {
+         commands.push_back(f);
+         command_cv.notify_one();
+         return;
+      }
+   }
+
+   f();
+}
+
+void ParametricImageSource::commandWorker()
+{
+   while (true)
+   {
+      std::function<void()> f;
+      {
+         unique_lock<mutex> lk(command_mutex);
+         command_cv.wait(lk, [this] { return stop_commands || !commands.empty(); });
+
+         if (commands.empty())
+            return;
+
+         f = commands.front();
+         commands.pop_front();
+      }
+
+      // Exceptions from runCommand are passed back by its future, so only posted commands get here
+      try
+      {
+         f();
+      }
+      catch (std::exception& e)
+      {
+         std::cout << "Error in camera command: " << e.what() << "\n";
+      }
+   }
+}
+
+ParameterState ParametricImageSource::readState(const ParameterHandle& parameter)
+{
+   ParameterState state;
+   state.value = getParameter(parameter);
+   state.is_writable = isParameterWritable(parameter);
+
+   if (parameter.type() == Integer || parameter.type() == Float)
+   {
+      state.min = getParameterLimit(parameter, Min);
+      state.max = getParameterLimit(parameter, Max);
+   }
+
+   return state;
+}
+
+/*
+   Wait for watched parameters to be invalidated, or for the next poll,
+   then wait a little longer so that a burst of invalidations, e.g. from
+   the camera reporting each parameter affected by a write, is read and 
+   sent as a single batch
+*/
+void ParametricImageSource::notificationWorker()
+{
+   auto next_poll = steady_clock::now() + milliseconds(poll_interval_ms);
+
+   while (true)
+   {
+      {
+         unique_lock<mutex> lk(watch_mutex);
+         watch_cv.wait_until(lk, next_poll, [this] { return stop_notifications || !dirty.isEmpty(); });
+         if (stop_notifications)
+            return;
+      }
+
+      this_thread::sleep_for(milliseconds(batch_interval_ms));
+
+      bool poll = steady_clock::now() >= next_poll;
+      if (poll)
+         next_poll = steady_clock::now() + milliseconds(poll_interval_ms);
+
+      QList<ParameterHandle> to_read;
+      QList<ParameterId> to_refresh;
+      {
+         lock_guard<mutex> lk(watch_mutex);
+         if (stop_notifications)
+            return;
+
+         for (auto it = watched.constBegin(); it != watched.constEnd(); it++)
+         {
+            bool is_polled = poll && it->n_polling > 0;
+            if (is_polled)
+               to_refresh.append(it.key());
+            if (is_polled || dirty.contains(it.key()))
+               to_read.append(it->handle);
+         }
+         dirty.clear();
+      }
+
+      // Polled parameters may have changed without the camera telling us
+      for (ParameterId id : to_refresh)
+         dropCachedParameter(id);
+
+      ParameterChanges changes;
+      for (auto& parameter : to_read)
+      {
+         ParameterState state;
+         try
+         {
+            state = readState(parameter);
+         }
+         catch (...)
+         {
+            continue; // e.g. not available in the current mode
+         }
+
+         lock_guard<mutex> lk(watch_mutex);
+         auto it = watched.find(parameter.id());
+         if (it == watched.end())
+            continue;
+
+         if (!it->has_state || it->state != state)
+         {
+            it->has_state = true;
+            it->state = state;
+            changes.insert(parameter.id(), state);
+         }
+      }
+
+      if (!changes.isEmpty())
+         emit parametersChanged(changes);
+   }
+}
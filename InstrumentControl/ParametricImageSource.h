@@ -3,31 +3,319 @@
 #include "ImageSource.h"
 #include <QVariant>
 #include <QMutex>
+#include <QHash>
+#include <QList>
+#include <QByteArray>
+#include <QSet>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <deque>
 
 enum ParameterType { Integer, Float, Boolean, Text, Enumeration };
 enum Limit { Min, Max };
 
 typedef QList<QPair<QString, int>> EnumerationList;
 
+// Interned parameter name, see ParametricImageSource::parameterId
+typedef int ParameterId;
+
+struct ParameterValue
+{
+   ParameterValue(const QString& parameter = QString(), ParameterType type = Integer, QVariant value = QVariant()) :
+      parameter(parameter), type(type), value(value) {}
+
+   QString parameter;
+   ParameterType type;
+   QVariant value;
+};
+
+/*
+   Everything about a parameter which doesn't change, worked out once
+   when a handle is first resolved
+*/
+struct ParameterInfo
+{
+   ParameterId id;
+   QString name;
+   ParameterType type;
+   QByteArray key; // vendor-native name, e.g. UTF-8 for Ximea or UTF-16 for Andor
+   bool is_volatile;
+};
+
+/*
+   What a control shows for a parameter; limits are only read for
+   Integer and Float parameters
+*/
+struct ParameterState
+{
+   QVariant value;
+   QVariant min;
+   QVariant max;
+   bool is_writable = true;
+
+   bool operator==(const ParameterState& other) const 
+   { 
+      return value == other.value && min == other.min && max == other.max && is_writable == other.is_writable; 
+   }
+   bool operator!=(const ParameterState& other) const { return !(*this == other); }
+};
+
+typedef QHash<ParameterId, ParameterState> ParameterChanges;
+Q_DECLARE_METATYPE(ParameterChanges)
+
+class ParametricImageSource;
+
+/*
+   A parameter resolved once with ParametricImageSource::getParameterHandle,
+   for repeated access without looking up or re-encoding the name. Values,
+   limits and flags are read through the source's cache rather than stored
+   in the handle, since they can change when other parameters are written.
+*/
+class ParameterHandle
+{
+public:
+
+   ParameterHandle() {}
+
+   bool isValid() const { return source != nullptr; }
+
+   ParameterId id() const { return info->id; }
+   const QString& name() const { return info->name; }
+   ParameterType type() const { return info->type; }
+   const QByteArray& nativeKey() const { return info->key; }
+
+   inline QVariant get() const;
+   inline void set(QVariant value) const;
+   inline QVariant limit(Limit limit) const;
+   inline QVariant minIncrement() const;
+   inline EnumerationList enumerationList() const;
+   inline bool isWritable() const;
+   inline bool isReadOnly() const;
+
+protected:
+
+   ParameterHandle(ParametricImageSource* source, std::shared_ptr<const ParameterInfo> info) :
+      source(source), info(info) {}
+
+   ParametricImageSource* source = nullptr;
+   std::shared_ptr<const ParameterInfo> info;
+
+   friend class ParametricImageSource;
+};
+
+template<typename T> struct ParameterTypeOf;
+template<> struct ParameterTypeOf<int> { static const ParameterType type = Integer; };
+template<> struct ParameterTypeOf<qint64> { static const ParameterType type = Integer; };
+template<> struct ParameterTypeOf<double> { static const ParameterType type = Float; };
+template<> struct ParameterTypeOf<bool> { static const ParameterType type = Boolean; };
+template<> struct ParameterTypeOf<QString> { static const ParameterType type = Text; };
+
+/*
+   Handle with the value type fixed at compile time,
+   e.g. TypedParameter<double> for an exposure time
+*/
+template<typename T>
+class TypedParameter : public ParameterHandle
+{
+public:
+
+   TypedParameter() {}
+   explicit TypedParameter(const ParameterHandle& handle) : ParameterHandle(handle) {}
+
+   T get() const { return ParameterHandle::get().value<T>(); }
+   void set(const T& value) const { ParameterHandle::set(QVariant::fromValue(value)); }
+   T limit(Limit l) const { return ParameterHandle::limit(l).value<T>(); }
+};
+
+/*
+   Image source with named parameters, e.g. a camera.
+
+   Parameter values, limits and flags are cached, so that repeated queries
+   from the UI or per-frame setup don't go to the camera. Subclasses implement
+   the protected read/write functions, which are only called on a cache miss.
+   The cache is invalidated on every write, since writing one parameter may
+   change others, and by the subclass when the camera reports a change.
+
+   The string-keyed functions resolve a handle on each call; code which
+   accesses a parameter repeatedly should keep a ParameterHandle instead.
+
+   Rather than polling, controls watch their parameter and are sent its new
+   state with parametersChanged. Whenever the cache is invalidated, by a
+   write or by the camera reporting a change, a single background thread
+   re-reads the affected watched parameters and emits only those which
+   changed, batched so that a burst of changes arrives as one update.
+   Parameters the camera can change without telling us (e.g. under auto
+   exposure, or temperatures) can be watched with polling, in which case
+   they are re-read from the camera every poll interval.
+
+   All calls to the camera made by the read/write functions are run on a 
+   single command thread, so they are serialised without a lock shared
+   with callers. Cache hits don't involve the command thread, and 
+   acquisition never waits on it.
+*/
 class ParametricImageSource : public ImageSource
 {
    Q_OBJECT
 
 public:
 
-   ParametricImageSource(QObject* parent = 0) :
-      ImageSource(parent) {}
+   ParametricImageSource(QObject* parent = 0);
+   ~ParametricImageSource();
+
+   // Ids are stable for the lifetime of the process and shared between sources
+   static ParameterId parameterId(const QString& parameter);
+   static QString parameterName(ParameterId id);
+
+   ParameterHandle getParameterHandle(const QString& parameter, ParameterType type);
+
+   template<typename T>
+   TypedParameter<T> getTypedParameter(const QString& parameter)
+   {
+      return TypedParameter<T>(getParameterHandle(parameter, ParameterTypeOf<T>::type));
+   }
+
+   void setParameter(const ParameterHandle& parameter, QVariant value);
+   QVariant getParameter(const ParameterHandle& parameter);
+   QVariant getParameterLimit(const ParameterHandle& parameter, Limit limit);
+   QVariant getParameterMinIncrement(const ParameterHandle& parameter);
+   EnumerationList getEnumerationList(const ParameterHandle& parameter);
+   bool isParameterWritable(const ParameterHandle& parameter);
+   bool isParameterReadOnly(const ParameterHandle& parameter);
+
+   void setParameter(const QString& parameter, ParameterType type, QVariant value) { setParameter(getParameterHandle(parameter, type), value); }
+   QVariant getParameter(const QString& parameter, ParameterType type) { return getParameter(getParameterHandle(parameter, type)); }
+   QVariant getParameterLimit(const QString& parameter, ParameterType type, Limit limit) { return getParameterLimit(getParameterHandle(parameter, type), limit); }
+   QVariant getParameterMinIncrement(const QString& parameter, ParameterType type) { return getParameterMinIncrement(getParameterHandle(parameter, type)); } // returns QVariant() if no min increment
+   EnumerationList getEnumerationList(const QString& parameter) { return getEnumerationList(getParameterHandle(parameter, Enumeration)); }
+   bool isParameterWritable(const QString& parameter) { return isParameterWritable(getParameterHandle(parameter, Integer)); }
+   bool isParameterReadOnly(const QString& parameter) { return isParameterReadOnly(getParameterHandle(parameter, Integer)); }
+
+   // Write several parameters in order, invalidating the cache once
+   void setParameters(const QList<ParameterValue>& values);
+
+   // Fill in the value of each parameter, only reading cache misses from the camera
+   void getParameters(QList<ParameterValue>& parameters);
 
-   virtual void setParameter(const QString& parameter, ParameterType type, QVariant value) {};
-   virtual QVariant getParameter(const QString& parameter, ParameterType type) { return QVariant(); };
-   virtual QVariant getParameterLimit(const QString& parameter, ParameterType type, Limit limit) { return 0; };
-   virtual QVariant getParameterMinIncrement(const QString& parameter, ParameterType type) { return QVariant(); }; // returns QVariant() if no min increment
-   virtual EnumerationList getEnumerationList(const QString& parameter) { return EnumerationList(); };
-   virtual bool isParameterWritable(const QString& parameter) { return true; };
-   virtual bool isParameterReadOnly(const QString& parameter) { return false; };
+   void invalidateParameter(const QString& parameter);
+   void invalidateParameterCache();
 
-   QMutex* control_mutex;
+   // Calls to watch and unwatch should be paired; a parameter is polled if any watcher asks
+   void watchParameter(const ParameterHandle& parameter, bool poll = false);
+   void unwatchParameter(const ParameterHandle& parameter, bool poll = false);
+   void setParameterPollInterval(int poll_interval_ms_) { poll_interval_ms = poll_interval_ms_; }
+
+   /*
+      Run f on the command thread and return its result; exceptions are
+      passed back to the caller. f is run directly if called from the 
+      command thread, e.g. by a camera callback during a write.
+   */
+   template<typename F>
+   auto runCommand(F f) -> decltype(f())
+   {
+      if (std::this_thread::get_id() == command_thread_id)
+         return f();
+
+      auto task = std::make_shared<std::packaged_task<decltype(f())()>>(f);
+      auto result = task->get_future();
+      postCommand([task]() { (*task)(); });
+      return result.get();
+   }
 
 signals:
    void controlLockUpdated(bool locked);
-};
\ No newline at end of file
+
+   // Emitted from the notification thread; connect with a queued connection
+   void parametersChanged(const ParameterChanges& changes);
+
+protected:
+
+   virtual void writeParameter(const ParameterInfo& parameter, QVariant value) {};
+   virtual QVariant readParameter(const ParameterInfo& parameter) { return QVariant(); };
+   virtual QVariant readParameterLimit(const ParameterInfo& parameter, Limit limit) { return 0; };
+   virtual QVariant readParameterMinIncrement(const ParameterInfo& parameter) { return QVariant(); };
+   virtual EnumerationList readEnumerationList(const ParameterInfo& parameter) { return EnumerationList(); };
+   virtual bool readParameterWritable(const ParameterInfo& parameter) { return true; };
+   virtual bool readParameterReadOnly(const ParameterInfo& parameter) { return false; };
+
+   // Name passed to the vendor API, stored in ParameterInfo::key
+   virtual QByteArray nativeParameterKey(const QString& parameter) { return parameter.toUtf8(); };
+
+   /*
+      Override to return true for parameters whose value changes without
+      being written and isn't reported by the camera, e.g. sensor temperature.
+      Their values are never cached; limits and flags still are.
+   */
+   virtual bool isParameterVolatile(const QString& parameter) { return false; };
+
+   // Queue f to run on the command thread without waiting for it
+   void postCommand(std::function<void()> f);
+
+   /*
+      Subclasses must call this in their destructor, as the notification 
+      and command threads call the read functions above
+   */
+   void stopParameterThreads();
+
+private:
+
+   enum CacheField { CachedValue, CachedMin, CachedMax, CachedIncrement, CachedWritable, CachedReadOnly, CachedEnumeration };
+
+   static quint64 cacheKey(ParameterId id, int field) { return (quint64(id) << 3) | field; }
+
+   template<typename F>
+   QVariant cached(const ParameterInfo& parameter, CacheField field, F read);
+
+   QMutex handle_mutex;
+   QHash<quint64, std::shared_ptr<const ParameterInfo>> handles; // keyed by id and type
+
+   void dropCachedParameter(ParameterId id);
+   void markDirty(ParameterId id);
+   void markAllDirty();
+
+   ParameterState readState(const ParameterHandle& parameter);
+   void notificationWorker();
+   void commandWorker();
+
+   QMutex cache_mutex;
+   QHash<quint64, QVariant> cache;
+   quint64 cache_generation = 0; // incremented on invalidation, so stale reads aren't stored
+
+   struct WatchedParameter
+   {
+      ParameterHandle handle;
+      int n_watchers = 0;
+      int n_polling = 0;
+      bool has_state = false;
+      ParameterState state; // last state sent
+   };
+
+   std::thread notification_thread;
+   std::mutex watch_mutex;
+   std::condition_variable watch_cv;
+   QHash<ParameterId, WatchedParameter> watched;
+   QSet<ParameterId> dirty;
+   bool stop_notifications = false;
+   std::atomic<int> poll_interval_ms = { 500 };
+   const int batch_interval_ms = 16; // about one UI frame
+
+   std::thread command_thread;
+   std::thread::id command_thread_id;
+   std::mutex command_mutex;
+   std::condition_variable command_cv;
+   std::deque<std::function<void()>> commands;
+   bool stop_commands = false;
+};
+
+
+QVariant ParameterHandle::get() const { return source->getParameter(*this); }
+void ParameterHandle::set(QVariant value) const { source->setParameter(*this, value); }
+QVariant ParameterHandle::limit(Limit limit) const { return source->getParameterLimit(*this, limit); }
+QVariant ParameterHandle::minIncrement() const { return source->getParameterMinIncrement(*this); }
+EnumerationList ParameterHandle::enumerationList() const { return source->getEnumerationList(*this); }
+bool ParameterHandle::isWritable() const { return source->isParameterWritable(*this); }
+bool ParameterHandle::isReadOnly() const { return source->isParameterReadOnly(*this); }
@@ -0,0 +1,256 @@
+#include "ProcessingPipeline.h"
+
+#include <chrono>
+
+using namespace std;
+using namespace std::chrono;
+
+void ProcessingPipeline::Gate::wait(uint64_t seq)
+{
+   unique_lock<mutex> lk(m);
+   cv.wait(lk, [&] { return next == seq; });
+}
+
+void ProcessingPipeline::Gate::advance()
+{
+   {
+      lock_guard<mutex> lk(m);
+      next++;
+   }
+   cv.notify_all();
+}
+
+
+ProcessingPipeline::ProcessingPipeline(ImageSource* input, int n_workers, QObject* parent, QThread* thread,
+                                       const vector<shared_ptr<FrameProcessingStage>>& stages) :
+   ImageSource(parent, thread),
+   input(input),
+   pool(16)
+{
+   setStages(stages);
+
+   for (int i = 0; i < n_workers; i++)
+      workers.push_back(std::thread(&ProcessingPipeline::worker, this));
+
+   startThread();
+}
+
+ProcessingPipeline::~ProcessingPipeline()
+{
+   if (input)
+      disconnect(input, &ImageSource::newImage, this, nullptr);
+
+   {
+      lock_guard<mutex> lk(queue_mutex);
+      terminate = true;
+   }
+   queue_cv.notify_all();
+
+   for (auto& w : workers)
+      w.join();
+}
+
+ProcessingPipeline* ProcessingPipeline::create(ImageSource* input, const vector<shared_ptr<FrameProcessingStage>>& stages, int n_workers, QObject* parent)
+{
+   return new ProcessingPipeline(input, n_workers, parent, 0, stages);
+}
+
+void ProcessingPipeline::init()
+{
+   // Copy the frame on the source's thread, before it can be overwritten
+   if (input)
+      connect(input, &ImageSource::newImage, this, [this]() { submitFrame(input->getImageUnsafe()); }, Qt::DirectConnection);
+}
+
+void ProcessingPipeline::addStage(shared_ptr<FrameProcessingStage> stage)
+{
+   auto stages = getStages();
+   stages.push_back(stage);
+   setStages(stages);
+}
+
+void ProcessingPipeline::clearStages()
+{
+   setStages({});
+}
+
+vector<shared_ptr<FrameProcessingStage>> ProcessingPipeline::getStages()
+{
+   lock_guard<mutex> lk(queue_mutex);
+   return chain->stages;
+}
+
+/*
+   Frames already received keep the chain they started with. The gates of
+   the new chain start at the next sequence number to be assigned.
+*/
+void ProcessingPipeline::setStages(const vector<shared_ptr<FrameProcessingStage>>& stages)
+{
+   auto new_chain = make_shared<Chain>();
+   new_chain->stages = stages;
+
+   lock_guard<mutex> lk(queue_mutex);
+   for (size_t i = 0; i <= stages.size(); i++)
+   {
+      new_chain->gates.push_back(unique_ptr<Gate>(new Gate));
+      new_chain->gates.back()->next = next_seq;
+   }
+   chain = new_chain;
+}
+
+void ProcessingPipeline::submitFrame(const cv::Mat& frame)
+{
+   if (frame.empty() || !producing_images)
+      return;
+
+   {
+      lock_guard<mutex> lk(queue_mutex);
+      if ((int) queue.size() >= max_queued_frames)
+      {
+         n_dropped++;
+         return;
+      }
+   }
+
+   PooledFrame f = pool.acquire(frame.size(), frame.type());
+   frame.copyTo(*f);
+
+   {
+      lock_guard<mutex> lk(queue_mutex);
+      Job job;
+      job.seq = next_seq++;
+      job.chain = chain;
+      job.frame = f;
+      queue.push_back(job);
+   }
+   queue_cv.notify_one();
+}
+
+void ProcessingPipeline::worker()
+{
+   while (true)
+   {
+      Job job;
+      {
+         unique_lock<mutex> lk(queue_mutex);
+         queue_cv.wait(lk, [this] { return !queue.empty() || terminate; });
+
+         // Queued frames are drained so no worker is left waiting at a gate
+         if (queue.empty())
+            return;
+
+         job = queue.front();
+         queue.pop_front();
+      }
+
+      process(job);
+   }
+}
+
+/*
+   A frame consumed by a stage still has to pass through the remaining
+   ordered gates, so that later frames aren't held up waiting for it
+*/
+void ProcessingPipeline::process(Job& job)
+{
+   Chain& c = *job.chain;
+   PooledFrame frame = job.frame;
+   bool consumed = terminate;
+
+   for (size_t i = 0; i < c.stages.size(); i++)
+   {
+      FrameProcessingStage* stage = c.stages[i].get();
+      bool ordered = stage->isOrdered();
+
+      if (ordered)
+         c.gates[i]->wait(job.seq);
+
+      if (!consumed)
+      {
+         auto t0 = steady_clock::now();
+
+         cv::Size size = stage->outputSize(frame->size());
+         int type = stage->outputType(frame->type());
+
+         PooledFrame output;
+         if (stage->canProcessInPlace() && size == frame->size() && type == frame->type())
+            output = frame;
+         else
+            output = pool.acquire(size, type);
+
+         consumed = !stage->process(*frame, *output);
+         frame = output;
+
+         stage->recordTiming(duration<double, micro>(steady_clock::now() - t0).count());
+      }
+
+      if (ordered)
+         c.gates[i]->advance();
+   }
+
+   Gate& publish_gate = *c.gates.back();
+   publish_gate.wait(job.seq);
+   if (!consumed)
+      publish(frame);
+   publish_gate.advance();
+}
+
+void ProcessingPipeline::publish(PooledFrame frame)
+{
+   {
+      lock_guard<mutex> lk(frame_mutex);
+      latest = frame;
+      frame_count++;
+   }
+   frame_cv.notify_all();
+   n_processed++;
+
+   // Publishing is serialised by the publish gate, so only one frame is delivered at a time
+   delivering = frame;
+   delivering_thread = std::this_thread::get_id();
+
+   emit newImage();
+
+   delivering_thread = std::thread::id();
+   delivering.reset();
+}
+
+cv::Mat ProcessingPipeline::getImage()
+{
+   PooledFrame frame;
+   {
+      lock_guard<mutex> lk(frame_mutex);
+      frame = latest;
+   }
+   return frame ? frame->clone() : cv::Mat();
+}
+
+/*
+   A pooled buffer is reused as soon as nothing holds it, which a cv::Mat
+   header doesn't. So the buffer is only shared with slots directly
+   connected to newImage, while the frame is held for its delivery; any
+   other caller gets a copy.
+*/
+cv::Mat ProcessingPipeline::getImageUnsafe()
+{
+   if (delivering_thread == std::this_thread::get_id())
+      return *delivering;
+
+   return getImage();
+}
+
+cv::Mat ProcessingPipeline::getNextImage()
+{
+   unique_lock<mutex> lk(frame_mutex);
+   uint64_t count = frame_count;
+   if (!frame_cv.wait_for(lk, seconds(10), [&] { return frame_count > count; }))
+      return cv::Mat();
+
+   return latest ? latest->clone() : cv::Mat();
+}
+
+void ProcessingPipeline::resetTimings()
+{
+   for (auto& stage : getStages())
+      stage->resetTiming();
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "ImageSource.h"
+#include "FramePool.h"
+#include "FrameProcessingStage.h"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstdint>
+
+/*
+   Runs frames from an ImageSource through a chain of FrameProcessingStages
+   on a pool of worker threads, and is itself an ImageSource of the
+   processed frames. Different frames are processed by different workers
+   at the same time; stages which are ordered only see one frame at a time,
+   in order, and frames are always published in the order they arrived.
+
+   Frames are copied from the source into buffers from a FramePool on the
+   thread that emits newImage, and every stage writes into a pooled
+   buffer, so nothing is allocated at a steady frame size. If the workers
+   fall more than max_queued_frames behind, incoming frames are dropped.
+
+   Pipelines can be chained, e.g. to give different consumers differently
+   processed versions of the same stream.
+*/
+class ProcessingPipeline : public ImageSource
+{
+   Q_OBJECT
+
+public:
+
+   // The initial stages are set before the input is connected, so every frame goes through them
+   ProcessingPipeline(ImageSource* input, int n_workers = 2, QObject* parent = 0, QThread* thread = 0,
+                      const std::vector<std::shared_ptr<FrameProcessingStage>>& stages = {});
+   ~ProcessingPipeline();
+
+   // A pipeline with a fixed set of stages, e.g. to give one consumer a binned stream
+   static ProcessingPipeline* create(ImageSource* input, const std::vector<std::shared_ptr<FrameProcessingStage>>& stages, int n_workers = 1, QObject* parent = 0);
+
+   void init();
+
+   // Changes to the stages apply to frames received afterwards
+   void addStage(std::shared_ptr<FrameProcessingStage> stage);
+   void clearStages();
+   std::vector<std::shared_ptr<FrameProcessingStage>> getStages();
+
+   // Copy a frame into the pipeline, for sources which aren't an ImageSource
+   void submitFrame(const cv::Mat& frame);
+
+   cv::Mat getImage();
+   cv::Mat getNextImage();
+
+   // Shares the pooled buffer only in a slot directly connected to newImage, otherwise copies
+   cv::Mat getImageUnsafe();
+
+   void setMaxQueuedFrames(int max_queued_frames_) { max_queued_frames = max_queued_frames_; }
+   uint64_t getNumDroppedFrames() { return n_dropped; }
+   uint64_t getNumProcessedFrames() { return n_processed; }
+
+   void resetTimings();
+
+private:
+
+   // Frames pass through each gate in sequence order
+   struct Gate
+   {
+      std::mutex m;
+      std::condition_variable cv;
+      uint64_t next = 0;
+
+      void wait(uint64_t seq);
+      void advance();
+   };
+
+   struct Chain
+   {
+      std::vector<std::shared_ptr<FrameProcessingStage>> stages;
+      std::vector<std::unique_ptr<Gate>> gates; // one per stage, and one for publishing
+   };
+
+   struct Job
+   {
+      uint64_t seq;
+      std::shared_ptr<Chain> chain;
+      PooledFrame frame;
+   };
+
+   void setStages(const std::vector<std::shared_ptr<FrameProcessingStage>>& stages);
+   void worker();
+   void process(Job& job);
+   void publish(PooledFrame frame);
+
+   ImageSource* input;
+   FramePool pool;
+
+   std::vector<std::thread> workers;
+   std::atomic<bool> terminate = { false };
+
+   std::mutex queue_mutex;
+   std::condition_variable queue_cv;
+   std::deque<Job> queue;
+   int max_queued_frames = 4;
+
+   std::shared_ptr<Chain> chain; // guarded by queue_mutex
+   uint64_t next_seq = 0;
+
+   std::mutex frame_mutex;
+   std::condition_variable frame_cv;
+   PooledFrame latest;
+   uint64_t frame_count = 0;
+
+   // Frame held while newImage is emitted, only read on the emitting thread
+   PooledFrame delivering;
+   std::atomic<std::thread::id> delivering_thread = { std::thread::id() };
+
+   std::atomic<uint64_t> n_dropped = { 0 };
+   std::atomic<uint64_t> n_processed = { 0 };
+};
@@ -0,0 +1,361 @@
+#include "ScanEngine.h"
+
+#include <QDateTime>
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+   std::shared_future<bool> ReadyFuture(bool value)
+   {
+      std::promise<bool> p;
+      p.set_value(value);
+      return p.get_future().share();
+   }
+}
+
+std::vector<double> ScanAxis::LinearValues(double start, double end, int n)
+{
+   std::vector<double> values;
+
+   if (n == 1)
+      values.push_back(start);
+
+   for (int i = 0; n > 1 && i < n; i++)
+      values.push_back(start + i * (end - start) / (n - 1));
+
+   return values;
+}
+
+void ScanAxis::SetSetter(std::function<void(double)> setter)
+{
+   move = [setter](double value)
+   {
+      setter(value);
+      return ReadyFuture(true);
+   };
+}
+
+void ScanAxis::SetCameraParameter(ParametricImageSource* source, const QString& parameter, ParameterType type)
+{
+   ParameterHandle handle = source->getParameterHandle(parameter, type);
+   move = [handle](double value)
+   {
+      handle.set(value);
+      return ReadyFuture(true);
+   };
+}
+
+/*
+   Indices into axes, outermost first
+*/
+std::vector<int> ScanPlan::GetAxisOrder() const
+{
+   std::vector<int> order(axes.size());
+   for (size_t i = 0; i < axes.size(); i++)
+      order[i] = (int) i;
+
+   if (optimise_axis_order)
+      stable_sort(order.begin(), order.end(), [this](int a, int b) { return axes[a].change_time_ms > axes[b].change_time_ms; });
+
+   return order;
+}
+
+int ScanPlan::GetNumPoints() const
+{
+   int n = n_timepoints;
+   for (auto& axis : axes)
+      n *= (int) axis.values.size();
+   return n;
+}
+
+/*
+   Points are enumerated as a mixed radix counter over the ordered axes
+   with time outermost. With snake ordering an axis runs backwards on
+   every other pass, where the pass number counts how many times it has
+   completed, so consecutive points differ in a single axis by one step.
+*/
+std::vector<ScanPoint> ScanPlan::GeneratePoints() const
+{
+   std::vector<int> order = GetAxisOrder();
+   int n_points = GetNumPoints();
+
+   std::vector<ScanPoint> points;
+   points.reserve(n_points);
+
+   for (int n = 0; n < n_points; n++)
+   {
+      ScanPoint p;
+      p.index = n;
+      p.indices.resize(axes.size());
+      p.coordinates.resize(axes.size());
+
+      int remainder = n;
+      int block = n_points / n_timepoints;
+      p.timepoint = remainder / block;
+      remainder %= block;
+
+      for (int axis_idx : order)
+      {
+         const ScanAxis& axis = axes[axis_idx];
+         int size = (int) axis.values.size();
+         int pass = n / block;
+         block /= size;
+
+         int i = remainder / block;
+         remainder %= block;
+
+         if (axis.snake && (pass % 2))
+            i = size - 1 - i;
+
+         p.indices[axis_idx] = i;
+         p.coordinates[axis_idx] = axis.values[i];
+      }
+
+      points.push_back(p);
+   }
+
+   return points;
+}
+
+QString ScanPlan::Label(const ScanPoint& point) const
+{
+   QStringList parts;
+
+   if (n_timepoints > 1)
+      parts.append(QString("T=%1").arg(point.timepoint));
+
+   for (size_t i = 0; i < axes.size(); i++)
+      parts.append(QString("%1=%2%3").arg(axes[i].name).arg(point.coordinates[i], 0, 'f', 3).arg(axes[i].unit));
+
+   return parts.join(", ");
+}
+
+
+void ScanDataset::BeginScan(const ScanPlan& plan)
+{
+   axis_names.clear();
+   axis_units.clear();
+   records.clear();
+
+   for (auto& axis : plan.GetAxes())
+   {
+      axis_names.append(axis.name);
+      axis_units.append(axis.unit);
+   }
+
+   records.reserve(plan.GetNumPoints());
+}
+
+void ScanDataset::AddImage(const ScanPoint& point, const cv::Mat& image)
+{
+   Record r;
+   r.point = point;
+   r.image = image;
+   records.push_back(r);
+}
+
+const ScanDataset::Record* ScanDataset::Find(const std::vector<int>& indices, int timepoint)
+{
+   for (auto& r : records)
+      if (r.point.timepoint == timepoint && r.point.indices == indices)
+         return &r;
+   return nullptr;
+}
+
+
+std::shared_future<bool> ScanEngine::Start()
+{
+   Stop();
+
+   auto promise = make_shared<std::promise<bool>>();
+   std::shared_future<bool> future = promise->get_future().share();
+
+   ClearStop();
+   running = true;
+   worker = std::thread([this, promise]()
+   {
+      promise->set_value(Run());
+   });
+
+   return future;
+}
+
+void ScanEngine::Stop()
+{
+   stop_requested = true;
+   if (worker.joinable())
+      worker.join();
+}
+
+bool ScanEngine::Run()
+{
+   running = true;
+
+   std::vector<ScanPoint> points = plan.GeneratePoints();
+
+   for (auto sink : sinks)
+      sink->BeginScan(plan);
+
+   {
+      lock_guard<mutex> lk(queue_mutex);
+      queue.clear();
+      queue_finished = false;
+   }
+   std::thread processor(&ScanEngine::ProcessImages, this);
+
+   auto t_start = steady_clock::now();
+   bool success = true;
+
+   for (size_t i = 0; i < points.size(); i++)
+   {
+      ScanPoint& p = points[i];
+
+      if (!WaitUntil(t_start + milliseconds((qint64) p.timepoint * plan.GetTimepointInterval())) ||
+          !MoveTo(p, (i > 0) ? &points[i - 1] : nullptr))
+      {
+         success = false;
+         break;
+      }
+
+      p.timestamp_ms = QDateTime::currentMSecsSinceEpoch();
+      QueueImage(p, AcquireImage());
+
+      emit PointAcquired((int) i);
+      emit ProgressChanged((int) ((100 * (i + 1)) / points.size()));
+
+      if (stop_requested)
+      {
+         success = (i + 1 == points.size());
+         break;
+      }
+   }
+
+   {
+      lock_guard<mutex> lk(queue_mutex);
+      queue_finished = true;
+   }
+   queue_cv.notify_all();
+   processor.join();
+
+   for (auto sink : sinks)
+      sink->EndScan();
+
+   running = false;
+   emit Finished(success);
+
+   return success;
+}
+
+/*
+   Start all axes which need to change together, then wait for all of them
+   and the longest settle time. Returns false if any move failed, so that
+   no image is recorded at coordinates the stage never reached.
+*/
+bool ScanEngine::MoveTo(const ScanPoint& point, const ScanPoint* previous)
+{
+   const std::vector<ScanAxis>& axes = plan.GetAxes();
+
+   std::vector<std::shared_future<bool>> moves;
+   int settle_time_ms = 0;
+
+   for (int axis_idx : plan.GetAxisOrder())
+   {
+      const ScanAxis& axis = axes[axis_idx];
+      if (!axis.move || (previous && previous->indices[axis_idx] == point.indices[axis_idx]))
+         continue;
+
+      moves.push_back(axis.move(point.coordinates[axis_idx]));
+      settle_time_ms = max(settle_time_ms, axis.settle_time_ms);
+   }
+
+   bool moves_ok = true;
+   for (auto& move : moves)
+   {
+      while (move.wait_for(milliseconds(50)) != future_status::ready)
+         if (stop_requested)
+            return false;
+
+      moves_ok &= move.get();
+   }
+
+   if (!moves_ok)
+   {
+      cout << "Scan move failed at point " << point.index << ", stopping scan\n";
+      return false;
+   }
+
+   return WaitUntil(steady_clock::now() + milliseconds(settle_time_ms));
+}
+
+bool ScanEngine::WaitUntil(steady_clock::time_point t)
+{
+   while (steady_clock::now() < t)
+   {
+      if (stop_requested)
+         return false;
+      this_thread::sleep_until(min(t, steady_clock::now() + milliseconds(50)));
+   }
+   return true;
+}
+
+cv::Mat ScanEngine::AcquireImage()
+{
+   if (image_source == nullptr)
+      return cv::Mat();
+
+   for (int i = 0; i < n_discard_frames; i++)
+      image_source->getNextImage();
+
+   cv::Mat m = image_source->getNextImage();
+
+   if (stability_threshold > 0)
+   {
+      for (int i = 1; i < max_stability_frames && !stop_requested; i++)
+      {
+         cv::Mat next = image_source->getNextImage();
+         double change = cv::norm(next, m, cv::NORM_L1) / (cv::norm(m, cv::NORM_L1) + 1e-9);
+         m = next;
+
+         if (change < stability_threshold)
+            break;
+      }
+   }
+
+   return m;
+}
+
+void ScanEngine::QueueImage(const ScanPoint& point, cv::Mat image)
+{
+   {
+      unique_lock<mutex> lk(queue_mutex);
+      queue_cv.wait(lk, [this] { return (int) queue.size() < max_queued_images; });
+      queue.push_back(std::make_pair(point, image));
+   }
+   queue_cv.notify_all();
+}
+
+void ScanEngine::ProcessImages()
+{
+   while (true)
+   {
+      std::pair<ScanPoint, cv::Mat> item;
+      {
+         unique_lock<mutex> lk(queue_mutex);
+         queue_cv.wait(lk, [this] { return !queue.empty() || queue_finished; });
+
+         if (queue.empty())
+            return;
+
+         item = queue.front();
+         queue.pop_front();
+      }
+      queue_cv.notify_all();
+
+      for (auto sink : sinks)
+         sink->AddImage(item.first, item.second);
+   }
+}
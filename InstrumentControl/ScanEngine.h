@@ -0,0 +1,216 @@
+#pragma once
+
+#include "ImageSource.h"
+#include "ParametricImageSource.h"
+
+#include <QObject>
+#include <QString>
+#include <QStringList>
+#include <cv.h>
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <future>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+/*
+   One dimension of a scan: a list of values and a function which applies
+   a value, returning a future which becomes ready once it has taken effect
+*/
+struct ScanAxis
+{
+   typedef std::function<std::shared_future<bool>(double)> Mover;
+
+   QString name = "P";
+   QString unit;
+   std::vector<double> values;
+   Mover move;
+
+   int settle_time_ms = 0; // wait after the value has been applied
+   double change_time_ms = 0; // estimated cost of a change, slow axes are scanned outermost
+   bool snake = true; // reverse direction on alternate passes
+
+   static std::vector<double> LinearValues(double start, double end, int n);
+
+   // For controllers with std::shared_future<bool> MoveToPosition(double)
+   template<class T>
+   void SetStage(T* stage)
+   {
+      move = [stage](double value) { return stage->MoveToPosition(value); };
+   }
+
+   // For setters which take effect immediately, e.g. Arduino parameters
+   void SetSetter(std::function<void(double)> setter);
+   void SetCameraParameter(ParametricImageSource* source, const QString& parameter, ParameterType type);
+};
+
+struct ScanPoint
+{
+   int index = 0; // position in acquisition order
+   int timepoint = 0;
+   std::vector<int> indices; // per axis, in the order axes were added
+   std::vector<double> coordinates;
+   qint64 timestamp_ms = 0; // acquisition time, ms since epoch
+};
+
+/*
+   The set of axes and time points to scan. Points are generated with the
+   most expensive axis outermost, so it changes least often, and with snake
+   ordering of the inner axes to minimise travel.
+*/
+class ScanPlan
+{
+public:
+
+   void AddAxis(const ScanAxis& axis) { axes.push_back(axis); }
+   const std::vector<ScanAxis>& GetAxes() const { return axes; }
+
+   void SetTimeLapse(int n_timepoints_, int interval_ms_) { n_timepoints = n_timepoints_; timepoint_interval_ms = interval_ms_; }
+   int GetNumTimepoints() const { return n_timepoints; }
+   int GetTimepointInterval() const { return timepoint_interval_ms; }
+
+   // If false, axes are scanned in the order they were added, first outermost
+   void SetOptimiseAxisOrder(bool optimise_axis_order_) { optimise_axis_order = optimise_axis_order_; }
+
+   std::vector<int> GetAxisOrder() const;
+   std::vector<ScanPoint> GeneratePoints() const;
+   int GetNumPoints() const;
+
+   QString Label(const ScanPoint& point) const;
+
+protected:
+   std::vector<ScanAxis> axes;
+   int n_timepoints = 1;
+   int timepoint_interval_ms = 0;
+   bool optimise_axis_order = true;
+};
+
+/*
+   Receives images from a scan. AddImage is called on the scan's processing
+   thread, in acquisition order.
+*/
+class ScanSink
+{
+public:
+   virtual ~ScanSink() {};
+
+   virtual void BeginScan(const ScanPlan& plan) {};
+   virtual void AddImage(const ScanPoint& point, const cv::Mat& image) = 0;
+   virtual void EndScan() {};
+};
+
+/*
+   In-memory dataset of a scan with the coordinates of every image
+*/
+class ScanDataset : public ScanSink
+{
+public:
+
+   struct Record
+   {
+      ScanPoint point;
+      cv::Mat image;
+   };
+
+   void BeginScan(const ScanPlan& plan);
+   void AddImage(const ScanPoint& point, const cv::Mat& image);
+
+   const QStringList& GetAxisNames() { return axis_names; }
+   const QStringList& GetAxisUnits() { return axis_units; }
+   const std::vector<Record>& GetRecords() { return records; }
+
+   // Returns nullptr if the point hasn't been acquired
+   const Record* Find(const std::vector<int>& indices, int timepoint = 0);
+
+protected:
+   QStringList axis_names;
+   QStringList axis_units;
+   std::vector<Record> records;
+};
+
+/*
+   Executes a ScanPlan, acquiring one image from an ImageSource at each
+   point. Only axes whose value changes are moved, and all changing axes
+   are moved simultaneously. Images are passed to the sinks on a separate
+   thread so the next move overlaps with processing of the current image.
+*/
+class ScanEngine : public QObject
+{
+   Q_OBJECT
+
+public:
+
+   ScanEngine(QObject* parent = 0) :
+      QObject(parent)
+   {}
+
+   ~ScanEngine() { Stop(); }
+
+   void SetPlan(const ScanPlan& plan_) { plan = plan_; }
+   const ScanPlan& GetPlan() { return plan; }
+
+   void SetImageSource(ImageSource* image_source_) { image_source = image_source_; }
+   void AddSink(ScanSink* sink) { sinks.push_back(sink); }
+   void ClearSinks() { sinks.clear(); }
+
+   /*
+      If threshold > 0, images are acquired after each move until the relative
+      mean absolute difference between consecutive images drops below it
+      (up to max_frames), and the last image is used
+   */
+   void SetStabilityThreshold(double threshold, int max_frames = 10) { stability_threshold = threshold; max_stability_frames = max_frames; }
+
+   // Number of frames to discard after settling, e.g. if the first frame may have been exposed during motion
+   void SetDiscardFrames(int n_discard_frames_) { n_discard_frames = n_discard_frames_; }
+
+   // Acquisition waits if the sinks fall this many images behind, bounding memory use
+   void SetMaxQueuedImages(int max_queued_images_) { max_queued_images = max_queued_images_; }
+
+   std::shared_future<bool> Start();
+   bool Run(); // blocks until the scan is complete, false if stopped or a move failed
+   void Stop();
+
+   /*
+      Run() doesn't clear a previous Stop(), so that a Stop() made while the
+      thread is starting isn't lost. Call this before starting a thread that
+      calls Run(); Start() does this itself
+   */
+   void ClearStop() { stop_requested = false; }
+   bool IsRunning() { return running; }
+
+signals:
+   void ProgressChanged(int percentage_progress);
+   void PointAcquired(int index);
+   void Finished(bool success);
+
+protected:
+
+   bool MoveTo(const ScanPoint& point, const ScanPoint* previous);
+   bool WaitUntil(std::chrono::steady_clock::time_point t);
+   cv::Mat AcquireImage();
+
+   void QueueImage(const ScanPoint& point, cv::Mat image);
+   void ProcessImages();
+
+   ScanPlan plan;
+   ImageSource* image_source = nullptr;
+   std::vector<ScanSink*> sinks;
+
+   double stability_threshold = 0;
+   int max_stability_frames = 10;
+   int n_discard_frames = 0;
+   int max_queued_images = 32;
+
+   std::thread worker;
+   std::atomic<bool> running = { false };
+   std::atomic<bool> stop_requested = { false };
+
+   std::mutex queue_mutex;
+   std::condition_variable queue_cv;
+   std::deque<std::pair<ScanPoint, cv::Mat>> queue;
+   bool queue_finished = false;
+};
@@ -0,0 +1,145 @@
+#include "ScanFileSink.h"
+
+#include <QDir>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <iostream>
+
+ScanFileSink::ScanFileSink(const QString& folder, int images_per_chunk) :
+   folder(folder),
+   images_per_chunk(images_per_chunk)
+{
+}
+
+ScanFileSink::~ScanFileSink()
+{
+   EndScan();
+}
+
+void ScanFileSink::BeginScan(const ScanPlan& plan)
+{
+   QDir().mkpath(folder);
+   WriteMetadata(plan);
+
+   index_file.setFileName(QDir(folder).filePath("index.csv"));
+   if (!index_file.open(QIODevice::WriteOnly | QIODevice::Text))
+      std::cout << "Could not open scan index file in " << folder.toStdString() << "\n";
+
+   index.setDevice(&index_file);
+
+   QStringList header = { "index", "timepoint" };
+   for (auto& axis : plan.GetAxes())
+      header.append(axis.name + "_index");
+   for (auto& axis : plan.GetAxes())
+      header.append(axis.name);
+   header << "timestamp_ms" << "chunk" << "offset" << "rows" << "cols" << "cv_type";
+
+   index << header.join(",") << "\n";
+   index.flush();
+
+   chunk_idx = 0;
+   images_in_chunk = 0;
+   OpenChunk();
+}
+
+void ScanFileSink::WriteMetadata(const ScanPlan& plan)
+{
+   QJsonArray axes;
+   for (auto& axis : plan.GetAxes())
+   {
+      QJsonArray values;
+      for (double v : axis.values)
+         values.append(v);
+
+      QJsonObject a;
+      a["name"] = axis.name;
+      a["unit"] = axis.unit;
+      a["values"] = values;
+      axes.append(a);
+   }
+
+   QJsonArray order;
+   for (int i : plan.GetAxisOrder())
+      order.append(i);
+
+   QJsonObject metadata;
+   metadata["axes"] = axes;
+   metadata["axis_order"] = order;
+   metadata["n_timepoints"] = plan.GetNumTimepoints();
+   metadata["timepoint_interval_ms"] = plan.GetTimepointInterval();
+   metadata["n_images"] = plan.GetNumPoints();
+   metadata["images_per_chunk"] = images_per_chunk;
+
+   QFile file(QDir(folder).filePath("scan.json"));
+   if (file.open(QIODevice::WriteOnly))
+      file.write(QJsonDocument(metadata).toJson());
+}
+
+void ScanFileSink::OpenChunk()
+{
+   chunk_file.close();
+   chunk_file.setFileName(QDir(folder).filePath(QString("chunk_%1.raw").arg(chunk_idx, 5, 10, QChar('0'))));
+
+   if (!chunk_file.open(QIODevice::WriteOnly))
+      std::cout << "Could not open scan chunk file " << chunk_file.fileName().toStdString() << "\n";
+}
+
+void ScanFileSink::AddImage(const ScanPoint& point, const cv::Mat& image)
+{
+   if (images_in_chunk >= images_per_chunk)
+   {
+      chunk_idx++;
+      images_in_chunk = 0;
+      OpenChunk();
+   }
+
+   cv::Mat m = image.isContinuous() ? image : image.clone();
+   qint64 offset = chunk_file.pos();
+   chunk_file.write(reinterpret_cast<const char*>(m.data), m.total() * m.elemSize());
+   chunk_file.flush();
+   images_in_chunk++;
+
+   QStringList row;
+   row << QString::number(point.index) << QString::number(point.timepoint);
+   for (int i : point.indices)
+      row << QString::number(i);
+   for (double c : point.coordinates)
+      row << QString::number(c, 'g', 10);
+   row << QString::number(point.timestamp_ms) << QString::number(chunk_idx) << QString::number(offset)
+       << QString::number(m.rows) << QString::number(m.cols) << QString::number(m.type());
+
+   index << row.join(",") << "\n";
+   index.flush();
+}
+
+void ScanFileSink::EndScan()
+{
+   chunk_file.close();
+   index.flush();
+   index_file.close();
+}
+
+
+ScanThumbnailSink::ScanThumbnailSink(int max_dimension, QObject* parent) :
+   QObject(parent),
+   max_dimension(max_dimension)
+{
+   qRegisterMetaType<cv::Mat>("cv::Mat");
+}
+
+void ScanThumbnailSink::AddImage(const ScanPoint& point, const cv::Mat& image)
+{
+   if (image.empty())
+      return;
+
+   cv::Mat thumbnail;
+   double scale = (double) max_dimension / std::max(image.rows, image.cols);
+
+   if (max_dimension > 0 && scale < 1)
+      cv::resize(image, thumbnail, cv::Size(), scale, scale, cv::INTER_AREA);
+   else
+      thumbnail = image.clone();
+
+   emit NewThumbnail(thumbnail, plan.Label(point));
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "ScanEngine.h"
+
+#include <QObject>
+#include <QFile>
+#include <QTextStream>
+#include <QMetaType>
+
+Q_DECLARE_METATYPE(cv::Mat)
+
+/*
+   Streams scan images to disk as they arrive so that nothing is kept in
+   memory. The folder contains:
+      scan.json         - axes, their values and the time-lapse settings
+      index.csv         - one row per image with its axis indices,
+                          coordinates, timestamp and location on disk
+      chunk_NNNNN.raw   - raw pixel data of up to images_per_chunk images,
+                          stored back to back
+*/
+class ScanFileSink : public ScanSink
+{
+public:
+
+   ScanFileSink(const QString& folder, int images_per_chunk = 100);
+   ~ScanFileSink();
+
+   void BeginScan(const ScanPlan& plan);
+   void AddImage(const ScanPoint& point, const cv::Mat& image);
+   void EndScan();
+
+   const QString& GetFolder() { return folder; }
+
+protected:
+
+   void OpenChunk();
+   void WriteMetadata(const ScanPlan& plan);
+
+   QString folder;
+   int images_per_chunk;
+
+   int chunk_idx = 0;
+   int images_in_chunk = 0;
+   QFile chunk_file;
+
+   QFile index_file;
+   QTextStream index;
+};
+
+/*
+   Emits a downsampled copy of each scan image, or a full resolution copy
+   if max_dimension is 0. Connect NewThumbnail with a queued connection to 
+   display images in the GUI thread.
+*/
+class ScanThumbnailSink : public QObject, public ScanSink
+{
+   Q_OBJECT
+
+public:
+
+   ScanThumbnailSink(int max_dimension = 256, QObject* parent = 0);
+
+   // Don't change during a scan
+   void SetMaxDimension(int max_dimension_) { max_dimension = max_dimension_; }
+
+   void BeginScan(const ScanPlan& plan_) { plan = plan_; }
+   void AddImage(const ScanPoint& point, const cv::Mat& image);
+
+signals:
+   void NewThumbnail(cv::Mat thumbnail, QString label);
+
+protected:
+   int max_dimension;
+   ScanPlan plan;
+};
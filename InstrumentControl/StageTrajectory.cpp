@@ -0,0 +1,292 @@
+#include "StageTrajectory.h"
+
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+using namespace std::chrono;
+
+StageTrajectory::StageTrajectory(TrajectoryAxis* axis, QObject* parent) :
+   QObject(parent),
+   axis(axis)
+{
+}
+
+StageTrajectory::~StageTrajectory()
+{
+   Stop();
+}
+
+void StageTrajectory::SetMotionLimits(double max_velocity_, double acceleration_)
+{
+   max_velocity = max_velocity_;
+   acceleration = acceleration_;
+}
+
+void StageTrajectory::SetPoints(const std::vector<TrajectoryPoint>& points_)
+{
+   lock_guard<mutex> lk(points_mutex);
+   points = points_;
+}
+
+/*
+   Trapezoidal velocity profile for a move. If the move is too short to
+   reach velocity the profile is triangular with a lower peak velocity.
+*/
+StageTrajectory::Segment StageTrajectory::ComputeSegment(double start, double end, double velocity, double acceleration)
+{
+   Segment s;
+   s.start = start;
+   s.end = end;
+   s.velocity = velocity;
+   s.acceleration = acceleration;
+
+   double distance = abs(end - start);
+   s.peak_velocity = min(velocity, sqrt(distance * acceleration));
+
+   if (s.peak_velocity > 0)
+      s.duration_s = distance / s.peak_velocity + s.peak_velocity / acceleration;
+
+   return s;
+}
+
+/*
+   Time after the start of a segment at which the stage has moved distance
+*/
+double StageTrajectory::TimeToReach(const Segment& s, double distance)
+{
+   double total = abs(s.end - s.start);
+   double a = s.acceleration;
+   double vp = s.peak_velocity;
+
+   if (vp <= 0)
+      return 0;
+
+   distance = max(0.0, min(distance, total));
+
+   double t_acc = vp / a;
+   double d_acc = 0.5 * vp * t_acc;
+
+   if (distance <= d_acc)
+      return sqrt(2 * distance / a);
+   if (distance <= total - d_acc)
+      return t_acc + (distance - d_acc) / vp;
+   return s.duration_s - sqrt(2 * (total - distance) / a);
+}
+
+double StageTrajectory::GetEstimatedDuration(double start_position)
+{
+   lock_guard<mutex> lk(points_mutex);
+
+   double duration = 0;
+   double position = start_position;
+   for (auto& p : points)
+   {
+      double v = (p.velocity > 0) ? min(p.velocity, max_velocity) : max_velocity;
+      duration += ComputeSegment(position, p.position, v, acceleration).duration_s + p.dwell_ms * 1e-3;
+      position = p.position;
+   }
+   return duration;
+}
+
+std::shared_future<bool> StageTrajectory::Start()
+{
+   return Launch([this]() { return RunPoints(); });
+}
+
+std::shared_future<bool> StageTrajectory::StartContinuous(double start, double end, double velocity, const std::vector<double>& trigger_positions)
+{
+   return Launch([=]() { return RunContinuous(start, end, velocity, trigger_positions); });
+}
+
+void StageTrajectory::Stop()
+{
+   stop_requested = true;
+   if (worker.joinable())
+      worker.join();
+   stop_requested = false;
+}
+
+std::shared_future<bool> StageTrajectory::Launch(std::function<bool()> run)
+{
+   Stop();
+
+   auto promise = make_shared<std::promise<bool>>();
+   std::shared_future<bool> future = promise->get_future().share();
+
+   running = true;
+   worker = std::thread([this, run, promise]()
+   {
+      bool success = run();
+      running = false;
+      promise->set_value(success);
+      emit Finished(success);
+   });
+
+   return future;
+}
+
+/*
+   Velocity is only sent to the controller when it changes
+*/
+void StageTrajectory::ApplyVelocity(double velocity)
+{
+   if (velocity != current_velocity)
+   {
+      axis->SetVelocity(velocity);
+      current_velocity = velocity;
+   }
+}
+
+/*
+   Wait for a move to complete, allowing twice the expected duration
+   plus move_timeout_ms. Returns false on failure, timeout or Stop()
+*/
+bool StageTrajectory::WaitForMove(std::shared_future<bool> future, double expected_duration_s)
+{
+   auto deadline = steady_clock::now() + milliseconds(move_timeout_ms) + microseconds((qint64)(2e6 * expected_duration_s));
+
+   while (future.wait_for(milliseconds(20)) != future_status::ready)
+   {
+      if (stop_requested)
+         return false;
+
+      if (steady_clock::now() > deadline)
+      {
+         cout << "Trajectory move timed out\n";
+         return false;
+      }
+   }
+
+   return future.get();
+}
+
+void StageTrajectory::Arrived(int index, double position)
+{
+   qint64 timestamp_us = duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+
+   if (arrival_callback)
+      arrival_callback(index, position);
+
+   emit PointArrived(index, position, timestamp_us);
+}
+
+/*
+   Stop-and-go: each move is issued as soon as the previous one has
+   completed and its dwell time has elapsed
+*/
+bool StageTrajectory::RunPoints()
+{
+   vector<TrajectoryPoint> run_points;
+   {
+      lock_guard<mutex> lk(points_mutex);
+      run_points = points;
+   }
+
+   // Precompute all segment profiles before moving
+   vector<Segment> segments;
+   double position = axis->GetCurrentPosition();
+   for (auto& p : run_points)
+   {
+      double v = (p.velocity > 0) ? min(p.velocity, max_velocity) : max_velocity;
+      segments.push_back(ComputeSegment(position, p.position, v, acceleration));
+      position = p.position;
+   }
+
+   current_velocity = -1;
+   axis->SetAcceleration(acceleration);
+
+   for (size_t i = 0; i < run_points.size(); i++)
+   {
+      if (stop_requested)
+         return false;
+
+      ApplyVelocity(segments[i].velocity);
+
+      if (!WaitForMove(axis->MoveToPosition(run_points[i].position), segments[i].duration_s))
+         return false;
+
+      auto arrival_time = steady_clock::now();
+      Arrived((int) i, axis->GetCurrentPosition());
+
+      auto dwell_end = arrival_time + milliseconds(run_points[i].dwell_ms);
+      while (steady_clock::now() < dwell_end)
+      {
+         if (stop_requested)
+            return false;
+         this_thread::sleep_until(min(dwell_end, steady_clock::now() + milliseconds(20)));
+      }
+   }
+
+   return true;
+}
+
+/*
+   On-the-fly scan: one constant velocity move from start to end. Each
+   trigger fires at its predicted time from the motion profile or when the
+   measured position passes it, whichever comes first. The prediction is
+   re-anchored when movement is first observed to absorb the command latency.
+*/
+bool StageTrajectory::RunContinuous(double start, double end, double velocity, vector<double> trigger_positions)
+{
+   current_velocity = -1;
+   axis->SetAcceleration(acceleration);
+   ApplyVelocity(max_velocity);
+
+   Segment approach = ComputeSegment(axis->GetCurrentPosition(), start, max_velocity, acceleration);
+   if (!WaitForMove(axis->MoveToPosition(start), approach.duration_s))
+      return false;
+
+   velocity = min(velocity, max_velocity);
+   Segment scan = ComputeSegment(start, end, velocity, acceleration);
+   double direction = (end >= start) ? 1 : -1;
+
+   // Order triggers along the direction of travel, ignoring any outside the scan
+   vector<double> triggers;
+   for (double t : trigger_positions)
+      if ((t - start) * direction >= 0 && (end - t) * direction >= 0)
+         triggers.push_back(t);
+   sort(triggers.begin(), triggers.end(), [&](double a, double b) { return (a - b) * direction < 0; });
+
+   ApplyVelocity(velocity);
+
+   auto t0 = steady_clock::now();
+   std::shared_future<bool> move = axis->MoveToPosition(end);
+   bool anchored = false;
+
+   for (size_t i = 0; i < triggers.size(); i++)
+   {
+      double trigger_distance = (triggers[i] - start) * direction;
+
+      while (true)
+      {
+         if (stop_requested)
+            return false;
+
+         auto now = steady_clock::now();
+         double distance = (axis->GetCurrentPosition() - start) * direction;
+
+         if (!anchored && distance > 0)
+         {
+            auto t_anchor = now - microseconds((qint64)(1e6 * TimeToReach(scan, distance)));
+            t0 = max(t0, t_anchor);
+            anchored = true;
+         }
+
+         auto predicted = t0 + microseconds((qint64)(1e6 * TimeToReach(scan, trigger_distance)));
+
+         if (distance >= trigger_distance || now >= predicted)
+            break;
+
+         if (move.wait_for(seconds(0)) == future_status::ready && !move.get())
+            return false;
+
+         this_thread::sleep_until(min(predicted, now + milliseconds(poll_interval_ms)));
+      }
+
+      Arrived((int) i, triggers[i]);
+   }
+
+   return WaitForMove(move, scan.duration_s);
+}
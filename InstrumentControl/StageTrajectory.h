@@ -0,0 +1,145 @@
+#pragma once
+
+#include <QObject>
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+struct TrajectoryPoint
+{
+   double position = 0;
+   int dwell_ms = 0;
+   double velocity = 0; // 0 uses the trajectory's maximum velocity
+};
+
+/*
+   Minimal interface to a single stage axis used by StageTrajectory
+*/
+class TrajectoryAxis
+{
+public:
+   virtual ~TrajectoryAxis() {};
+
+   virtual std::shared_future<bool> MoveToPosition(double position) = 0;
+   virtual double GetCurrentPosition() = 0;
+   virtual void SetVelocity(double velocity) = 0;
+   virtual void SetAcceleration(double acceleration) = 0;
+};
+
+/*
+   Adapts any controller providing MoveToPosition, GetCurrentPosition,
+   SetVelocity and SetAcceleration, e.g. GenericNewportController,
+   NewportBusAxis or ThorlabsAPTController
+*/
+template<class Stage>
+class StageTrajectoryAxis : public TrajectoryAxis
+{
+public:
+   StageTrajectoryAxis(Stage* stage) : stage(stage) {}
+
+   std::shared_future<bool> MoveToPosition(double position) { return stage->MoveToPosition(position); }
+   double GetCurrentPosition() { return stage->GetCurrentPosition(); }
+   void SetVelocity(double velocity) { stage->SetVelocity(velocity); }
+   void SetAcceleration(double acceleration) { stage->SetAcceleration(acceleration); }
+
+private:
+   Stage* stage;
+};
+
+/*
+   Runs a sequence of moves on one axis from a dedicated thread so that
+   each move is issued as soon as the previous one completes, without a
+   round trip through an event loop.
+
+   Start() visits a list of points, stopping at each for its dwell time.
+   StartContinuous() moves from start to end in a single move at constant
+   velocity and fires at each trigger position on the way, e.g. to trigger
+   a camera on the fly. Trigger times are predicted from the motion profile
+   and corrected against the measured position, so their accuracy depends
+   on how often the controller reports its position.
+
+   PointArrived is emitted for each point or trigger, stamped with the
+   steady_clock time in microseconds. The arrival callback is called
+   directly on the trajectory thread for minimal latency.
+*/
+class StageTrajectory : public QObject
+{
+   Q_OBJECT
+
+public:
+
+   // Precomputed trapezoidal profile for each move
+   struct Segment
+   {
+      double start = 0;
+      double end = 0;
+      double velocity = 0;
+      double peak_velocity = 0;
+      double acceleration = 0;
+      double duration_s = 0;
+   };
+
+   typedef std::function<void(int index, double position)> ArrivalCallback;
+
+   // Takes ownership of axis
+   StageTrajectory(TrajectoryAxis* axis, QObject* parent = 0);
+   ~StageTrajectory();
+
+   template<class Stage>
+   static StageTrajectory* ForStage(Stage* stage, QObject* parent = 0)
+   {
+      return new StageTrajectory(new StageTrajectoryAxis<Stage>(stage), parent);
+   }
+
+   void SetMotionLimits(double max_velocity, double acceleration);
+   void SetMoveTimeout(int timeout_ms) { move_timeout_ms = timeout_ms; }
+   void SetPositionPollInterval(int interval_ms) { poll_interval_ms = interval_ms; }
+   void SetArrivalCallback(ArrivalCallback callback) { arrival_callback = callback; }
+
+   void SetPoints(const std::vector<TrajectoryPoint>& points);
+   double GetEstimatedDuration(double start_position);
+
+   std::shared_future<bool> Start();
+   std::shared_future<bool> StartContinuous(double start, double end, double velocity, const std::vector<double>& trigger_positions);
+   void Stop();
+   bool IsRunning() { return running; }
+
+   static Segment ComputeSegment(double start, double end, double velocity, double acceleration);
+   static double TimeToReach(const Segment& segment, double distance);
+
+signals:
+   void PointArrived(int index, double position, qint64 timestamp_us);
+   void Finished(bool success);
+
+protected:
+
+   std::shared_future<bool> Launch(std::function<bool()> run);
+   bool RunPoints();
+   bool RunContinuous(double start, double end, double velocity, std::vector<double> trigger_positions);
+   bool WaitForMove(std::shared_future<bool> future, double expected_duration_s);
+   void Arrived(int index, double position);
+   void ApplyVelocity(double velocity);
+
+   std::unique_ptr<TrajectoryAxis> axis;
+
+   std::mutex points_mutex;
+   std::vector<TrajectoryPoint> points;
+
+   double max_velocity = 1;
+   double acceleration = 1;
+   double current_velocity = -1;
+   int move_timeout_ms = 10000;
+   int poll_interval_ms = 5;
+
+   ArrivalCallback arrival_callback;
+
+   std::thread worker;
+   std::atomic<bool> running = { false };
+   std::atomic<bool> stop_requested = { false };
+};
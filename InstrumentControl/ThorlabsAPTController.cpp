@@ -1,76 +1,16 @@
 #include "ThorlabsAPTController.h"
 #include "ThorlabsAPTCommands.h"
-#include <windows.h>
-#include "FTD2XX.h"
 #include <iostream>
 #include <vector>
+#include <stdexcept>
 
 #include <QDataStream>
 
 using namespace std;
 
-void Check(unsigned long status)
-{
-   if (status != FT_OK)
-   {
-      cout << "Thorlabs APT Controller error\n";
-      throw exception("Error with Thorlabs APT Controller", status);
-   }
-}
-
-vector<FT_DEVICE_LIST_INFO_NODE> GetAPTDevices()
-{
-   DWORD n_dev;
-
-   // create the device information list
-   Check(FT_CreateDeviceInfoList(&n_dev));
-   printf("Number of devices is %d\n", n_dev);
-
-   // allocate storage for list based on numDevs
-   vector<FT_DEVICE_LIST_INFO_NODE> dev_info(n_dev);
-
-   if (n_dev > 0)
-   {
-      // get the device information list
-      Check(FT_GetDeviceInfoList(dev_info.data(), &n_dev));
-
-      for (auto& dev : dev_info)
-      {
-         printf(" Flags=0x%x\n", dev.Flags);
-         printf(" Type=0x%x\n", dev.Type);
-         printf(" ID=0x%x\n", dev.ID);
-         printf(" LocId=0x%x\n", dev.LocId);
-         printf(" SerialNumber=%s\n", dev.SerialNumber);
-         printf(" Description=%s\n", dev.Description);
-      }
-   }
-
-   return dev_info;
-}
-
-/*
-   Information on communicating using FTD2xx:
-   http://www.ftdichip.com/Support/Documents/ProgramGuides/D2XX_Programmer's_Guide(FT_000071).pdf
-*/
-
-
-
-FT_HANDLE GetAPTDeviceByType(const QString& type)
-{
-   vector<FT_DEVICE_LIST_INFO_NODE> devices = GetAPTDevices();
-
-   for (auto& dev : devices)
-   {
-      if (dev.Description == type)
-         return dev.ftHandle;
-   }
-
-   return nullptr;
-}
-
-
-ThorlabsAPTController::ThorlabsAPTController(const QString& controller_type, const QString& stage_type, QObject* parent) :
+ThorlabsAPTController::ThorlabsAPTController(const QString& controller_type, const QString& stage_type, QObject* parent, AbstractAPTTransport* transport) :
    ThreadedObject(parent),
+   transport(transport),
    controller_type(controller_type)
 {
    // Setup conversion factors based on selected stage
@@ -96,7 +36,7 @@ ThorlabsAPTController::ThorlabsAPTController(const QString& controller_type, con
          units = "mm";
       }
       else
-         throw(std::exception("Unrecognised stage type"));
+         throw(std::runtime_error("Unrecognised stage type"));
 
       position_factor = encoder_count;
       velocity_factor = encoder_count * T * 65536;
@@ -113,7 +53,7 @@ ThorlabsAPTController::ThorlabsAPTController(const QString& controller_type, con
       if (stage_type == "DDS220" || stage_type == "DDS300" || stage_type == "DDS600" || stage_type == "MLS203")
          encoder_count = 20000;
       else
-         throw(std::exception("Unrecognised stage type"));
+         throw(std::runtime_error("Unrecognised stage type"));
 
       position_factor = encoder_count;
       velocity_factor = encoder_count * T * 65536;
@@ -123,71 +63,41 @@ ThorlabsAPTController::ThorlabsAPTController(const QString& controller_type, con
    {
       // Need to add support for additional controllers here - 
       // see APT communications protocol document
-      throw(std::exception("Unrecognised Thorlabs APT controller, only DC motors currently supported"));
+      throw(std::runtime_error("Unrecognised Thorlabs APT controller, only DC motors currently supported"));
    }
 
-   StartThread();
+   // Default to ten encoder counts
+   position_tolerance = 10.0 / position_factor;
+
+   startThread();
 }
 
 ThorlabsAPTController::~ThorlabsAPTController()
 {
    connected = false;
+   EndMotion(false);
    emit Disconnected();
 
    if (reader_thread.joinable())
       reader_thread.join();
 }
 
-void ThorlabsAPTController::ConnectToDevice(int dev_index)
+void ThorlabsAPTController::ConnectToDevice()
 {
-   if (device != nullptr)
-   {
-      FT_Close(device);
-      device = nullptr;
-   }
-
-   if (event_handle != nullptr)
-   {
-      CloseHandle(event_handle);
-      event_handle = nullptr;
-   }
-   
-
-   ULONG baud_rate = 115200;
-   int purge_dwell_time = 50;
-
-   // TODO: open correct device index not just first T-Cube
-
-   GetAPTDevices();
-
-   Check(FT_OpenEx("APT TDC001 T-Cube (Rev 2)", FT_OPEN_BY_DESCRIPTION, &device)); // TODO
-
-   Check(FT_SetBaudRate(device, baud_rate));
-   Check(FT_SetDataCharacteristics(device, FT_BITS_8, FT_STOP_BITS_1, FT_PARITY_NONE));
+   if (!transport)
+      transport.reset(CreateFTDIAPTTransport("APT TDC001 T-Cube (Rev 2)")); // TODO
 
-   // Pre purge dwell 50ms.
-   QThread::msleep(purge_dwell_time);
-   Check(FT_Purge(device, FT_PURGE_RX | FT_PURGE_TX));
-   // Post purge dwell 50ms.
-   QThread::msleep(purge_dwell_time);
-
-   Check(FT_ResetDevice(device));
-   Check(FT_SetFlowControl(device, FT_FLOW_RTS_CTS, 0, 0));
-   Check(FT_SetRts(device));
-
-   // Setup signalling event
-   bool manual_reset = false;
-   bool signalled = false;
-   event_handle = CreateEvent(NULL, manual_reset, signalled, "");
-
-   Check(FT_SetEventNotification(device, FT_EVENT_RXCHAR, event_handle));
+   if (!transport)
+      throw std::runtime_error("No transport given and FTDI support not built");
 
+   transport->open();
    connected = true;
 }
 
 void ThorlabsAPTController::ConnectToRotationStage()
 {
-   ConnectToDevice(0);
+   ConnectToDevice();
+   InvalidateCache();
 
    reader_thread = std::thread(&ThorlabsAPTController::ResponseReader, this);
    QThread::msleep(100);
@@ -235,6 +145,7 @@ void ThorlabsAPTController::MonitorConnection()
    if (connected && watchdog_reset)
    {
       watchdog_reset = false;
+      CheckMotionTimeout();
       connection_timer->start(200);
    }
    else
@@ -243,11 +154,15 @@ void ThorlabsAPTController::MonitorConnection()
 
       connected = false;
       homed = false;
+      EndMotion(false);
       Disconnected();
 
       if (reader_thread.joinable())
          reader_thread.join();
 
+      if (transport)
+         transport->close();
+
       try
       {
          ConnectToRotationStage();
@@ -268,13 +183,10 @@ bool ThorlabsAPTController::WaitForStatusUpdate(int timeout_ms)
 {
    unique_lock<mutex> lk(status_mutex);
    has_status = false;
-   //status_cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [this]{ return has_status; });
-   status_cv.wait(lk, [this]{ return has_status; });
-
-   return has_status;
+   return status_cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [this]{ return has_status; });
 }
 
-void ThorlabsAPTController::Init()
+void ThorlabsAPTController::init()
 {
    connection_timer = new QTimer(this);
    connection_timer->setSingleShot(true);
@@ -321,10 +233,23 @@ void ThorlabsAPTController::SetToMinimumPosition()
    SetPosition(min_position);
 }
 
-void ThorlabsAPTController::SetPosition(double position_)
+void ThorlabsAPTController::SetPosition(double position)
+{
+   MoveToPosition(position);
+}
+
+/*
+   Start a move, the returned future becomes ready when the move completes.
+   It is false if the move failed, timed out or was interrupted.
+*/
+std::shared_future<bool> ThorlabsAPTController::MoveToPosition(double position_)
 {
    if (!connected || !homed)
-      return;
+   {
+      std::promise<bool> p;
+      p.set_value(false);
+      return p.get_future().share();
+   }
 
    if (enforce_limits)
    {
@@ -334,7 +259,19 @@ void ThorlabsAPTController::SetPosition(double position_)
          position_ = max_position;
    }
 
+   // Don't send a move if we're already there
+   double tol = position_tolerance;
+   if (!in_motion && abs(position_ - target_position) < tol && abs(cur_position - target_position) < tol)
+   {
+      std::promise<bool> p;
+      p.set_value(true);
+      return p.get_future().share();
+   }
+
    std::cout << "Setting position: " << position_ << "\n";
+
+   BeginMotion();
+   std::shared_future<bool> future = GetMotionFuture();
    target_position = position_;
 
    QByteArray data;
@@ -347,13 +284,75 @@ void ThorlabsAPTController::SetPosition(double position_)
    ds << channel << position;
 
    SendCommandWithData(MGMSG_MOT_MOVE_ABSOLUTE, data);
+
+   return future;
+}
+
+std::shared_future<bool> ThorlabsAPTController::GetMotionFuture()
+{
+   lock_guard<mutex> lk(motion_mutex);
+
+   if (!motion_future.valid())
+   {
+      std::promise<bool> p;
+      p.set_value(true);
+      return p.get_future().share();
+   }
+
+   return motion_future;
+}
+
+/*
+   Completion is signalled from the reader thread, so this can be
+   called from any thread
+*/
+bool ThorlabsAPTController::WaitForMotionComplete(int timeout_ms)
+{
+   std::shared_future<bool> future = GetMotionFuture();
+
+   if (timeout_ms >= 0 && future.wait_for(std::chrono::milliseconds(timeout_ms)) != std::future_status::ready)
+      return false;
+
+   return future.get();
 }
 
-void ThorlabsAPTController::WaitForMotionComplete()
+void ThorlabsAPTController::BeginMotion()
 {
-   while (in_motion || (abs(cur_position-target_position) > 1)) // second condition just makes sure we wait until we start moving
-   { 
-      QThread::msleep(5); 
+   EndMotion(false);
+
+   lock_guard<mutex> lk(motion_mutex);
+   motion_promise = std::promise<bool>();
+   motion_future = motion_promise.get_future().share();
+   motion_pending = true;
+   motion_start = std::chrono::steady_clock::now();
+}
+
+void ThorlabsAPTController::EndMotion(bool success)
+{
+   {
+      lock_guard<mutex> lk(motion_mutex);
+      if (!motion_pending)
+         return;
+
+      motion_pending = false;
+      motion_promise.set_value(success);
+   }
+
+   emit MotionFinished(success);
+}
+
+void ThorlabsAPTController::CheckMotionTimeout()
+{
+   bool timed_out;
+   {
+      lock_guard<mutex> lk(motion_mutex);
+      timed_out = motion_pending && (std::chrono::steady_clock::now() - motion_start) > std::chrono::milliseconds(move_timeout_ms);
+   }
+
+   if (timed_out)
+   {
+      std::cout << "Thorlabs APT move timed out\n";
+      EndMotion(false);
    }
 }
 
@@ -409,200 +408,144 @@ void ThorlabsAPTController::SendCommand(uint16_t command, char param1, char para
 {
    lock_guard<recursive_mutex> lk(send_mutex);
 
-   char src = 0x01; // host PC
-   char dest = 0x50; // USB unit
-
+   APTMessage message = APTMessage::command(command, param1, param2);
    if (more_data)
-      dest |= 0x80;
-    
-   char* cmd = reinterpret_cast<char*>(&command);
- 
-   unsigned char tx[6];
-   tx[0] = cmd[0];
-   tx[1] = cmd[1];
-   tx[2] = param1;
-   tx[3] = param2;
-   tx[4] = dest;
-   tx[5] = src;
+      message.dest |= 0x80;
 
-   DWORD bytes_written;
-   Check(FT_Write(device, reinterpret_cast<void*>(tx), 6, &bytes_written));
-
-   if (bytes_written != 6)
-      int a = 1;
+   transport->write(message.toBytes());
 }
 
 void ThorlabsAPTController::SendCommandWithData(uint16_t command, QByteArray data)
 {
    lock_guard<recursive_mutex> lk(send_mutex);
-
-   char size = data.size();
-   SendCommand(command, size, 0, true);
-
-   DWORD bytes_written;
-
-   // Get char* pointer from data - we need to strip const
-   const char* data_c_ptr = data;
-   char* data_ptr = const_cast<char*>(data_c_ptr);
-
-   Check(FT_Write(device, data_ptr, data.size(), &bytes_written));
+   transport->write(APTMessage::commandWithData(command, data).toBytes());
 }
 
-QByteArray ThorlabsAPTController::ReadBytes(unsigned int n_bytes, int timeout_ms)
+/*
+   Runs on reader_thread. The transport blocks until data arrives, so
+   messages are handled as soon as they are complete.
+*/
+void ThorlabsAPTController::ResponseReader()
 {
-   DWORD EventDWord;
-   DWORD n_rx_bytes = 0, n_tx_bytes = 0;
-
-   // Sometime later, block the application thread by waiting on the event, then when the event has
-   // occurred, determine the condition that caused the event, and process it accordingly.
-   //DWORD s = WaitForSingleObject(event_handle, timeout_ms);
-
-   FT_GetStatus(device, &n_rx_bytes, &n_tx_bytes, &EventDWord);
+   APTMessageParser parser;
+   APTMessage message;
 
-   int attempts = timeout_ms / 5;
-   while (n_rx_bytes < n_bytes && attempts-- > 0)
-   {
-      FT_GetStatus(device, &n_rx_bytes, &n_tx_bytes, &EventDWord);
-      QThread::msleep(5);
-   }
-
-   if (n_rx_bytes >= n_bytes)
+   while (connected)
    {
-      QByteArray data(n_bytes, Qt::Uninitialized);
-
-      DWORD bytes_read;
-      FT_Read(device, data.data(), n_bytes, &bytes_read);
-      data.truncate(bytes_read);
+      parser.append(transport->read(read_timeout_ms));
 
-      return data;
+      while (parser.next(message))
+         ProcessMessage(message);
    }
-
-   return QByteArray();
 }
 
-void ThorlabsAPTController::ResponseReader()
+void ThorlabsAPTController::ProcessMessage(const APTMessage& message)
 {
-   while (connected)
+   if (message.hasData()) // Messages with data packets
    {
-      QByteArray header = ReadBytes(6);
+      QDataStream ds(message.data);
+      ds.setByteOrder(QDataStream::LittleEndian);
 
-      if (header.size() == 6)
+      quint16 channel;
+      int a;
+      switch (message.id)
       {
-         QDataStream ds(&header, QIODevice::ReadOnly);
-         ds.setByteOrder(QDataStream::LittleEndian);
-
-         quint16 response;
-         quint8 param1, param2, dest, src;
-         ds >> response >> param1 >> param2 >> dest >> src;
-
-         if (dest & 0x80) // Messages with data packets
-         {
-            QByteArray data = ReadBytes(param1);
-
-            if (data.size() == param1)
-            {
-
-               QDataStream ds(&data, QIODevice::ReadOnly);
-               ds.setByteOrder(QDataStream::LittleEndian);
-
-               quint16 channel;
-               int a;
-               switch (response)
-               {
-               case MGMSG_HW_RICHRESPONSE:
-                  a = 1;
-                  // TODO: ERROR OCCURRED
-
-               case MGMSG_HW_GET_INFO:
-                  ProcessHardwareInformationMessage(ds);
-                  break;
-
-               case MGMSG_MOT_GET_POSCOUNTER:
-                  qint32 position;
-                  ds >> channel >> position;
-                  break;
-
-               case MGMSG_MOT_GET_ENCCOUNTER:
-                  qint32 encoder;
-                  ds >> channel >> encoder;
-                  break;
-
-               case MGMSG_MOT_GET_VELPARAMS:
-                  ProcessVelocityParamsMessage(ds);
-                  break;
-
-                  // all these messages are followed by status message
-               case MGMSG_MOT_MOVE_COMPLETED:
-               case MGMSG_MOT_MOVE_STOPPED:
-                  emit MoveFinished();
-               case MGMSG_MOT_GET_DCSTATUSUPDATE:
-                  ProcessStatusMessage(ds);
-                  break;
-
-               case MGMSG_MOT_GET_STATUSBITS:
-                  ProcessStatusMessage(ds, true);
-                  break;
-
-               case MGMSG_MOT_GET_POTPARAMS:
-
-                  quint16 channel, wnd[4];
-                  qint32 vel[4];
-
-                  ds >> channel >> wnd[0] >> vel[0]
-                     >> wnd[1] >> vel[1]
-                     >> wnd[2] >> vel[2]
-                     >> wnd[3] >> vel[3];
-
-
-                  break;
-
-               case MGMSG_MOT_GET_HOMEPARAMS:
-                  ProcessHomeParamsMessage(ds);
-                  break;
-                     
-                     // The following messages are currently ignored
-               case MGMSG_HUB_GET_BAYUSED:
-               case MGMSG_MOT_GET_JOGPARAMS:
-               case MGMSG_MOT_GET_GENMOVEPARAMS:
-               case MGMSG_MOT_GET_MOVERELPARAMS:
-               case MGMSG_MOT_GET_MOVEABSPARAMS:
-               case MGMSG_MOT_GET_LIMSWITCHPARAMS:
-               case MGMSG_MOT_GET_DCPIDPARAMS:
-               case MGMSG_MOT_GET_AVMODES:
-               case MGMSG_MOT_GET_BUTTONPARAMS:
-                  break;
-
-               }
-            }
-         }
-         else // Header only messages
-         {
-            int a;
-            switch (response)
-            {
-            case MGMSG_MOT_MOVE_HOMED:
-               std::cout << "   Homing complete.\n";
-               homed = true;
-               emit Operational();
-               break;
-
-            case MGMSG_HW_DISCONNECT:
-               connected = false;
-               emit Disconnected();
-               break;
-
-            case MGMSG_HW_RESPONSE:
-               a = 1;
-               // TODO: ERROR OCURRED
-               break;
-
-               // The following messages are currently ignored
-            case MGMSG_MOD_GET_CHANENABLESTATE:
-               break;
-            }
-         }
-
-      } 
+      case MGMSG_HW_RICHRESPONSE:
+         a = 1;
+         // TODO: ERROR OCCURRED
+
+      case MGMSG_HW_GET_INFO:
+         ProcessHardwareInformationMessage(ds);
+         break;
+
+      case MGMSG_MOT_GET_POSCOUNTER:
+         qint32 position;
+         ds >> channel >> position;
+         break;
+
+      case MGMSG_MOT_GET_ENCCOUNTER:
+         qint32 encoder;
+         ds >> channel >> encoder;
+         break;
+
+      case MGMSG_MOT_GET_VELPARAMS:
+         ProcessVelocityParamsMessage(ds);
+         break;
+
+         // these messages are followed by status message
+      case MGMSG_MOT_MOVE_COMPLETED:
+         ProcessStatusMessage(ds);
+         EndMotion(!motion_error);
+         break;
+
+      case MGMSG_MOT_MOVE_STOPPED:
+         ProcessStatusMessage(ds);
+         EndMotion(false);
+         break;
+
+      case MGMSG_MOT_GET_DCSTATUSUPDATE:
+         ProcessStatusMessage(ds);
+         break;
+
+      case MGMSG_MOT_GET_STATUSBITS:
+         ProcessStatusMessage(ds, true);
+         break;
+
+      case MGMSG_MOT_GET_POTPARAMS:
+
+         quint16 wnd[4];
+         qint32 vel[4];
+
+         ds >> channel >> wnd[0] >> vel[0]
+            >> wnd[1] >> vel[1]
+            >> wnd[2] >> vel[2]
+            >> wnd[3] >> vel[3];
+
+
+         break;
+
+      case MGMSG_MOT_GET_HOMEPARAMS:
+         ProcessHomeParamsMessage(ds);
+         break;
+            
+            // The following messages are currently ignored
+      case MGMSG_HUB_GET_BAYUSED:
+      case MGMSG_MOT_GET_JOGPARAMS:
+      case MGMSG_MOT_GET_GENMOVEPARAMS:
+      case MGMSG_MOT_GET_MOVERELPARAMS:
+      case MGMSG_MOT_GET_MOVEABSPARAMS:
+      case MGMSG_MOT_GET_LIMSWITCHPARAMS:
+      case MGMSG_MOT_GET_DCPIDPARAMS:
+      case MGMSG_MOT_GET_AVMODES:
+      case MGMSG_MOT_GET_BUTTONPARAMS:
+         break;
+
+      }
+   }
+   else // Header only messages
+   {
+      switch (message.id)
+      {
+      case MGMSG_MOT_MOVE_HOMED:
+         std::cout << "   Homing complete.\n";
+         homed = true;
+         emit Operational();
+         break;
+
+      case MGMSG_HW_DISCONNECT:
+         connected = false;
+         emit Disconnected();
+         break;
+
+      case MGMSG_HW_RESPONSE:
+         // TODO: ERROR OCURRED
+         InvalidateCache();
+         break;
+
+         // The following messages are currently ignored
+      case MGMSG_MOD_GET_CHANENABLESTATE:
+         break;
+      }
    }
 }
 
@@ -637,9 +580,7 @@ void ThorlabsAPTController::ProcessStatusMessage(QDataStream& ds, bool short_ver
    homed = status & 0x400;
    bool in_motion_ = status & (0x10 | 0x20 | 0x40 | 0x80 | 0x200);
 
-   if (in_motion & !in_motion_) // just stopped moving
-      emit MoveFinished();
-
+   bool stopped = in_motion & !in_motion_;
    in_motion = in_motion_;
 
    bool forward_hw_limit = status & 0x1;
@@ -654,6 +595,12 @@ void ThorlabsAPTController::ProcessStatusMessage(QDataStream& ds, bool short_ver
    if (motion_error)
       std::cout << "Thorlabs APT Motion Error!\n";
 
+   // In case end of move messages are missed
+   if (motion_error)
+      EndMotion(false);
+   else if (stopped && abs(cur_position - target_position) <= position_tolerance)
+      EndMotion(true);
+
    SendCommand(MGMSG_MOT_ACK_DCSTATUSUPDATE);
 
    if (enforce_limits & homed & !in_motion)
@@ -691,16 +638,122 @@ void ThorlabsAPTController::ProcessHardwareInformationMessage(QDataStream& ds)
 
    QString model(model_no);
    if (model != controller_type)
-      throw(std::exception("APT controller is not the type expected"));
+      throw(std::runtime_error("APT controller is not the type expected"));
 }
 
 void ThorlabsAPTController::ProcessVelocityParamsMessage(QDataStream& ds)
 {
+   quint16 channel;
    qint32 start_velocity_, acceleration_, max_velocity_;
-   ds >> start_velocity_ >> acceleration_ >> max_velocity_;
+   ds >> channel >> start_velocity_ >> acceleration_ >> max_velocity_;
 
+   lock_guard<mutex> lk(cache_mutex);
    acceleration = acceleration_ / acceleration_factor;
    max_velocity = max_velocity_ / velocity_factor;
+   velocity_params_valid = true;
+   velocity_params_time = std::chrono::steady_clock::now();
+   velocity_params_cv.notify_all();
+}
+
+/*
+   Write-through velocity parameters - nothing is sent if they haven't changed
+*/
+void ThorlabsAPTController::SetVelocityParameters(double max_velocity_, double acceleration_)
+{
+   {
+      lock_guard<mutex> lk(cache_mutex);
+      if (velocity_params_valid && max_velocity_ == max_velocity && acceleration_ == acceleration)
+         return;
+
+      max_velocity = max_velocity_;
+      acceleration = acceleration_;
+      velocity_params_valid = true;
+      velocity_params_time = std::chrono::steady_clock::now();
+   }
+
+   QByteArray data;
+   QDataStream ds(&data, QIODevice::WriteOnly);
+   ds.setByteOrder(QDataStream::LittleEndian);
+
+   quint16 channel = 1;
+   qint32 min_velocity = 0;
+   qint32 acc = acceleration_ * acceleration_factor;
+   qint32 max_vel = max_velocity_ * velocity_factor;
+
+   ds << channel << min_velocity << acc << max_vel;
+
+   SendCommandWithData(MGMSG_MOT_SET_VELPARAMS, data);
+}
+
+/*
+   Get both velocity parameters, asking the controller and waiting for the
+   reply if they haven't been read or written yet. Returns false if they
+   are still unknown after timeout_ms.
+*/
+bool ThorlabsAPTController::ReadVelocityParameters(double& max_velocity_, double& acceleration_, int timeout_ms)
+{
+   unique_lock<mutex> lk(cache_mutex);
+
+   if (!velocity_params_valid && connected)
+   {
+      SendCommand(MGMSG_MOT_REQ_VELPARAMS, 1);
+      velocity_params_cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [this] { return velocity_params_valid; });
+   }
+
+   max_velocity_ = max_velocity;
+   acceleration_ = acceleration;
+   return velocity_params_valid;
+}
+
+/*
+   Velocity and acceleration are always written together, so the other
+   value must be known first; nothing is sent if it can't be read
+*/
+void ThorlabsAPTController::SetVelocity(double velocity)
+{
+   double max_velocity_, acceleration_;
+   if (!ReadVelocityParameters(max_velocity_, acceleration_))
+   {
+      std::cout << "Could not set velocity: velocity parameters unknown\n";
+      return;
+   }
+   SetVelocityParameters(velocity, acceleration_);
+}
+
+void ThorlabsAPTController::SetAcceleration(double acceleration)
+{
+   double max_velocity_, acceleration_;
+   if (!ReadVelocityParameters(max_velocity_, acceleration_))
+   {
+      std::cout << "Could not set acceleration: velocity parameters unknown\n";
+      return;
+   }
+   SetVelocityParameters(max_velocity_, acceleration);
+}
+
+double ThorlabsAPTController::GetMaxVelocity()
+{
+   lock_guard<mutex> lk(cache_mutex);
+   
+   auto age = std::chrono::steady_clock::now() - velocity_params_time;
+   if (connected && (!velocity_params_valid || age > std::chrono::milliseconds(parameter_cache_age_ms)))
+      SendCommand(MGMSG_MOT_REQ_VELPARAMS, 1); // refresh in background
+
+   return max_velocity;
+}
+
+double ThorlabsAPTController::GetAcceleration()
+{
+   GetMaxVelocity(); // refreshes cache if required
+
+   lock_guard<mutex> lk(cache_mutex);
+   return acceleration;
+}
+
+void ThorlabsAPTController::InvalidateCache()
+{
+   lock_guard<mutex> lk(cache_mutex);
+   velocity_params_valid = false;
 }
 
 void ThorlabsAPTController::ProcessHomeParamsMessage(QDataStream& ds)
@@ -4,10 +4,15 @@
 #include <QByteArray>
 #include <QTimer>
 #include "ThreadedObject.h"
+#include "APTTransport.h"
 
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <future>
 
 class ThorlabsAPTController : public ThreadedObject
 {
@@ -17,15 +22,24 @@ class ThorlabsAPTController : public ThreadedObject
 
 public:
 
-   ThorlabsAPTController(const QString& controller_type, const QString& stage_type, QObject* parent = 0);
+   // If transport is null the controller is opened over FTDI, if built; takes ownership of transport
+   ThorlabsAPTController(const QString& controller_type, const QString& stage_type, QObject* parent = 0, AbstractAPTTransport* transport = nullptr);
    ~ThorlabsAPTController();
 
    void SetPosition(double position);
+   std::shared_future<bool> MoveToPosition(double position);
+   std::shared_future<bool> GetMotionFuture();
    void SetToMinimumPosition();
    double GetPosition() { return cur_position; };
+   double GetCurrentPosition() { return cur_position; };
 
-   // blocks -> only call this from another thread
-   void WaitForMotionComplete();
+   // Returns false if the move failed or timeout_ms elapsed first (-1 waits indefinitely)
+   bool WaitForMotionComplete(int timeout_ms = -1);
+
+   void SetPositionTolerance(double tolerance) { position_tolerance = tolerance; }
+   double GetPositionTolerance() { return position_tolerance; }
+
+   void SetMoveTimeout(int timeout_ms) { move_timeout_ms = timeout_ms; }
 
    const QString& GetUnits() { return units; }
 
@@ -39,17 +53,24 @@ public:
    double GetMinPosition() { return min_position; }
 
    void SetAllowManualControl(bool allow_manual_control);
+
+   void SetVelocityParameters(double max_velocity, double acceleration);
+   double GetMaxVelocity();
+   double GetAcceleration();
+   void SetVelocity(double velocity);
+   void SetAcceleration(double acceleration);
+   void InvalidateCache();
    void SetEnforceLimits(bool enforce_limits_);
 
 
-   void Init();
+   void init();
 
 signals:
 
    void Operational(); // connected and homed
    void Disconnected();
    void PositionChanged(double position);
-   void MoveFinished();
+   void MotionFinished(bool success);
    void MaxPositionChanged(double max_position);
    void MinPositionChanged(double min_position);
 
@@ -57,15 +78,19 @@ protected:
 
    void ConnectToRotationStage();
 
-   void ConnectToDevice(int dev_index);
+   void ConnectToDevice();
    void MonitorConnection();
    
    void SendCommand(uint16_t command, char param1 = 0, char param2 = 0, bool more_data = false);
    void SendCommandWithData(uint16_t command, QByteArray data);
-   QByteArray ReadBytes(unsigned int n_bytes, int timeout_ms = 500);
    void ResponseReader();
+   void ProcessMessage(const APTMessage& message);
    bool WaitForStatusUpdate(int timeout_ms);
 
+   void BeginMotion();
+   void EndMotion(bool success);
+   void CheckMotionTimeout();
+
    void EnablePotSwitch(bool enabled);
    void EnableJogButtons(bool enabled);
 
@@ -73,10 +98,11 @@ protected:
    void ProcessStatusMessage(QDataStream& data, bool short_version = false);
    void ProcessVelocityParamsMessage(QDataStream& data);
    void ProcessHomeParamsMessage(QDataStream& data);
+   bool ReadVelocityParameters(double& max_velocity, double& acceleration, int timeout_ms = 1000);
    
    QTimer* connection_timer;
-   void* device = nullptr;
-   void* event_handle = nullptr;
+   std::unique_ptr<AbstractAPTTransport> transport;
+   int read_timeout_ms = 100;
 
    std::thread reader_thread;
    std::mutex status_mutex;
@@ -89,18 +115,37 @@ protected:
    QString units;
    QString controller_type;
 
-   double target_position = 0;
-   double cur_position = 0;
-   double cur_velocity = 0;
+   // Written by reader_thread
+   std::atomic<double> target_position = { 0 };
+   std::atomic<double> cur_position = { 0 };
+   std::atomic<double> cur_velocity = { 0 };
+
+   // Moves complete on MGMSG_MOT_MOVE_COMPLETED, or when the stage stops
+   // within position_tolerance (stage units) of the target
+   std::mutex motion_mutex;
+   std::promise<bool> motion_promise;
+   std::shared_future<bool> motion_future;
+   bool motion_pending = false;
+   std::chrono::steady_clock::time_point motion_start;
+   double position_tolerance;
+   int move_timeout_ms = 30000;
+
+   // Velocity parameters are cached from VELPARAMS messages and writes, 
+   // and refreshed in the background once older than parameter_cache_age_ms
+   std::mutex cache_mutex;
    double max_velocity = 0;
    double acceleration = 0;
-
-   bool connected = false;
-   bool homed = false;
-   bool in_motion = false;
-   bool motion_error = false;
+   bool velocity_params_valid = false;
+   std::condition_variable velocity_params_cv;
+   std::chrono::steady_clock::time_point velocity_params_time;
+   int parameter_cache_age_ms = 60000;
+
+   std::atomic<bool> connected = { false };
+   std::atomic<bool> homed = { false };
+   std::atomic<bool> in_motion = { false };
+   std::atomic<bool> motion_error = { false };
    bool has_status = false;
-   bool watchdog_reset = false;
+   std::atomic<bool> watchdog_reset = { false };
 
    double min_position = 0;
    double max_position = 360;
@@ -1,6 +1,7 @@
 #include <QFileDialog>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <cmath>
 
 #include "ImageRenderWidget.h"
 
@@ -242,12 +243,14 @@ void ImageRenderWidget::SetImage(cv::Mat& im)
    if (cv_image.empty())
    {
       cv_image.push_back(cv::Mat(1, 1, CV_8U, cvScalar(0)));
+      image_means.push_back(NAN);
       image_labels.push_back("");
       cur_index = 0;
    }
 
    // Get the latest image from the source
    cv_image[cur_index] = im;
+   image_means[cur_index] = NAN;
 
    Redraw();
 }
@@ -255,6 +258,7 @@ void ImageRenderWidget::SetImage(cv::Mat& im)
 void ImageRenderWidget::ClearImages()
 {
    cv_image.clear();
+   image_means.clear();
    cur_index = 0;
    ImageIndexChanged(0);
    MaxImageIndexChanged(0);
@@ -268,6 +272,7 @@ void ImageRenderWidget::AddImage(cv::Mat image, QString label)
    // Append label first since counts are based on cv_image size
    image_labels.push_back(label);
    cv_image.push_back(image);
+   image_means.push_back(NAN);
 
    int sz = static_cast<int>(cv_image.size()) - 1;
    emit MaxImageIndexChanged(sz);
@@ -373,14 +378,17 @@ void ImageRenderWidget::paintEvent(QPaintEvent *event)
          v = im.at<float>(selected_pos.y(), selected_pos.x());
    }
 
-   double meanv = 0;
-   if (image_size.area() > 0)
-      meanv = cv::mean(im)[0];
-
-
    if (!im_label.isEmpty())
       im_label.append(". ");
-   QString label = QString("%1Point (%2, %3) : %4,  Average : %5").arg(im_label).arg(selected_pos.x()).arg(selected_pos.y()).arg(v).arg(meanv);
+   QString label = QString("%1Point (%2, %3) : %4").arg(im_label).arg(selected_pos.x()).arg(selected_pos.y()).arg(v);
+
+   // Only computed when the image changes, not on every paint
+   double& meanv = image_means[cur_index];
+   if (std::isnan(meanv))
+      meanv = (image_size.area() > 0) ? cv::mean(im)[0] : 0;
+
+   label.append(QString(",  Average : %1").arg(meanv));
+
    emit LabelChanged(label);
 
 }
@@ -101,6 +101,7 @@ private:
    std::vector<QPoint> overlay_points;
 
    std::vector<cv::Mat> cv_image;
+   std::vector<double> image_means; // NaN until the image is first shown
    QStringList image_labels;
 
    QSize sz;
@@ -2,11 +2,31 @@
 
 #include <QObject>
 #include <ImageSource.h>
+#include <ScanEngine.h>
+#include <ScanFileSink.h>
 #include <thread>
 #include <functional>
+#include <future>
+#include <atomic>
+#include <memory>
+#include <iostream>
+#include <QDir>
+#include <QDateTime>
 
 #include "ImageRenderWindow.h"
 
+/*
+   Scans a single value between scan_start and scan_end, acquiring an
+   image at each step. Additional axes (further stages, Arduino or camera
+   parameters) and time-lapse can be added with AddAxis and SetTimeLapse;
+   the scan is run by a ScanEngine.
+
+   If an output folder is set, images are streamed to disk by a ScanFileSink
+   as they are acquired and the render window only receives thumbnails.
+   Otherwise the render window keeps the full resolution images, which is
+   the only copy of the scan. Images are delivered to the GUI thread by a 
+   queued connection.
+*/
 class ImageSeriesScanner : public QObject
 {
    Q_OBJECT
@@ -17,6 +37,15 @@ public:
       QObject(parent),
       image_sources(image_sources)
    {
+      engine = new ScanEngine(this);
+      connect(engine, &ScanEngine::ProgressChanged, this, &ImageSeriesScanner::ProgressChanged);
+
+      thumbnail_sink = new ScanThumbnailSink(thumbnail_size, this);
+   }
+
+   ~ImageSeriesScanner()
+   {
+      SetScanning(false);
    }
 
    template<class T>
@@ -24,11 +53,51 @@ public:
    {
       SetPosition = std::bind(setter_, position_controller, std::placeholders::_1);
       GetPosition = std::bind(getter_, position_controller);
+      MoveToPosition = nullptr;
+
+      value_name = value_name_;
+      unit = unit_;
+   }
+
+   /*
+      Use a controller which reports when motion is complete, e.g.
+      GenericNewportController::MoveToPosition, so that we only wait for the
+      settle time after each move rather than a fixed delay
+   */
+   template<class T>
+   void SetPositionController(T* position_controller, std::shared_future<bool>(T::*mover_)(double), double (T::*getter_)(), const QString& value_name_ = "P", const QString unit_ = "")
+   {
+      MoveToPosition = std::bind(mover_, position_controller, std::placeholders::_1);
+      SetPosition = [this](double position) { MoveToPosition(position); };
+      GetPosition = std::bind(getter_, position_controller);
 
       value_name = value_name_;
       unit = unit_;
    }
 
+   // Additional axes, scanned together with the position axis
+   void AddAxis(const ScanAxis& axis) { extra_axes.push_back(axis); }
+   void ClearAxes() { extra_axes.clear(); }
+
+   void SetTimeLapse(int n_timepoints_, int interval_ms_) { n_timepoints = n_timepoints_; timepoint_interval_ms = interval_ms_; }
+
+   // Time to wait after motion completes before acquiring
+   void SetSettleTime(int settle_time_ms_) { settle_time_ms = settle_time_ms_; }
+   int GetSettleTime() { return settle_time_ms; }
+
+   // Fixed wait after each step if the controller doesn't report motion completion
+   void SetFixedWaitTime(int fixed_wait_ms_) { fixed_wait_ms = fixed_wait_ms_; }
+   int GetFixedWaitTime() { return fixed_wait_ms; }
+
+   void SetStabilityThreshold(double threshold, int max_frames = 10) { engine->SetStabilityThreshold(threshold, max_frames); }
+   void SetDiscardFrames(int n_discard_frames) { engine->SetDiscardFrames(n_discard_frames); }
+
+   // Each scan is written to a new subfolder; if empty images are only displayed
+   void SetOutputFolder(const QString& output_folder_) { output_folder = output_folder_; }
+   const QString& GetOutputFolder() { return output_folder; }
+
+   void SetImagesPerChunk(int images_per_chunk_) { images_per_chunk = images_per_chunk_; }
+
    void SetScanStart(double scan_start_) { scan_start = scan_start_; }
    double GetScanStart() { return scan_start; }
 
@@ -50,9 +119,39 @@ public:
 
    unsigned int GetImageSourceIndex() { return image_source_index; }
 
+   ScanPlan BuildPlan()
+   {
+      ScanAxis axis;
+      axis.name = value_name;
+      axis.unit = unit;
+      axis.values = ScanAxis::LinearValues(scan_start, scan_end, n_steps);
+      axis.snake = false;
+
+      if (MoveToPosition)
+      {
+         axis.move = MoveToPosition;
+         axis.settle_time_ms = settle_time_ms;
+      }
+      else
+      {
+         axis.SetSetter(SetPosition);
+         axis.settle_time_ms = fixed_wait_ms;
+      }
+
+      ScanPlan plan;
+      plan.AddAxis(axis);
+      for (auto& a : extra_axes)
+         plan.AddAxis(a);
+      plan.SetTimeLapse(n_timepoints, timepoint_interval_ms);
+
+      return plan;
+   }
 
    void SetScanning(bool scanning_)
    {
+      if (scanning_ && worker.joinable() && !engine->IsRunning())
+         worker.join(); // previous scan has finished
+
       if (scanning_ && !worker.joinable())
       {
          // Create a new window for display
@@ -64,43 +163,41 @@ public:
          window->show();
          emit NewRenderWindow(window);
 
-         terminate = false;
-         worker = std::thread(&ImageSeriesScanner::Scan, this, render_widget);
+         disconnect(thumbnail_sink, &ScanThumbnailSink::NewThumbnail, nullptr, nullptr);
+         connect(thumbnail_sink, &ScanThumbnailSink::NewThumbnail, render_widget, &ImageRenderWidget::AddImage, Qt::QueuedConnection);
+
+         engine->SetPlan(BuildPlan());
+         engine->SetImageSource(image_sources[image_source_index]);
+         engine->ClearSinks();
+         engine->AddSink(thumbnail_sink);
+
+         // Without a file sink the window holds the only copy, so don't downsample
+         thumbnail_sink->SetMaxDimension(output_folder.isEmpty() ? 0 : thumbnail_size);
+
+         file_sink.reset();
+         if (!output_folder.isEmpty())
+         {
+            QString scan_folder = QString("%1 scan %2").arg(value_name).arg(QDateTime::currentDateTime().toString("yyyy-MM-dd hh-mm-ss"));
+            file_sink.reset(new ScanFileSink(QDir(output_folder).filePath(scan_folder), images_per_chunk));
+            engine->AddSink(file_sink.get());
+         }
+
+         engine->ClearStop();
+         worker = std::thread(&ImageSeriesScanner::Scan, this);
       }
 
       if (!scanning_ && worker.joinable())
       {
-         terminate = true;
+         engine->Stop();
          worker.join();
       }
    }
 
-   void Scan(ImageRenderWidget* render_widget)
+   void Scan()
    {
-      double start = scan_start;
-      double end = scan_end;
-      double n = n_steps;
-      double step = (end - start) / (n - 1);
-
-      for (int i = 0; i < n; i++)
-      {
-
-         float position = start + i*step;
-         SetPosition(position);
-         QThread::msleep(500);
-         // slm->WaitForNextUpdate(); // TODO
-
-         cv::Mat m = image_sources[image_source_index]->getNextImage();
-         render_widget->AddImage(m, QString("%1=%2%3").arg(value_name).arg(position, 0, 'f', 3).arg(unit));
-
-         emit ProgressChanged((100 * (i + 1)) / n);
-
-         if (terminate)
-            break;
-      }
-
+      if (!engine->Run())
+         std::cout << value_name.toStdString() << " scan did not complete\n";
       emit ScanningChanged(false);
-
    }
 
 signals:
@@ -119,12 +216,24 @@ private:
    unsigned int image_source_index = 0;
    std::vector<ImageSource*> image_sources;
 
+   ScanEngine* engine;
+   ScanThumbnailSink* thumbnail_sink;
+   std::unique_ptr<ScanFileSink> file_sink;
+   int thumbnail_size = 256;
+   QString output_folder;
+   int images_per_chunk = 100;
+   std::vector<ScanAxis> extra_axes;
    std::thread worker;
-   bool terminate = true;
+
+   int n_timepoints = 1;
+   int timepoint_interval_ms = 0;
+   int settle_time_ms = 0;
+   int fixed_wait_ms = 500;
 
    QString value_name = "P";
    QString unit = "";
 
    std::function<void(double)> SetPosition;
    std::function<double(void)> GetPosition;
-};
\ No newline at end of file
+   std::function<std::shared_future<bool>(double)> MoveToPosition;
+};
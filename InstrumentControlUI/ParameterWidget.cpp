@@ -8,12 +8,11 @@
 #include <QComboBox>
 #include <QTimer>
 #include <QPushButton>
-#include <QMutexLocker>
 
 #include <iostream>
 #include <cstdint>
 
-ParameterWidget::ParameterWidget(ParametricImageSource* camera, QFormLayout* parent, const QString& control, ParameterType type, const QString& suffix, bool use_timer, bool auto_init) :
+ParameterWidget::ParameterWidget(ParametricImageSource* camera, QFormLayout* parent, const QString& control, ParameterType type, const QString& suffix, bool poll, bool auto_init) :
 QObject(parent),
 control(control),
 type(type),
@@ -21,8 +20,8 @@ layout(parent),
 min_btn(nullptr),
 max_btn(nullptr),
 camera(camera),
-use_timer(use_timer),
-mutex(camera->control_mutex)
+parameter(camera->getParameterHandle(control, type)),
+poll(poll)
 {
    // Timer to delay setting of value after entry (for typing)
    value_timer = new QTimer();
@@ -34,13 +33,17 @@ mutex(camera->control_mutex)
       init();
 }
 
+ParameterWidget::~ParameterWidget()
+{
+   if (is_watching)
+      camera->unwatchParameter(parameter, poll);
+}
+
 /*
    Subclass contructor should call this after appropriate checks
 */
 void ParameterWidget::init()
 {
-   timer = new QTimer(this);
-
    createWidget();
    setWidgetValue();
 
@@ -54,31 +57,33 @@ void ParameterWidget::init()
       sendValueToCamera();
    }
 
-   if (use_timer)
-   {
-      connect(timer, &QTimer::timeout, this, &ParameterWidget::setWidgetValue);
-      timer->start(500);
-   }
+   connect(camera, &ParametricImageSource::parametersChanged, this, &ParameterWidget::parametersChanged, Qt::QueuedConnection);
+   camera->watchParameter(parameter, poll);
+   is_watching = true;
 
    connect(camera, &ParametricImageSource::controlLockUpdated, this, &ParameterWidget::setControlLock, Qt::QueuedConnection);
 };
 
-
-bool ParameterWidget::event(QEvent *event)
+/*
+   Called on the GUI thread with a batch of changed parameters
+*/
+void ParameterWidget::parametersChanged(const ParameterChanges& changes)
 {
-   switch (event->type()) {
-   case WidgetEvent::ValueUpdated:
-      setWidgetValue();
-      return true;
-   default:
-      return QObject::event(event);
-   }
+   auto it = changes.constFind(parameter.id());
+   if (it == changes.constEnd())
+      return;
+
+   // Don't overwrite a value the user is still entering
+   if (value_timer->isActive())
+      return;
+
+   applyState(it.value());
 }
 
 
 void ParameterWidget::setControlLock(bool locked)
 {
-   bool enabled = (!locked) && camera->isParameterWritable(control);
+   bool enabled = (!locked) && parameter.isWritable();
    obj->setEnabled(enabled);
 
    if (min_btn != nullptr)
@@ -89,10 +94,8 @@ void ParameterWidget::setControlLock(bool locked)
 
 bool ParameterWidget::createWidget()
 {
-   QMutexLocker lk(mutex);
-
    // TODO: do we need to expose read only?
-   bool is_read_only = camera->isParameterReadOnly(control);
+   bool is_read_only = parameter.isReadOnly();
 
    if (type == Integer)
    {
@@ -101,13 +104,13 @@ bool ParameterWidget::createWidget()
          spinbox->setSuffix(suffix);
       obj = spinbox;
 
-      QVariant min_step = camera->getParameterMinIncrement(control, type);
+      QVariant min_step = parameter.minIncrement();
       if (min_step.isValid())
          spinbox->setSingleStep(min_step.toInt());
 
-      int mn = camera->getParameterLimit(control, type, Min).toInt();
+      int mn = parameter.limit(Min).toInt();
       spinbox->setMinimum(mn);
-      int mx = camera->getParameterLimit(control, type, Max).toInt();
+      int mx = parameter.limit(Max).toInt();
       spinbox->setMinimum(mx);
 
       connect(spinbox, static_cast<void (QSpinBox::*)(int)>(&QSpinBox::valueChanged),
@@ -120,9 +123,9 @@ bool ParameterWidget::createWidget()
          spinbox->setSuffix(suffix);
       obj = spinbox;
 
-      int mn = camera->getParameterLimit(control, type, Min).toDouble();
+      int mn = parameter.limit(Min).toDouble();
       spinbox->setMinimum(mn);
-      int mx = camera->getParameterLimit(control, type, Max).toDouble();
+      int mx = parameter.limit(Max).toDouble();
       spinbox->setMinimum(mx);
 
       connect(spinbox, static_cast<void (QDoubleSpinBox::*)(double)>(&QDoubleSpinBox::valueChanged),
@@ -186,18 +189,33 @@ void ParameterWidget::setWidgetValue()
    if (obj == NULL)
       return;
 
-   QMutexLocker lk(mutex);
+   ParameterState state;
+   state.value = parameter.get();
+   state.is_writable = parameter.isWritable();
+   if (type == Integer || type == Float)
+   {
+      state.min = parameter.limit(Limit::Min);
+      state.max = parameter.limit(Limit::Max);
+   }
+
+   applyState(state);
+}
 
-   int is_read_only = camera->isParameterReadOnly(control);
+void ParameterWidget::applyState(const ParameterState& state)
+{
+   if (obj == NULL)
+      return;
+
+   int is_read_only = parameter.isReadOnly();
 
    setControlLock(false);
 
-   QVariant value = camera->getParameter(control, type);
+   const QVariant& value = state.value;
 
    if (type == Integer)
    {
-      int value_min = camera->getParameterLimit(control, type, Limit::Min).toInt();
-      int value_max = camera->getParameterLimit(control, type, Limit::Max).toInt();
+      int value_min = state.min.toInt();
+      int value_max = state.max.toInt();
 
       QSpinBox* spinbox = static_cast<QSpinBox*>(obj);
       spinbox->setMinimum(value_min);
@@ -212,8 +230,8 @@ void ParameterWidget::setWidgetValue()
    }
    else if (type == Float)
    {
-      double value_min = camera->getParameterLimit(control, type, Limit::Min).toDouble();
-      double value_max = camera->getParameterLimit(control, type, Limit::Max).toDouble();
+      double value_min = state.min.toDouble();
+      double value_max = state.max.toDouble();
 
       QDoubleSpinBox* spinbox = static_cast<QDoubleSpinBox*>(obj);
       spinbox->setMinimum(value_min);
@@ -239,7 +257,7 @@ void ParameterWidget::setWidgetValue()
    }
    else if (type == Enumeration)
    {
-      EnumerationList list = camera->getEnumerationList(control);      
+      EnumerationList list = parameter.enumerationList();      
       QComboBox* combobox = static_cast<QComboBox*>(obj);
 
       // suppress signals while we're updating box
@@ -264,7 +282,7 @@ void ParameterWidget::setWidgetValue()
 
 void ParameterWidget::limitClicked(Limit limit)
 {
-   proposed_value = camera->getParameterLimit(control, type, limit);
+   proposed_value = parameter.limit(limit);
    sendValueToCamera();
 }
 
@@ -279,37 +297,27 @@ void ParameterWidget::widgetUpdated(QVariant value)
    // Instead use timer to set value after a short delay
    value_timer->stop();
    value_timer->start();
-
-   // stop update timer
-   if (use_timer)
-      timer->stop();
 }
 
 void ParameterWidget::sendValueToCamera()
 {
-   {
-      QMutexLocker lk(mutex);
-      if (!camera->isParameterWritable(control)) return;
+   if (!parameter.isWritable()) return;
 
-      try
-      {
-         std::cout << "Setting parameter: " << control.toStdString() << " = " << proposed_value.toString().toStdString() << "\n";
-         camera->setParameter(control, type, proposed_value);
-      }
-      catch (std::exception e)
-      {
-         // In case of error setting value get current value from camera
-         std::cout << "Error setting parameter: " << e.what() << "\n";
-         setWidgetValue();
-      }
+   try
+   {
+      std::cout << "Setting parameter: " << control.toStdString() << " = " << proposed_value.toString().toStdString() << "\n";
+      parameter.set(proposed_value);
+   }
+   catch (std::exception e)
+   {
+      // In case of error setting value get current value from camera
+      std::cout << "Error setting parameter: " << e.what() << "\n";
+      setWidgetValue();
+   }
 
-      QVariant actual_value = camera->getParameter(control, type);
-      settings->setValue(control, actual_value);
+   QVariant actual_value = parameter.get();
+   settings->setValue(control, actual_value);
 
-      // restart update timer
-      if (use_timer && !timer->isActive())
-         timer->start();
-   }
    emit valueChanged();
 }
 
@@ -14,21 +14,17 @@
 #include <QList>
 #include <QSettings>
 
-class WidgetEvent : public QEvent
-{
-public:
-   static const QEvent::Type ValueUpdated = static_cast<QEvent::Type>(QEvent::User);
-   WidgetEvent() : QEvent(ValueUpdated) {};
-   ~WidgetEvent() {};
-};
-
 class ParameterWidget : public QObject
 {
    Q_OBJECT
 
 public:
-   ParameterWidget(ParametricImageSource* camera, QFormLayout* parent, const QString& control, ParameterType type, const QString& suffix = "", bool use_timer = false, bool auto_init = true);
-   virtual ~ParameterWidget() {};
+   /*
+      Changes to the parameter are pushed by the camera. Set poll for values
+      the camera can change without reporting it, e.g. under auto exposure
+   */
+   ParameterWidget(ParametricImageSource* camera, QFormLayout* parent, const QString& control, ParameterType type, const QString& suffix = "", bool poll = false, bool auto_init = true);
+   virtual ~ParameterWidget();
    
    void setControlLock(bool locked);
    void setWidgetValue();
@@ -40,7 +36,6 @@ signals:
 protected:
 
    void init();
-   bool event(QEvent *event);
 
 protected:
    QString control;
@@ -50,6 +45,9 @@ private:
 
    bool createWidget();
 
+   void parametersChanged(const ParameterChanges& changes);
+   void applyState(const ParameterState& state);
+
    void widgetUpdated(QVariant value);
    void boolWidgetUpdated(bool value);
    void intWidgetUpdated(int value);
@@ -69,14 +67,13 @@ private:
    QPushButton* min_btn;
    QPushButton* max_btn;
 
-   QTimer* timer;
    QTimer* value_timer;
    ParametricImageSource* camera;
+   ParameterHandle parameter; // resolved once, so updates don't look up the name
 
    int is_implemented;
-   bool use_timer;
+   bool poll;
+   bool is_watching = false;
 
    QSettings* settings;
-
-   QMutex* mutex;
 };
@@ -0,0 +1,103 @@
+#include "StatisticsPlotWidget.h"
+
+#include <QPainter>
+#include <QPolygonF>
+
+#include <algorithm>
+
+StatisticsPlotWidget::StatisticsPlotWidget(QWidget* parent) :
+   QWidget(parent)
+{
+   setMinimumSize(300, 150);
+}
+
+void StatisticsPlotWidget::SetStatistics(FrameStatistics* statistics_)
+{
+   disconnect(update_connection);
+
+   statistics = statistics_;
+   if (statistics != nullptr)
+      update_connection = connect(statistics, &FrameStatistics::StatisticsUpdated, this, static_cast<void (QWidget::*)()>(&QWidget::update), Qt::QueuedConnection);
+
+   update();
+}
+
+void StatisticsPlotWidget::SetQuantity(Quantity quantity_, int roi_index_)
+{
+   quantity = quantity_;
+   roi_index = roi_index_;
+   update();
+}
+
+bool StatisticsPlotWidget::GetValue(const FrameStats& stats, double& value)
+{
+   switch (quantity)
+   {
+   case Mean: value = stats.mean; return true;
+   case Std: value = stats.std; return true;
+   case Min: value = stats.min; return true;
+   case Max: value = stats.max; return true;
+   case Saturated: value = (double) stats.n_saturated; return true;
+   case RoiSum:
+      if (roi_index < 0 || roi_index >= (int) stats.roi_sums.size())
+         return false;
+      value = stats.roi_sums[roi_index];
+      return true;
+   }
+   return false;
+}
+
+void StatisticsPlotWidget::paintEvent(QPaintEvent* event)
+{
+   QPainter painter(this);
+   painter.fillRect(rect(), Qt::black);
+
+   if (statistics == nullptr)
+      return;
+
+   std::vector<FrameStats> history = statistics->GetHistory();
+
+   std::vector<QPointF> points;
+   points.reserve(history.size());
+   for (auto& stats : history)
+   {
+      double value;
+      if (GetValue(stats, value))
+         points.push_back(QPointF(stats.timestamp_us * 1e-6, value));
+   }
+
+   if (points.size() < 2)
+      return;
+
+   double t0 = points.front().x(), t1 = points.back().x();
+   double v0 = points[0].y(), v1 = points[0].y();
+   for (auto& p : points)
+   {
+      v0 = std::min(v0, p.y());
+      v1 = std::max(v1, p.y());
+   }
+   if (v1 == v0)
+      v1 = v0 + 1;
+   if (t1 == t0)
+      t1 = t0 + 1;
+
+   const int margin = 20;
+   QRectF plot_rect = QRectF(rect()).adjusted(margin, margin / 2, -margin / 2, -margin);
+
+   QPolygonF line;
+   for (auto& p : points)
+   {
+      double x = plot_rect.left() + plot_rect.width() * (p.x() - t0) / (t1 - t0);
+      double y = plot_rect.bottom() - plot_rect.height() * (p.y() - v0) / (v1 - v0);
+      line.append(QPointF(x, y));
+   }
+
+   painter.setRenderHint(QPainter::Antialiasing);
+   painter.setPen(QPen(Qt::green, 1));
+   painter.drawPolyline(line);
+
+   painter.setPen(Qt::white);
+   painter.drawText(QPointF(2, margin / 2 + 10), QString::number(v1, 'g', 5));
+   painter.drawText(QPointF(2, height() - margin), QString::number(v0, 'g', 5));
+   painter.drawText(QPointF(plot_rect.right() - 60, height() - 4), QString("%1 s").arg(t1 - t0, 0, 'f', 1));
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QWidget>
+#include <QPaintEvent>
+
+#include "FrameStatistics.h"
+
+/*
+   Plots a quantity from the FrameStatistics history against time.
+   Repaints are requested when new statistics arrive and coalesced by Qt,
+   so the plot never redraws faster than the GUI can manage.
+*/
+class StatisticsPlotWidget : public QWidget
+{
+   Q_OBJECT
+
+public:
+
+   enum Quantity { Mean, Std, Min, Max, Saturated, RoiSum };
+
+   StatisticsPlotWidget(QWidget* parent = 0);
+
+   void SetStatistics(FrameStatistics* statistics);
+
+   // For RoiSum, roi_index selects the ROI
+   void SetQuantity(Quantity quantity_, int roi_index_ = 0);
+
+protected:
+
+   void paintEvent(QPaintEvent* event);
+
+private:
+
+   bool GetValue(const FrameStats& stats, double& value);
+
+   FrameStatistics* statistics = nullptr;
+   QMetaObject::Connection update_connection;
+
+   Quantity quantity = Mean;
+   int roi_index = 0;
+};